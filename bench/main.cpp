@@ -0,0 +1,322 @@
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "DNS.h"
+#include "Rdata.h"
+
+// Every global allocation is counted, so each benchmark can report allocations per packet
+// alongside its time.
+namespace {
+    size_t allocationCount = 0;
+}
+
+void* operator new(size_t size) {
+    allocationCount++;
+    if (auto memory = malloc(size == 0 ? 1 : size)) {
+        return memory;
+    }
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept {
+    free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+    free(memory);
+}
+
+// std::pmr::new_delete_resource allocates through the aligned forms.
+void* operator new(size_t size, std::align_val_t alignment) {
+    allocationCount++;
+    const auto align = (size_t)alignment;
+    if (auto memory = aligned_alloc(align, (size + align - 1) / align * align)) {
+        return memory;
+    }
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory, std::align_val_t) noexcept {
+    free(memory);
+}
+
+void operator delete(void* memory, size_t, std::align_val_t) noexcept {
+    free(memory);
+}
+
+namespace {
+    using namespace DNice;
+
+    struct CorpusEntry {
+        const char* name;
+        std::vector<uint8_t> bytes;
+        // Where a compressed owner name sits, for the label benchmarks, or 0 if none does.
+        size_t pointerOffset;
+    };
+
+    Packet makeQuery(const char* name, Type qtype) {
+        Packet packet;
+        packet.id = 0x1234;
+        packet.recursionDesired = true;
+
+        Question question;
+        question.label.domainName.assign(name);
+        question.qtype = qtype;
+        packet.questions.push_back(question);
+        return packet;
+    }
+
+    Resource makeResource(const char* name, Type rtype, uint32_t ttl) {
+        Resource resource;
+        resource.label.domainName.assign(name);
+        resource.rtype = rtype;
+        resource.ttl = ttl;
+        return resource;
+    }
+
+    // A response with an answer, authority and additional section of the shape recursive
+    // resolvers see from large zones. Every owner name repeats the question, so it compresses.
+    Packet makeLargeResponse() {
+        auto packet = makeQuery("www.example.com", Type::A);
+        packet.isResponse = true;
+        packet.recursionAvailable = true;
+
+        auto alias = makeResource("www.example.com", Type::CNAME, 300);
+        NameRdata target;
+        target.name.assign("edge.cdn.example.com");
+        encodeRdata(target, alias);
+        packet.answers.push_back(alias);
+
+        for (uint8_t i = 0; i < 16; i++) {
+            auto address = makeResource("edge.cdn.example.com", Type::A, 60);
+            const uint8_t ip[] = { 192, 0, 2, (uint8_t)(10 + i) };
+            encodeRdata(AddressRdata { ip, sizeof(ip) }, address);
+            packet.answers.push_back(address);
+        }
+
+        for (int i = 0; i < 4; i++) {
+            auto server = makeResource("example.com", Type::NS, 86400);
+            NameRdata ns;
+            ns.name.assign(("ns" + std::to_string(i + 1) + ".example.com").c_str());
+            encodeRdata(ns, server);
+            packet.authorities.push_back(server);
+
+            auto glue = makeResource(("ns" + std::to_string(i + 1) + ".example.com").c_str(), Type::A, 86400);
+            const uint8_t ip[] = { 198, 51, 100, (uint8_t)(i + 1) };
+            encodeRdata(AddressRdata { ip, sizeof(ip) }, glue);
+            packet.additionalRecords.push_back(glue);
+        }
+
+        return packet;
+    }
+
+    // A query carrying an EDNS(0) OPT record advertising a 1232 byte payload and a cookie.
+    Packet makeEdnsQuery() {
+        auto packet = makeQuery("www.example.com", Type::AAAA);
+
+        auto opt = makeResource("", Type::OPT, 0);
+        opt.rclass = (Class)1232;
+        // COOKIE option (RFC 7873): code 10, an 8 byte client cookie.
+        opt.data = { 0, 10, 0, 8, 1, 2, 3, 4, 5, 6, 7, 8 };
+        opt.length = (uint16_t)opt.data.size();
+        packet.additionalRecords.push_back(opt);
+        return packet;
+    }
+
+    // SPF and verification records, as returned for a TXT query on a busy mail domain.
+    Packet makeTxtResponse() {
+        auto packet = makeQuery("example.com", Type::TXT);
+        packet.isResponse = true;
+
+        const char* texts[] = {
+            "v=spf1 ip4:192.0.2.0/24 ip4:198.51.100.0/24 include:_spf.mail.example.net include:_spf.relay.example.org ~all",
+            "google-site-verification=4ibFUgB-wXLQ_S7vsXVomSTVamuOXBiVAzpR5IZ87D0",
+            "MS=ms12345678",
+            "apple-domain-verification=Ab1Cd2Ef3Gh4Ij5K",
+            "docusign=05958488-4752-4ef2-95eb-aa7ba8a3bd0e",
+            "facebook-domain-verification=abcdefghijklmnopqrstuvwxyz0123",
+        };
+
+        for (const auto text : texts) {
+            auto record = makeResource("example.com", Type::TXT, 3600);
+            TxtRdata rdata;
+            rdata.strings.push_back(text);
+            encodeRdata(rdata, record);
+            packet.answers.push_back(record);
+        }
+
+        return packet;
+    }
+
+    CorpusEntry makeEntry(const char* name, const Packet& packet) {
+        CorpusEntry entry { name, {}, 0 };
+        serializeDnsPacket(packet, entry.bytes);
+
+        // The first answer's owner name follows the question, and is a pointer back to it.
+        if (!packet.answers.empty()) {
+            Question question;
+            size_t index = DNS_HEADER_SIZE;
+            parseQuestion(entry.bytes, index, question);
+            entry.pointerOffset = index;
+        }
+
+        return entry;
+    }
+
+    const std::vector<CorpusEntry>& corpus() {
+        static const std::vector<CorpusEntry> entries = {
+            makeEntry("small query", makeQuery("www.example.com", Type::A)),
+            makeEntry("large compressed response", makeLargeResponse()),
+            makeEntry("EDNS0 query", makeEdnsQuery()),
+            makeEntry("TXT-heavy response", makeTxtResponse()),
+        };
+
+        return entries;
+    }
+
+    // bytes is how much of the packet one iteration reads, for the benchmarks that only handle
+    // part of it.
+    void reportPerPacket(benchmark::State& state, const CorpusEntry& entry, size_t allocations, size_t bytes = 0) {
+        state.SetLabel(entry.name);
+        state.SetItemsProcessed(state.iterations());
+        state.SetBytesProcessed(state.iterations() * (int64_t)(bytes != 0 ? bytes : entry.bytes.size()));
+        state.counters["allocs/packet"] = benchmark::Counter((double)allocations, benchmark::Counter::kAvgIterations);
+    }
+
+    void parsePacket(benchmark::State& state) {
+        const auto& entry = corpus()[state.range(0)];
+        Packet packet;
+
+        const auto before = allocationCount;
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(parseDnsPacket(entry.bytes, packet));
+        }
+
+        reportPerPacket(state, entry, allocationCount - before);
+    }
+
+    // As the worker does it: every packet is parsed into an arena rewound between packets.
+    void parsePacketArena(benchmark::State& state) {
+        const auto& entry = corpus()[state.range(0)];
+        std::vector<uint8_t> arenaBuffer(64 * 1024);
+        std::pmr::monotonic_buffer_resource arena(arenaBuffer.data(), arenaBuffer.size());
+
+        const auto before = allocationCount;
+        for (auto _ : state) {
+            {
+                Packet packet(&arena);
+                benchmark::DoNotOptimize(parseDnsPacket(entry.bytes, packet));
+            }
+
+            arena.release();
+        }
+
+        reportPerPacket(state, entry, allocationCount - before);
+    }
+
+    void serializePacketVector(benchmark::State& state) {
+        const auto& entry = corpus()[state.range(0)];
+        Packet packet;
+        parseDnsPacket(entry.bytes, packet);
+
+        std::vector<uint8_t> bytes;
+        const auto before = allocationCount;
+        for (auto _ : state) {
+            bytes.clear();
+            benchmark::DoNotOptimize(serializeDnsPacket(packet, bytes));
+        }
+
+        reportPerPacket(state, entry, allocationCount - before);
+    }
+
+    void serializePacketBuffer(benchmark::State& state) {
+        const auto& entry = corpus()[state.range(0)];
+        Packet packet;
+        parseDnsPacket(entry.bytes, packet);
+
+        std::vector<uint8_t> buffer(65535);
+        size_t length = 0;
+        const auto before = allocationCount;
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(serializeDnsPacket(packet, buffer.data(), buffer.size(), length));
+        }
+
+        reportPerPacket(state, entry, allocationCount - before);
+    }
+
+    void parseQuestionLabel(benchmark::State& state) {
+        const auto& entry = corpus()[state.range(0)];
+        Label label;
+        size_t index = DNS_HEADER_SIZE;
+
+        const auto before = allocationCount;
+        for (auto _ : state) {
+            index = DNS_HEADER_SIZE;
+            benchmark::DoNotOptimize(parseLabel(entry.bytes, index, label));
+        }
+
+        reportPerPacket(state, entry, allocationCount - before, index - DNS_HEADER_SIZE);
+    }
+
+    void resolvePointerLabel(benchmark::State& state) {
+        const auto& entry = corpus()[state.range(0)];
+        Label label;
+        size_t index = entry.pointerOffset;
+        parseLabel(entry.bytes, index, label);
+
+        const auto before = allocationCount;
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(resolveLabel(entry.bytes, label));
+        }
+
+        reportPerPacket(state, entry, allocationCount - before, resolveLabel(entry.bytes, label).wireLength());
+    }
+
+    void resolvePointerLabelMemo(benchmark::State& state) {
+        const auto& entry = corpus()[state.range(0)];
+        Label label;
+        size_t index = entry.pointerOffset;
+        parseLabel(entry.bytes, index, label);
+
+        NameMemo memo;
+        const auto name = resolveLabel(entry.bytes, label, &memo);
+
+        const auto before = allocationCount;
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(resolveLabel(entry.bytes, label, &memo));
+        }
+
+        reportPerPacket(state, entry, allocationCount - before, name.wireLength());
+    }
+
+    void corpusArguments(benchmark::internal::Benchmark* benchmark) {
+        for (size_t i = 0; i < corpus().size(); i++) {
+            benchmark->Arg((int64_t)i);
+        }
+    }
+
+    // The entries with an owner name compressed to a pointer.
+    void pointerCorpusArguments(benchmark::internal::Benchmark* benchmark) {
+        for (size_t i = 0; i < corpus().size(); i++) {
+            if (corpus()[i].pointerOffset != 0) {
+                benchmark->Arg((int64_t)i);
+            }
+        }
+    }
+}
+
+BENCHMARK(parsePacket)->Apply(corpusArguments);
+BENCHMARK(parsePacketArena)->Apply(corpusArguments);
+BENCHMARK(serializePacketVector)->Apply(corpusArguments);
+BENCHMARK(serializePacketBuffer)->Apply(corpusArguments);
+BENCHMARK(parseQuestionLabel)->Apply(corpusArguments);
+BENCHMARK(resolvePointerLabel)->Apply(pointerCorpusArguments);
+BENCHMARK(resolvePointerLabelMemo)->Apply(pointerCorpusArguments);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "DNS.h"
+#include "Edns.h"
+#include "PacketView.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace DNice {
+    // Serialized responses from the policy script, kept for the smallest TTL among their
+    // records so a repeated question is answered without entering JS. Each entry is a wire
+    // template: a hit copies it and patches the id, the question's spelling and the TTLs at
+    // offsets found when it was stored, with no parsing or serializing.
+    //
+    // Each worker owns its own cache. Workers are already sharded by SO_REUSEPORT and never
+    // share state, so lookups and inserts take no locks and touch no shared cache lines.
+    class AnswerCache {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        // The question and the flags that change the answer. The name compares and hashes
+        // case-insensitively.
+        struct Key {
+            DomainName name;
+            Type qtype = Type::A;
+            Class qclass = Class::IN;
+            // The script is shown RD and CD and may answer differently for them, so they are
+            // part of the key rather than patched into a shared template.
+            bool recursionDesired = false;
+            bool checkingDisabled = false;
+            // Whether the query had an OPT record, and its DO bit. Both decide what OPT record,
+            // if any, the response carries.
+            bool edns = false;
+            bool dnssecOk = false;
+
+            bool operator==(const Key& other) const;
+        };
+
+        struct KeyHash {
+            size_t operator()(const Key& key) const;
+        };
+
+        // Holds at most capacity responses. Zero disables the cache.
+        explicit AnswerCache(size_t capacity);
+
+        bool enabled() const { return capacity > 0; }
+
+        // Builds the lookup key for a query from its only question and the flags that change
+        // the answer. edns is the query's OPT record, or null if it had none. Returns false for
+        // queries that are never cached. Only the header and the question are read, so the
+        // query does not need to be indexed.
+        bool makeKey(const PacketView& query, const Edns* edns, Key& key) const;
+
+        // Copies a live response for query, whose key is key, into out with the query's id and
+        // the question name spelled as the query spelled it. Expired entries are dropped when
+        // they are found. Responses longer than maxLength, cached from a TCP query, are not
+        // returned, so the query is answered afresh and truncated to fit.
+        bool find(const PacketView& query, const Key& key, Clock::time_point now, size_t maxLength, std::vector<uint8_t>& out);
+
+        // Remembers response, whose serialized form is bytes, if it is worth caching.
+        void insert(const Key& key, const Packet& response, const std::vector<uint8_t>& bytes, Clock::time_point now);
+
+        size_t size() const { return entries.size(); }
+
+    private:
+        struct Entry {
+            std::vector<uint8_t> response;
+            // Where each record's TTL field is in response.
+            std::vector<uint16_t> ttlOffsets;
+            Clock::time_point stored;
+            Clock::time_point expires;
+        };
+
+        void evict(Clock::time_point now);
+
+        size_t capacity;
+        std::unordered_map<Key, Entry, KeyHash> entries;
+        // Scratch space for insert(), kept to avoid allocating for every candidate.
+        std::vector<uint16_t> ttlOffsets;
+    };
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace DNice {
+    // Compiled script bytecode (from duk_dump_function) persisted to a directory so restarts
+    // skip compilation. Entries are keyed by a hash of the source, its file name, the Duktape
+    // version and the build's config options and layout, since bytecode is only loadable by the
+    // Duktape build that dumped it.
+    class BytecodeCache {
+    public:
+        explicit BytecodeCache(const std::string& directory);
+
+        static uint64_t key(const std::string& source, const std::string& fileName);
+
+        // Returns false on a miss or if the cached entry is unreadable or stale.
+        bool load(uint64_t key, std::vector<uint8_t>& bytecode) const;
+        bool store(uint64_t key, const std::vector<uint8_t>& bytecode, std::string& error) const;
+
+    private:
+        std::string pathFor(uint64_t key) const;
+
+        std::string directory;
+    };
+}
@@ -0,0 +1,342 @@
+#pragma once
+
+#include "DomainName.h"
+
+#include <cstdint>
+#include <cstring>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+namespace DNice {
+    // The first two bits of a label length byte being set marks a compression pointer.
+    const uint8_t LABEL_POINTER_FLAGS = 0xC0;
+    const uint16_t MAX_POINTER_ADDRESS = 0x3FFF;
+    const size_t DNS_HEADER_SIZE = 12;
+    // Compression pointers may only chain this many times before a name is considered malformed.
+    const int MAX_POINTER_HOPS = 64;
+
+    // Why a message could not be parsed or serialized.
+    enum class DnsError : uint8_t {
+        None = 0,
+        // A length or count points past the end of the message.
+        Truncated,
+        // A label length byte uses the reserved 0x40 or 0x80 types.
+        BadLabelType,
+        // A compression pointer that does not point back into the message.
+        BadPointer,
+        // A name that chains through more than MAX_POINTER_HOPS compression pointers.
+        TooManyPointers,
+        LabelTooLong,
+        NameTooLong,
+        // A name with an empty label in the middle, like "a..b".
+        EmptyLabel,
+        // A resource whose length field does not match its data.
+        DataLengthMismatch,
+        // Record data that does not have the layout its type requires.
+        BadRdata,
+        // Record data decoded as a type other than the record's own.
+        TypeMismatch,
+        // An output buffer too small for even the header and questions.
+        BufferTooSmall,
+        // More than one OPT record, or one outside the additional section or not owned by the root.
+        BadOpt,
+    };
+
+    const char* describeError(DnsError error);
+
+    enum class Type : uint16_t {
+        A = 1,
+        NS = 2,
+        CNAME = 5,
+        SOA = 6,
+        PTR = 12,
+        MX = 15,
+        TXT = 16,
+        AAAA = 28,
+        SRV = 33,
+        OPT = 41,
+        ANY = 255,
+    };
+
+    enum class Class : uint16_t {
+        IN = 1,
+        CS = 2,
+        CH = 3,
+        HS = 4,
+        ANY = 255,
+    };
+
+    enum class Opcode : uint8_t {
+        Query = 0,
+        InverseQuery = 1,
+        Status = 2,
+        Notify = 4,
+        Update = 5,
+    };
+
+    enum class ResponseCode : uint8_t {
+        NoError = 0,
+        FormatError = 1,
+        ServerFailure = 2,
+        NameError = 3,
+        NotImplemented = 4,
+        Refused = 5,
+    };
+
+    struct Label {
+        bool isPointer = false;
+        uint16_t pointerAddress = 0;
+        DomainName domainName;
+    };
+
+    struct Question {
+        Label label;
+        Type qtype = Type::A;
+        Class qclass = Class::IN;
+    };
+
+    // Resources are allocator-aware, so when one is created inside a Packet's section its data
+    // comes from the same memory resource as the Packet.
+    struct Resource {
+        using allocator_type = std::pmr::polymorphic_allocator<uint8_t>;
+
+        Resource() = default;
+        explicit Resource(const allocator_type& allocator) : data(allocator) {}
+        Resource(const Resource& other) = default;
+        Resource(Resource&& other) = default;
+        Resource(const Resource& other, const allocator_type& allocator);
+        Resource(Resource&& other, const allocator_type& allocator);
+        Resource& operator=(const Resource& other) = default;
+        Resource& operator=(Resource&& other) = default;
+
+        Label label;
+        Type rtype = Type::A;
+        Class rclass = Class::IN;
+        uint32_t ttl = 0;
+        uint16_t length = 0;
+        std::pmr::vector<uint8_t> data;
+    };
+
+    // Every container in a Packet, down to each record's data, allocates from the memory
+    // resource it was created with. Building one over an arena that is rewound between
+    // messages keeps the global heap out of the query path.
+    struct Packet {
+        explicit Packet(std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+        uint16_t id = 0;
+
+        bool isResponse = false;
+        Opcode opcode = Opcode::Query;
+        bool isAuthoritative = false;
+        bool isTruncated = false;
+        bool recursionDesired = false;
+        bool recursionAvailable = false;
+        bool zBit = false;
+        bool isAuthenticData = false;
+        bool checkingDisabled = false;
+        ResponseCode responseCode = ResponseCode::NoError;
+
+        std::pmr::vector<Question> questions;
+        std::pmr::vector<Resource> answers;
+        std::pmr::vector<Resource> authorities;
+        std::pmr::vector<Resource> additionalRecords;
+    };
+
+    // Reads a big-endian value of type T starting at index.
+    template <typename T>
+    T getValue(const uint8_t* bytes, size_t index) {
+        T value = 0;
+        for (size_t i = 0; i < sizeof(T); i++) {
+            value = (T)((value << 8) | bytes[index + i]);
+        }
+
+        return value;
+    }
+
+    template <typename T, typename TAllocator>
+    T getValue(const std::vector<uint8_t, TAllocator>& bytes, size_t index) {
+        return getValue<T>(bytes.data(), index);
+    }
+
+    // Appends value to receiver in network (big-endian) byte order.
+    template <typename T, typename TAllocator, typename = typename std::enable_if<std::is_integral<T>::value>::type>
+    void pushValue(std::vector<uint8_t, TAllocator>& receiver, T value) {
+        for (size_t i = sizeof(T); i > 0; i--) {
+            receiver.push_back((uint8_t)(value >> ((i - 1) * 8)));
+        }
+    }
+
+    template <typename TAllocator, typename TValueAllocator>
+    void pushValue(std::vector<uint8_t, TAllocator>& receiver, const std::vector<uint8_t, TValueAllocator>& value) {
+        receiver.insert(receiver.end(), value.begin(), value.end());
+    }
+
+    // The fixed-capacity buffer the serializers write into. Bytes past the end are dropped but
+    // still counted, so a serializer runs to completion without checking each write, and the
+    // caller learns from size() how much room the message needed.
+    class WireWriter {
+    public:
+        WireWriter(uint8_t* buffer, size_t capacity) : buffer(buffer), capacity(capacity) {}
+
+        // Bytes written so far, including any that did not fit.
+        size_t size() const { return position; }
+        bool overflowed() const { return position > capacity; }
+
+        void push_back(uint8_t value) {
+            if (position < capacity) {
+                buffer[position] = value;
+            }
+
+            position++;
+        }
+
+        void append(const void* data, size_t length) {
+            if (position + length <= capacity) {
+                memcpy(buffer + position, data, length);
+            }
+
+            position += length;
+        }
+
+        // Overwrites two bytes already written, as for a length only known afterwards.
+        void setValue(size_t offset, uint16_t value) {
+            if (offset + 2 <= capacity) {
+                buffer[offset] = (uint8_t)(value >> 8);
+                buffer[offset + 1] = (uint8_t)(value & 0xff);
+            }
+        }
+
+        // Forgets everything written from offset onwards.
+        void rewind(size_t offset) { position = offset; }
+
+    private:
+        uint8_t* buffer;
+        size_t capacity;
+        size_t position = 0;
+    };
+
+    template <typename T, typename = typename std::enable_if<std::is_integral<T>::value>::type>
+    void pushValue(WireWriter& receiver, T value) {
+        for (size_t i = sizeof(T); i > 0; i--) {
+            receiver.push_back((uint8_t)(value >> ((i - 1) * 8)));
+        }
+    }
+
+    bool getFlag(uint8_t byte, uint8_t index);
+    void setFlag(uint8_t& byte, uint8_t index, bool value);
+
+    // Parses count consecutive items starting at index, leaving index just past the last one.
+    // Items are parsed in place so they allocate from the receiver's memory resource.
+    template <typename T, typename TParser>
+    DnsError collectResources(
+        std::pmr::vector<T>& receiver,
+        TParser parser,
+        const std::vector<uint8_t>& bytes,
+        size_t& index,
+        uint16_t count
+    ) {
+        for (uint16_t i = 0; i < count; i++) {
+            const auto error = parser(bytes, index, receiver.emplace_back());
+            if (error != DnsError::None) {
+                receiver.pop_back();
+                return error;
+            }
+        }
+
+        return DnsError::None;
+    }
+
+    // Offsets of name suffixes already written to a packet, keyed by their wire form, so
+    // repeats can be emitted as RFC 1035 compression pointers. Keys view into the names being
+    // serialized, so a table must not outlive the Packet it was filled from.
+    //
+    // The table is a fixed array so serializing never allocates. Once it is full, further
+    // suffixes are written out in full rather than remembered, which costs space but not
+    // correctness; a response that fits in a UDP datagram comes nowhere near the limit.
+    struct NameCompressionTable {
+        static const size_t MAX_SUFFIXES = 128;
+
+        struct Entry {
+            std::string_view suffix;
+            uint16_t offset = 0;
+        };
+
+        bool find(std::string_view suffix, uint16_t& offset) const;
+        void add(std::string_view suffix, uint16_t offset);
+
+        size_t packetStart = 0;
+        size_t count = 0;
+        Entry suffixes[MAX_SUFFIXES];
+    };
+
+    // Dotted names already decoded from one message, keyed by the offset they start at, so a
+    // suffix shared by many compressed names is decoded once however often it is pointed to.
+    // Only valid for the message it was filled from.
+    //
+    // Like NameCompressionTable this is a fixed array, so parsing a message never allocates for
+    // it. Once it is full further names are decoded each time they are pointed to; a message
+    // rarely points at more than a handful of distinct offsets.
+    struct NameMemo {
+        static const size_t MAX_NAMES = 16;
+
+        struct Entry {
+            // Left unconstructed until the entry is added, since a memo is made for every
+            // message parsed and most never fill more than one or two entries.
+            Entry() {}
+
+            uint16_t address;
+            // Pointers followed to decode it, so hits count against MAX_POINTER_HOPS too.
+            int pointers;
+            // Never destroyed, which is only sound while that does nothing.
+            static_assert(std::is_trivially_destructible<DomainName>::value, "NameMemo entries are never destroyed");
+            union {
+                DomainName name;
+            };
+        };
+
+        const Entry* find(uint16_t address) const;
+        void add(uint16_t address, const DomainName& name, int pointers);
+
+        size_t count = 0;
+        Entry names[MAX_NAMES];
+    };
+
+    // The parsers read the item at index, check every length against the end of bytes before
+    // reading it, and on success leave index just past the item. On failure nothing past the
+    // end of bytes has been read and index is unspecified.
+    // Pointers are resolved through memo when one is given. parseLabel leaves a name that is
+    // nothing but a pointer as that pointer; parseQuestion and parseResource follow it too, so
+    // like the record data their results never refer back into bytes.
+    DnsError parseLabel(const std::vector<uint8_t>& bytes, size_t& index, Label& label, NameMemo* memo = nullptr);
+    DnsError parseQuestion(const std::vector<uint8_t>& bytes, size_t& index, Question& question, NameMemo* memo = nullptr);
+    DnsError parseResource(const std::vector<uint8_t>& bytes, size_t& index, Resource& resource, NameMemo* memo = nullptr);
+    // Decodes the name at index among the size bytes at bytes into name, following pointers by
+    // the same rules as parseLabel. PacketView reads names through this as well, so both
+    // readers accept exactly the same names.
+    DnsError decodeDomainName(const uint8_t* bytes, size_t size, size_t index, DomainName& name, NameMemo* memo = nullptr);
+
+    // The serializers append to bytes. On failure bytes may hold part of the item.
+    DnsError serializeLabel(WireWriter& bytes, const Label& label, NameCompressionTable* compression = nullptr);
+    // Writes name, whose wire form is also found at wire. Compression keys view into wire rather
+    // than name, so name may be a temporary as long as wire outlives the table.
+    DnsError serializeName(WireWriter& bytes, const DomainName& name, const uint8_t* wire, NameCompressionTable* compression = nullptr);
+    DnsError serializeQuestion(WireWriter& bytes, const Question& question, NameCompressionTable* compression = nullptr);
+    DnsError serializeResource(WireWriter& bytes, const Resource& resource, NameCompressionTable* compression = nullptr);
+
+    DnsError parseDnsPacket(const std::vector<uint8_t>& rawPacket, Packet& outPacket);
+    // Serializes packet, compressing repeated owner names into pointers to their first occurrence.
+    DnsError serializeDnsPacket(const Packet& packet, std::vector<uint8_t>& outRawPacket);
+    // Serializes packet into the capacity bytes at buffer without allocating. A message too big
+    // for the buffer, which should be sized to what the client accepts, is cut back to its
+    // header, questions and OPT record with TC set so the client retries over TCP.
+    DnsError serializeDnsPacket(const Packet& packet, uint8_t* buffer, size_t capacity, size_t& outLength);
+
+    // Follows label pointers within rawPacket until a literal domain name is found. Returns the
+    // root if rawPacket is malformed.
+    DomainName resolveLabel(const std::vector<uint8_t>& rawPacket, const Label& label, NameMemo* memo = nullptr);
+    // As above, but says why a pointer could not be followed instead of giving the root.
+    DnsError resolveLabel(const std::vector<uint8_t>& rawPacket, const Label& label, DomainName& name, NameMemo* memo = nullptr);
+}
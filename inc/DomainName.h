@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+
+namespace DNice {
+    enum class DnsError : uint8_t;
+
+    // A domain name held as uncompressed wire-format labels in an inline buffer, so building
+    // one never allocates. Names compare case-insensitively (RFC 4343). The hash that goes with
+    // that is kept up to date as labels are appended, so a lookup never has to re-read or
+    // lowercase the name, and unequal names almost always differ at the first check.
+    class DomainName {
+    public:
+        // Wire bytes including the terminating root label.
+        static const size_t MAX_WIRE_LENGTH = 255;
+        static const size_t MAX_LABEL_LENGTH = 63;
+        // Every label takes at least two bytes.
+        static const size_t MAX_LABELS = (MAX_WIRE_LENGTH - 1) / 2;
+
+        // The root name.
+        DomainName();
+
+        // Replaces the name with one in dotted form. A trailing dot is optional, and "" and "."
+        // are the root. On failure the name is left as the root.
+        DnsError assign(std::string_view dotted);
+
+        void clear();
+
+        // Appends one label to the end of the name.
+        DnsError appendLabel(const uint8_t* label, size_t length);
+        // Appends every label of suffix.
+        DnsError append(const DomainName& suffix);
+
+        bool isRoot() const { return labels == 0; }
+        size_t labelCount() const { return labels; }
+        std::string_view label(size_t index) const;
+
+        // The name in wire format, ending in the root label.
+        const uint8_t* wire() const { return bytes; }
+        size_t wireLength() const { return size + 1; }
+        // The wire form of the name with its first index labels removed, root label included.
+        std::string_view wireSuffix(size_t index) const;
+
+        // Case-insensitive hash of the name.
+        size_t hash() const { return nameHash; }
+
+        // Dotted form, without a trailing dot. The root is empty.
+        std::string toString() const;
+        void appendTo(std::string& out) const;
+
+        bool operator==(const DomainName& other) const;
+        bool operator!=(const DomainName& other) const { return !(*this == other); }
+
+    private:
+        // Label bytes, then the root label's zero length byte.
+        uint8_t bytes[MAX_WIRE_LENGTH];
+        uint8_t size = 0;
+        uint8_t labels = 0;
+        // Where each label's length byte is in bytes.
+        uint8_t labelOffsets[MAX_LABELS];
+        size_t nameHash;
+    };
+}
+
+namespace std {
+    template <>
+    struct hash<DNice::DomainName> {
+        size_t operator()(const DNice::DomainName& name) const { return name.hash(); }
+    };
+}
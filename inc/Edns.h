@@ -0,0 +1,51 @@
+#pragma once
+
+#include "DNS.h"
+#include "PacketView.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace DNice {
+    // Largest UDP payload a client without EDNS accepts (RFC 1035 section 4.2.1), and the
+    // least an EDNS client may advertise (RFC 6891 section 6.2.3).
+    const uint16_t MIN_UDP_PAYLOAD_SIZE = 512;
+    // The upper eight bits of BADVERS (16), carried in the OPT record. The header's four
+    // response code bits are left zero.
+    const uint8_t EDNS_BAD_VERSION = 1;
+
+    struct EdnsOption {
+        uint16_t code = 0;
+        // Points into the message or Resource the option was decoded from.
+        const uint8_t* data = nullptr;
+        uint16_t length = 0;
+    };
+
+    // The contents of an OPT pseudo-record (RFC 6891). OPT reuses the fields of an ordinary
+    // record: its class holds the sender's UDP payload size and its TTL the extended response
+    // code, version and flags, with the options in its data.
+    struct Edns {
+        uint16_t udpPayloadSize = MIN_UDP_PAYLOAD_SIZE;
+        // The upper eight bits of the twelve bit response code. The lower four are in the header.
+        uint8_t extendedResponseCode = 0;
+        uint8_t version = 0;
+        // The DO bit: the sender wants DNSSEC records (RFC 3225).
+        bool dnssecOk = false;
+        std::vector<EdnsOption> options;
+    };
+
+    // Fails with TypeMismatch if the resource is not an OPT record, or BadRdata if its options
+    // run past its data. Options point into the resource, which must outlive out.
+    DnsError decodeEdns(const Resource& resource, Edns& out);
+    // As above for an OPT record in a view. Options point into the view's buffer.
+    DnsError decodeEdns(const PacketView& message, const ResourceView& resource, Edns& out);
+
+    // Replaces resource with an OPT record holding edns, owned by the root as OPT must be.
+    DnsError encodeEdns(const Edns& edns, Resource& resource);
+
+    // Looks for the OPT record in message, which need not be indexed, and decodes it into out.
+    // Sets present to whether there was one. Fails with BadOpt if there are several or one is
+    // misplaced, which RFC 6891 section 6.1.1 answers with FORMERR.
+    DnsError findEdns(const PacketView& message, Edns& out, bool& present);
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include "DNS.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/socket.h>
+
+namespace DNice {
+    struct ForwarderStats {
+        // Questions sent upstream, counting each only once however often it was retried.
+        uint64_t queries = 0;
+        uint64_t answered = 0;
+        // Attempts that timed out and were sent again.
+        uint64_t retries = 0;
+        // Questions given up on after every attempt timed out.
+        uint64_t failed = 0;
+        // Datagrams that matched no outstanding question, such as late answers to an
+        // attempt already retried, or spoofing attempts.
+        uint64_t unmatched = 0;
+    };
+
+    // Sends questions to upstream servers on behalf of one worker without ever blocking it.
+    // Each upstream gets a handful of connected UDP sockets, and every outstanding question
+    // is sent from one of them under a random id. Answers are matched on the socket they
+    // arrived at, their id and their question, which together make a forged answer as hard
+    // to land as RFC 5452 asks.
+    //
+    // The round-trip time of each upstream is tracked as in RFC 6298, and questions go to the
+    // upstream that has been answering fastest. An attempt that goes unanswered for the
+    // upstream's retransmission timeout is sent again, to a different upstream when there is
+    // one, until the retries or the overall timeout run out.
+    class Forwarder {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        // Called with the answer to the question forwarded under token, or with null when it
+        // went unanswered. The answer is only valid until the call returns.
+        using ReplyHandler = std::function<void(uint64_t token, const uint8_t* reply, size_t length)>;
+
+        // retries is how many times an unanswered question is sent again. timeout bounds the
+        // whole exchange, retries included. payloadSize is the UDP size advertised to upstreams
+        // with EDNS, zero to send no OPT record.
+        Forwarder(std::chrono::milliseconds timeout, unsigned int retries, uint16_t payloadSize, ReplyHandler handler);
+        ~Forwarder();
+
+        Forwarder(const Forwarder&) = delete;
+        Forwarder& operator=(const Forwarder&) = delete;
+
+        // Opens sockets to each upstream. Called on the main thread so errors surface at startup.
+        bool open(const std::vector<sockaddr_storage>& upstreams, std::string& error);
+        bool isOpen() const { return epollFd >= 0; }
+
+        // An epoll descriptor that polls readable whenever service() has answers to read.
+        int eventFd() const { return epollFd; }
+
+        // Sends question upstream with recursion desired. The handler is called with token once
+        // it is answered or given up on, always from service() or expire() and never from
+        // inside this call, so callers can finish what they were doing first.
+        void forward(const Question& question, uint64_t token);
+
+        // Reads and hands out whatever answers have arrived, without blocking.
+        void service();
+        // Retries or gives up on attempts whose time is up. Cheap when none is due, so it can be
+        // called on every loop iteration.
+        void expire();
+        // How long until expire() next has something to do, or max() when nothing is outstanding.
+        std::chrono::milliseconds nextTimeout() const;
+
+        const ForwarderStats& stats() const { return forwarderStats; }
+
+    private:
+        struct Upstream {
+            sockaddr_storage address;
+            socklen_t addressLength = 0;
+            // Smoothed round-trip time and its variation, zero until the first answer.
+            std::chrono::microseconds smoothedRtt{0};
+            std::chrono::microseconds rttVariation{0};
+        };
+
+        struct Socket {
+            int fd = -1;
+            size_t upstream = 0;
+        };
+
+        struct Pending {
+            uint64_t token = 0;
+            // The query as sent, with the current attempt's id in its first two bytes.
+            std::vector<uint8_t> query;
+            // Where the question ends in query, so answers can be checked against it.
+            size_t questionEnd = 0;
+            size_t socket = 0;
+            unsigned int attempts = 0;
+            // Tells this attempt's timer apart from those of earlier attempts and earlier users
+            // of the slot.
+            uint64_t attempt = 0;
+            Clock::time_point sent;
+            Clock::time_point giveUp;
+            bool active = false;
+        };
+
+        struct Timer {
+            Clock::time_point due;
+            size_t slot = 0;
+            uint64_t attempt = 0;
+
+            bool operator>(const Timer& other) const { return due > other.due; }
+        };
+
+        // Sends the next attempt of the question in slot. Returns false if no id was free for it.
+        bool send(size_t slot, bool retry);
+        void finish(size_t slot, const uint8_t* reply, size_t length);
+        size_t chooseUpstream(bool avoidCurrent, size_t current) const;
+        std::chrono::microseconds retransmitTimeout(const Upstream& upstream) const;
+        void sampleRtt(Upstream& upstream, std::chrono::microseconds sample);
+        void handleReply(size_t socket, const uint8_t* reply, size_t length);
+        // Unpredictable bits for ids and socket choices, drawn from the kernel in batches.
+        uint32_t randomBits();
+
+        std::chrono::milliseconds timeout;
+        unsigned int retries;
+        uint16_t payloadSize;
+        ReplyHandler handler;
+
+        int epollFd = -1;
+        std::vector<Upstream> upstreams;
+        std::vector<Socket> sockets;
+
+        std::vector<Pending> pending;
+        std::vector<size_t> freeSlots;
+        // Outstanding attempts by socket index and id.
+        std::unordered_map<uint32_t, size_t> inFlight;
+        std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+        uint64_t nextAttempt = 1;
+        // Questions that could not be sent at all, handed back by the next expire().
+        std::vector<uint64_t> failedTokens;
+
+        uint32_t randomPool[64];
+        size_t randomLeft = 0;
+        std::vector<uint8_t> receiveBuffer;
+
+        ForwarderStats forwarderStats;
+    };
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <linux/io_uring.h>
+
+namespace DNice {
+    // A minimal io_uring wrapper over the raw system calls: one submission/completion ring
+    // pair plus an optional provided-buffer ring the kernel picks receive buffers from.
+    // Like everything else in a worker, a ring is owned and driven by a single thread.
+    class IoUring {
+    public:
+        IoUring();
+        ~IoUring();
+
+        IoUring(const IoUring&) = delete;
+        IoUring& operator=(const IoUring&) = delete;
+
+        // Creates the rings. Fails when the kernel lacks io_uring or it has been disabled.
+        bool init(unsigned int entries, std::string& error);
+
+        // Checks with IORING_REGISTER_PROBE that the kernel implements opcode.
+        bool supportsOperation(uint8_t opcode) const;
+
+        // Returns a zeroed submission entry, submitting queued entries first if the ring is full.
+        io_uring_sqe* getSqe();
+
+        // Submits queued entries and waits for at least waitFor completions.
+        int submitAndWait(unsigned int waitFor);
+
+        // Calls handler for every available completion, then releases them to the kernel.
+        template <typename THandler>
+        unsigned int forEachCompletion(THandler handler) {
+            auto head = *cqHead;
+            const auto tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+            unsigned int count = 0;
+
+            while (head != tail) {
+                handler(cqes[head & cqMask]);
+                head++;
+                count++;
+            }
+
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+            return count;
+        }
+
+        // Registers count buffers of bufferSize bytes each, carved out of base, as provided
+        // buffer group groupId. count must be a power of two.
+        bool registerBufferRing(uint16_t groupId, uint8_t* base, size_t bufferSize, uint16_t count, std::string& error);
+
+        // Hands a consumed buffer back to the kernel. Takes effect on the next commitBuffers().
+        void recycleBuffer(uint16_t bufferId);
+        void commitBuffers();
+
+        uint8_t* bufferAddress(uint16_t bufferId) const { return bufferBase + bufferId * bufferSize; }
+
+    private:
+        int ringFd = -1;
+
+        void* sqRing = nullptr;
+        size_t sqRingSize = 0;
+        void* cqRing = nullptr;
+        size_t cqRingSize = 0;
+        io_uring_sqe* sqes = nullptr;
+        size_t sqesSize = 0;
+
+        unsigned int* sqHead = nullptr;
+        unsigned int* sqTail = nullptr;
+        unsigned int sqMask = 0;
+        unsigned int sqEntries = 0;
+        unsigned int* sqArray = nullptr;
+        unsigned int sqLocalTail = 0;
+        unsigned int sqSubmitted = 0;
+
+        unsigned int* cqHead = nullptr;
+        unsigned int* cqTail = nullptr;
+        unsigned int cqMask = 0;
+        io_uring_cqe* cqes = nullptr;
+
+        io_uring_buf_ring* bufferRing = nullptr;
+        size_t bufferRingSize = 0;
+        uint16_t bufferRingMask = 0;
+        uint16_t bufferRingTail = 0;
+        uint8_t* bufferBase = nullptr;
+        size_t bufferSize = 0;
+    };
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "DNS.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace DNice {
+    // Splits a TCP byte stream into the DNS messages it carries, each prefixed with its length
+    // as two bytes (RFC 1035 section 4.2.2). Chunks are fed in as they are read, cut wherever
+    // the reads happened to end. A message that lies whole within a chunk is handed out where
+    // it is, without copying. Only a message split across chunks is assembled in the framer's
+    // own buffer, along with anything held back when the handler asks to stop.
+    class MessageFramer {
+    public:
+        static const size_t LENGTH_PREFIX_SIZE = 2;
+
+        // Feeds the next length bytes of the stream. handler(message, messageLength) is called
+        // for each message completed and returns whether to go on. When it returns false the
+        // rest of the chunk is held, and handed out by drain() once the caller is ready.
+        // Messages passed to handler are only valid until it returns.
+        template <typename THandler>
+        void consume(const uint8_t* data, size_t length, THandler handler) {
+            if (holding) {
+                hold(data, length);
+                drain(handler);
+                return;
+            }
+
+            if (!buffer.empty()) {
+                // Finish the message the previous chunk ended in the middle of.
+                const auto taken = completeBuffered(data, length);
+                data += taken;
+                length -= taken;
+                if (!bufferedMessageComplete()) {
+                    return;
+                }
+
+                const bool more = handler(buffer.data() + LENGTH_PREFIX_SIZE, buffer.size() - LENGTH_PREFIX_SIZE);
+                buffer.clear();
+                if (!more) {
+                    hold(data, length);
+                    return;
+                }
+            }
+
+            while (length >= LENGTH_PREFIX_SIZE) {
+                const auto messageLength = getValue<uint16_t>(data, 0);
+                if (length - LENGTH_PREFIX_SIZE < messageLength) {
+                    break;
+                }
+
+                const bool more = handler(data + LENGTH_PREFIX_SIZE, messageLength);
+                data += LENGTH_PREFIX_SIZE + messageLength;
+                length -= LENGTH_PREFIX_SIZE + messageLength;
+                if (!more) {
+                    hold(data, length);
+                    return;
+                }
+            }
+
+            buffer.assign(data, data + length);
+        }
+
+        // Hands out held messages until the handler stops again or none is complete.
+        template <typename THandler>
+        void drain(THandler handler) {
+            while (holding) {
+                const auto available = buffer.size() - offset;
+                if (available < LENGTH_PREFIX_SIZE || available - LENGTH_PREFIX_SIZE < getValue<uint16_t>(buffer.data(), offset)) {
+                    releaseHeld();
+                    return;
+                }
+
+                const auto messageLength = getValue<uint16_t>(buffer.data(), offset);
+                const auto message = buffer.data() + offset + LENGTH_PREFIX_SIZE;
+                offset += LENGTH_PREFIX_SIZE + messageLength;
+                if (!handler(message, messageLength)) {
+                    if (offset == buffer.size()) {
+                        releaseHeld();
+                    }
+
+                    return;
+                }
+            }
+        }
+
+        // Whether data is held back for drain(). Callers should stop reading until it isn't,
+        // or the held data grows without bound.
+        bool isHolding() const { return holding; }
+
+        // Bytes of partial or held messages kept in the framer.
+        size_t bufferedBytes() const { return buffer.size() - offset; }
+
+        void clear();
+
+    private:
+        // Appends the start of data to the partial message in buffer, up to its end. Returns
+        // the number of bytes taken.
+        size_t completeBuffered(const uint8_t* data, size_t length);
+        bool bufferedMessageComplete() const;
+        void hold(const uint8_t* data, size_t length);
+        // Keeps only the unhandled end of buffer, which is at most a partial message.
+        void releaseHeld();
+
+        std::vector<uint8_t> buffer;
+        // While holding, where the first unhandled message starts in buffer. Otherwise zero.
+        size_t offset = 0;
+        bool holding = false;
+    };
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "duktape.h"
+
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace DNice {
+    struct CachedModule {
+        std::string path;
+        std::string source;
+        // duk_dump_function output for the module's wrapper function.
+        std::vector<uint8_t> bytecode;
+    };
+
+    // Process-wide cache of CommonJS modules read from disk. Each module is read and
+    // compiled by whichever heap requires it first; after that every heap loads the shared
+    // bytecode. Entries are never modified or evicted, so lookups only take a reader lock.
+    class ModuleCache {
+    public:
+        static ModuleCache& shared();
+
+        std::shared_ptr<const CachedModule> find(const std::string& path) const;
+
+        // Adds module unless another heap got there first, and returns whichever is cached.
+        std::shared_ptr<const CachedModule> insert(std::shared_ptr<const CachedModule> module);
+
+    private:
+        mutable std::shared_mutex mutex;
+        std::unordered_map<std::string, std::shared_ptr<const CachedModule>> modules;
+    };
+
+    // Sets Duktape.modSearch in ctx to load module id from "<root>/<id>.js" through the shared
+    // ModuleCache. duk_module_duktape_init() must have been called on ctx already.
+    void installModuleSearch(duk_context* ctx, const std::string& root);
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include "DNS.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace DNice {
+    // A byte range within the buffer a PacketView was built over.
+    struct Span {
+        size_t offset = 0;
+        size_t length = 0;
+    };
+
+    struct QuestionView {
+        // The in-place wire encoding of the name, up to and including its terminator or first pointer.
+        Span name;
+        Type qtype = Type::A;
+        Class qclass = Class::IN;
+    };
+
+    struct ResourceView {
+        Span name;
+        Type rtype = Type::A;
+        Class rclass = Class::IN;
+        uint32_t ttl = 0;
+        Span data;
+    };
+
+    class PacketView;
+
+    // Walks one section of an indexed packet, decoding each entry as it is reached.
+    template <typename TView>
+    class SectionRange {
+    public:
+        class iterator {
+        public:
+            iterator(const PacketView* view, size_t offset, uint16_t remaining) :
+                view(view),
+                offset(offset),
+                remaining(remaining) {
+                load();
+            }
+
+            const TView& operator*() const { return current; }
+            const TView* operator->() const { return &current; }
+
+            iterator& operator++() {
+                remaining--;
+                offset = next;
+                load();
+                return *this;
+            }
+
+            bool operator!=(const iterator& other) const { return remaining != other.remaining; }
+            bool operator==(const iterator& other) const { return remaining == other.remaining; }
+
+        private:
+            void load();
+
+            const PacketView* view;
+            size_t offset;
+            size_t next = 0;
+            uint16_t remaining;
+            TView current;
+        };
+
+        SectionRange(const PacketView* view, size_t start, uint16_t count) :
+            view(view),
+            start(start),
+            count(count) {
+        }
+
+        iterator begin() const { return iterator(view, start, count); }
+        iterator end() const { return iterator(view, start, 0); }
+        uint16_t size() const { return count; }
+
+    private:
+        const PacketView* view;
+        size_t start;
+        uint16_t count;
+    };
+
+    // A read-only view of a DNS message that indexes into the buffer it was received in.
+    // Header fields are decoded on demand and names and RDATA are exposed as spans, so
+    // inspecting a query never touches the heap. The buffer must outlive the view.
+    class PacketView {
+    public:
+        static const size_t MAX_NAME_LENGTH = 255;
+
+        PacketView(const uint8_t* bytes, size_t size);
+
+        // Walks every section once, validating each length against the buffer and recording
+        // where the sections start. Must succeed before any section is accessed. Fails with
+        // Truncated if the message is shorter than its counts and lengths say, or holds a
+        // label of a reserved type. Compression pointers are only followed when names are read.
+        DnsError index();
+
+        const uint8_t* data() const { return bytes; }
+        size_t size() const { return length; }
+
+        uint16_t id() const;
+        bool isResponse() const;
+        Opcode opcode() const;
+        bool isAuthoritative() const;
+        bool isTruncated() const;
+        bool recursionDesired() const;
+        bool recursionAvailable() const;
+        bool zBit() const;
+        bool isAuthenticData() const;
+        bool checkingDisabled() const;
+        ResponseCode responseCode() const;
+
+        uint16_t questionCount() const;
+        uint16_t answerCount() const;
+        uint16_t authorityCount() const;
+        uint16_t additionalRecordCount() const;
+
+        SectionRange<QuestionView> questions() const;
+        SectionRange<ResourceView> answers() const;
+        SectionRange<ResourceView> authorities() const;
+        SectionRange<ResourceView> additionalRecords() const;
+
+        // Offset just past the end of the question section.
+        size_t questionsEnd() const { return sectionStarts[1]; }
+
+        // Writes the dotted form of a (possibly compressed) name into out without allocating.
+        // Returns the number of characters written, or -1 if the name is malformed or does not fit.
+        int decodeName(const Span& name, char* out, size_t capacity) const;
+        bool appendName(const Span& name, std::string& out) const;
+        // Decodes a (possibly compressed) name into its uncompressed wire form.
+        bool readDomainName(const Span& name, DomainName& out) const;
+
+        // Builds an owning Packet from the view, for callers that need to keep or modify it.
+        bool materialize(Packet& outPacket) const;
+
+        bool readName(size_t& offset, Span& name) const;
+        bool readQuestion(size_t& offset, QuestionView& question) const;
+        bool readResource(size_t& offset, ResourceView& resource) const;
+
+    private:
+        // Copies a record's RDATA into resource, expanding any names it holds so that, like
+        // parseResource, the data never points back into this message.
+        bool readRdata(const ResourceView& view, Resource& resource) const;
+
+        const uint8_t* bytes;
+        size_t length;
+        size_t sectionStarts[4] = {};
+    };
+
+    template <>
+    inline void SectionRange<QuestionView>::iterator::load() {
+        next = offset;
+        if (remaining > 0) {
+            view->readQuestion(next, current);
+        }
+    }
+
+    template <>
+    inline void SectionRange<ResourceView>::iterator::load() {
+        next = offset;
+        if (remaining > 0) {
+            view->readResource(next, current);
+        }
+    }
+}
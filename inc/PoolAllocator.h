@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace DNice {
+    struct AllocatorStats {
+        uint64_t allocations = 0;
+        uint64_t frees = 0;
+        uint64_t reallocations = 0;
+        // Requests refused because they would have exceeded the budget.
+        uint64_t failures = 0;
+        size_t bytesInUse = 0;
+        size_t peakBytesInUse = 0;
+        // Memory taken from the system for size-class slabs.
+        size_t slabBytes = 0;
+        // Memory taken from the system for blocks too large for any size class.
+        size_t largeBytes = 0;
+    };
+
+    // A size-class pool allocator for a single Duktape heap. Small blocks are carved out of
+    // slabs and recycled through per-class free lists; larger ones go straight to malloc.
+    // A heap is only ever used by one thread, so nothing here locks.
+    //
+    // Everything taken from the system, slabs and large blocks alike, is held to a hard budget.
+    // Slabs are kept once carved and their blocks recycled within their class, so a heap whose
+    // allocation sizes drift is refused rather than allowed to grow. Refusing an allocation
+    // makes Duktape run an emergency garbage collection and retry before it raises an
+    // out-of-memory error.
+    class PoolAllocator {
+    public:
+        // A budget of zero means unlimited.
+        explicit PoolAllocator(size_t budget);
+        ~PoolAllocator();
+
+        PoolAllocator(const PoolAllocator&) = delete;
+        PoolAllocator& operator=(const PoolAllocator&) = delete;
+
+        void* allocate(size_t size);
+        void* reallocate(void* pointer, size_t size);
+        void release(void* pointer);
+
+        const AllocatorStats& stats() const { return allocatorStats; }
+
+    private:
+        struct FreeBlock {
+            FreeBlock* next;
+        };
+
+        // Checks that taking bytes more from the system stays within the budget, counting
+        // credit bytes as already given back.
+        bool reserve(size_t bytes, size_t credit);
+        // credit is memory the caller is about to give back, as when a large block moves.
+        void* allocateBlock(size_t size, size_t credit);
+        void* allocateFromClass(size_t classIndex, size_t credit);
+
+        size_t budget;
+        std::vector<FreeBlock*> freeLists;
+        std::vector<void*> slabs;
+        uint8_t* slabCursor = nullptr;
+        size_t slabRemaining = 0;
+
+        AllocatorStats allocatorStats;
+    };
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "DNS.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace DNice {
+    // Typed views of Resource::data for the common record types. Nothing is decoded until one
+    // of the decodeRdata overloads is called, and fixed-size fields are read in place: the
+    // address and text views point into the Resource, which must outlive them.
+    //
+    // Resource::data never holds compression pointers. The parser expands any names in RDATA
+    // when it reads a record, and serializeResource compresses them again against the message
+    // being written.
+
+    // A and AAAA.
+    struct AddressRdata {
+        const uint8_t* address = nullptr;
+        // 4 for A, 16 for AAAA.
+        size_t length = 0;
+    };
+
+    // NS, CNAME and PTR.
+    struct NameRdata {
+        DomainName name;
+    };
+
+    struct MxRdata {
+        uint16_t preference = 0;
+        DomainName exchange;
+    };
+
+    struct SrvRdata {
+        uint16_t priority = 0;
+        uint16_t weight = 0;
+        uint16_t port = 0;
+        DomainName target;
+    };
+
+    struct SoaRdata {
+        DomainName primaryServer;
+        DomainName responsibleMailbox;
+        uint32_t serial = 0;
+        uint32_t refresh = 0;
+        uint32_t retry = 0;
+        uint32_t expire = 0;
+        uint32_t minimum = 0;
+    };
+
+    struct TxtRdata {
+        std::vector<std::string_view> strings;
+    };
+
+    // Each fails with TypeMismatch if the resource is of a different type, or BadRdata if its
+    // data does not have the type's layout.
+    DnsError decodeRdata(const Resource& resource, AddressRdata& out);
+    DnsError decodeRdata(const Resource& resource, NameRdata& out);
+    DnsError decodeRdata(const Resource& resource, MxRdata& out);
+    DnsError decodeRdata(const Resource& resource, SrvRdata& out);
+    DnsError decodeRdata(const Resource& resource, SoaRdata& out);
+    DnsError decodeRdata(const Resource& resource, TxtRdata& out);
+
+    // Each replaces the resource's data and length; the caller sets its type.
+    DnsError encodeRdata(const AddressRdata& rdata, Resource& resource);
+    DnsError encodeRdata(const NameRdata& rdata, Resource& resource);
+    DnsError encodeRdata(const MxRdata& rdata, Resource& resource);
+    DnsError encodeRdata(const SrvRdata& rdata, Resource& resource);
+    DnsError encodeRdata(const SoaRdata& rdata, Resource& resource);
+    DnsError encodeRdata(const TxtRdata& rdata, Resource& resource);
+
+    // Where names sit in the RDATA of types that carry them: a fixed-size prefix, then names,
+    // then a fixed-size suffix.
+    struct RdataLayout {
+        uint8_t prefixLength = 0;
+        uint8_t nameCount = 0;
+        uint8_t suffixLength = 0;
+        // Whether the names may be compressed on output. RFC 3597 limits that to the types
+        // from RFC 1035; SRV targets, for one, must be written out in full.
+        bool compressible = false;
+    };
+
+    // Returns false for types whose RDATA holds no names.
+    bool rdataLayout(Type type, RdataLayout& layout);
+
+    // Copies the RDATA at index in message to out, expanding any compressed names.
+    DnsError expandRdata(const std::vector<uint8_t>& message, size_t index, size_t length, const RdataLayout& layout, NameMemo* memo, std::pmr::vector<uint8_t>& out);
+
+    // Appends the RDATA of resource to bytes, compressing its names against compression.
+    DnsError compressRdata(WireWriter& bytes, const Resource& resource, const RdataLayout& layout, NameCompressionTable* compression);
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "DNS.h"
+#include "PacketView.h"
+#include "PoolAllocator.h"
+
+#include "duktape.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace DNice {
+    // Owns one Duktape heap and the policy script loaded into it. A heap is single-threaded,
+    // so each worker gets its own host and never shares it.
+    //
+    // Scripts answer queries by defining a global handleQuery(query) function. The query is
+    // { id, opcode, recursionDesired, checkingDisabled, questions: [{ name, type, class }] }
+    // and the return value is an object with optional responseCode, isAuthoritative and
+    // recursionAvailable fields and answers/authorities/additionalRecords arrays of
+    // { name, type, class, ttl, data }, where data is a buffer or an array of bytes. Instead of
+    // data, records of the common types may give their fields: address (A, AAAA), target (NS,
+    // CNAME, PTR, SRV), preference and exchange (MX), priority, weight and port (SRV),
+    // primaryServer, responsibleMailbox, serial, refresh, retry, expire and minimum (SOA), or
+    // text, a string or an array of them (TXT).
+    //
+    // When forwarding is enabled, a handler may instead return forward(question, callback),
+    // which asks an upstream server and answers later with callback(reply). reply has the
+    // shape of a handler's result, with every record's data and the fields of the common
+    // types filled in, or is null if the upstream never answered. The callback returns an
+    // answer as handleQuery does, which may be reply itself, or forwards again.
+    //
+    // A handler marked with handleQuery.suspends = true runs as a Duktape coroutine and may
+    // wait inline instead: resolve(question) suspends it until the upstream answers and returns
+    // the reply, or null, while other queries are served. As with any Duktape yield, resolve()
+    // must be reached through script functions alone, not from inside callbacks such as those
+    // given to Array.forEach. Suspending handlers cost several microseconds more per query.
+    class ScriptHost {
+    public:
+        // heapBudget caps the bytes the heap may hold; zero means unlimited.
+        explicit ScriptHost(size_t heapBudget = 0);
+        ~ScriptHost();
+
+        ScriptHost(const ScriptHost&) = delete;
+        ScriptHost& operator=(const ScriptHost&) = delete;
+
+        // Makes require() load modules from files under root, sharing their compiled bytecode
+        // with every other heap in the process.
+        void setModuleRoot(const std::string& root);
+
+        // Compiles and runs source as the top-level program. fileName is used in stack traces.
+        bool load(const std::string& source, const std::string& fileName, std::string& error);
+
+        // Compiles source without running it and dumps the program as Duktape bytecode, which
+        // any heap from the same Duktape build can load without re-parsing.
+        bool compile(const std::string& source, const std::string& fileName, std::vector<uint8_t>& bytecode, std::string& error);
+
+        // Loads bytecode produced by compile() and runs it as the top-level program.
+        bool loadBytecode(const std::vector<uint8_t>& bytecode, std::string& error);
+
+        // Bounds how long handleQuery() may run. Zero disables the limit. Duktape only checks
+        // the clock every few hundred thousand bytecode instructions, so a runaway handler is
+        // stopped somewhat after the budget rather than exactly on it.
+        void setExecutionBudget(std::chrono::microseconds budget) { executionBudget = budget; }
+
+        // Runs the handler for query and fills in the header flags and records of response.
+        // response should already echo the query's id and questions.
+        bool handleQuery(const PacketView& query, Packet& response, std::string& error);
+
+        // Whether the last failed handleQuery() was aborted for exceeding the execution budget.
+        bool timedOut() const { return deadlineExpired; }
+
+        // Lets scripts call forward(). Without an upstream to send to it throws.
+        void enableForwarding(bool enable) { forwardingEnabled = enable; }
+
+        // Nonzero when the last handleQuery() or resumeForward() returned a forward() instead of
+        // an answer. The caller sends forwardedQuestion() upstream and passes the token and
+        // reply to resumeForward(), leaving response untouched until then.
+        uint64_t forwardToken() const { return pendingForward; }
+        const Question& forwardedQuestion() const { return forwardQuestion; }
+
+        // Runs the callback waiting on token with reply, or null if none came, and fills in
+        // response as handleQuery() does.
+        bool resumeForward(uint64_t token, const Packet* reply, Packet& response, std::string& error);
+
+        duk_context* context() const { return ctx; }
+        const AllocatorStats& allocatorStats() const { return allocator.stats(); }
+
+    private:
+        friend duk_bool_t (::dnice_exec_timeout_check)(void* udata);
+
+        // Duktape allocation hooks. The heap's udata is the owning ScriptHost.
+        static void* allocateMemory(void* udata, duk_size_t size);
+        static void* reallocateMemory(void* udata, void* pointer, duk_size_t size);
+        static void releaseMemory(void* udata, void* pointer);
+
+        // The native behind the script's forward().
+        static duk_ret_t forwardQuery(duk_context* ctx);
+        // Called by the coroutine trampoline with the question and thread of a handler that
+        // yielded in resolve().
+        static duk_ret_t suspendQuery(duk_context* ctx);
+        // Parks the continuation at index 1 until the question at index 0 is answered, and
+        // returns the marker that tells the caller to wait.
+        static duk_ret_t deferAnswer(duk_context* ctx, const char* function);
+
+        // Runs a handler or callback under the execution budget, then settles any forward() it
+        // made. returnedForward is filled in by function.
+        bool invoke(duk_safe_call_function function, void* call, const uint64_t& returnedForward, std::string& error);
+
+        // Declared before ctx so it outlives the heap that allocates from it.
+        PoolAllocator allocator;
+        duk_context* ctx;
+
+        std::chrono::microseconds executionBudget{0};
+        std::chrono::steady_clock::time_point deadline;
+        bool deadlineArmed = false;
+        // Once set, stays set until the call unwinds so no script catch block can swallow it.
+        bool deadlineExpired = false;
+
+        bool forwardingEnabled = false;
+        bool inCall = false;
+        // The forward() made during the current call, and the one the last call returned.
+        uint64_t requestedForward = 0;
+        uint64_t pendingForward = 0;
+        uint64_t nextForwardToken = 1;
+        Question forwardQuestion;
+    };
+}
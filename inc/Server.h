@@ -0,0 +1,38 @@
+#pragma once
+
+#include "Worker.h"
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace DNice {
+    // Runs one shared-nothing Worker per thread. Every worker binds its own SO_REUSEPORT
+    // socket, so the kernel spreads incoming queries across them without any user-space
+    // dispatch or locking.
+    class Server {
+    public:
+        explicit Server(const ServerOptions& options);
+
+        // Opens every worker's socket and compiles the policy script, or loads it from the
+        // bytecode cache. Must succeed before run().
+        bool start(std::string& error);
+
+        // Blocks until stop() is called, then joins the workers.
+        void run();
+        void stop();
+
+        // Sums the statistics of every worker. Only meaningful once run() has returned.
+        WorkerStats totalStats() const;
+
+    private:
+        bool prepareScript(const std::string& source, std::string& error);
+
+        ServerOptions options;
+        // The policy script compiled once at startup and loaded into every worker heap.
+        std::vector<uint8_t> scriptBytecode;
+        std::vector<std::unique_ptr<Worker>> workers;
+        std::atomic<bool> running;
+    };
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include "MessageFramer.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+
+namespace DNice {
+    struct TcpStats {
+        uint64_t accepted = 0;
+        // Connections closed as soon as they were accepted because the worker held its limit.
+        uint64_t rejected = 0;
+        // Connections closed for sitting idle past the timeout.
+        uint64_t idleClosed = 0;
+        uint64_t queries = 0;
+        // Responses queued for sending.
+        uint64_t answered = 0;
+    };
+
+    // The TCP side of one worker (RFC 7766). Like the UDP socket, each worker's listener is
+    // bound with SO_REUSEPORT, so the kernel spreads connections across workers and every
+    // query on a connection is handled by the worker that accepted it.
+    //
+    // Clients may pipeline any number of length-prefixed queries on a connection. Each is
+    // answered as soon as it has been handled, and since answers carry their query's id,
+    // clients match them up however they are ordered. That includes answers deferred while
+    // the worker waits on something else, which are delivered whenever they are ready.
+    //
+    // Everything a connection can hold on to is bounded: the number of connections, how long
+    // one may sit idle, and how much output may queue up for a client that isn't reading.
+    class TcpServer {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        // Names a connection for as long as it stays open. Once it closes, its id is never
+        // reused, so an answer delivered late is dropped instead of reaching another client.
+        using ConnectionId = uint64_t;
+
+        // Builds the response to one query, returning false when nothing should be sent back
+        // now. A handler that will answer later calls defer() for the connection first.
+        using QueryHandler = std::function<bool(ConnectionId connection, const uint8_t* request, size_t length, std::vector<uint8_t>& response)>;
+
+        TcpServer(size_t maxConnections, std::chrono::milliseconds idleTimeout, QueryHandler handler);
+        ~TcpServer();
+
+        TcpServer(const TcpServer&) = delete;
+        TcpServer& operator=(const TcpServer&) = delete;
+
+        // Binds and listens. Called on the main thread so bind errors surface at startup.
+        bool open(const sockaddr_storage& address, socklen_t addressLength, std::string& error);
+        bool isOpen() const { return listenFd >= 0; }
+
+        // An epoll descriptor that polls readable whenever service() has work to do.
+        int eventFd() const { return epollFd; }
+
+        // Accepts, reads, answers and writes whatever is ready, without blocking.
+        void service();
+        // Closes connections that have been idle past the timeout. Checks the clock and
+        // returns at once unless a sweep is due, so it can be called on every loop iteration.
+        void closeIdle();
+
+        // Promises an answer on connection later, through deliver() or abandon(). Until then the
+        // connection is neither closed for being idle nor once the client shuts down its side.
+        void defer(ConnectionId connection);
+        // Sends a deferred answer. Returns false if the connection has closed in the meantime.
+        bool deliver(ConnectionId connection, const uint8_t* response, size_t length);
+        // Gives up on a deferred answer without sending anything.
+        void abandon(ConnectionId connection);
+
+        const TcpStats& stats() const { return tcpStats; }
+
+    private:
+        struct Connection {
+            int fd = -1;
+            // Holds only what was read but not yet handled: a message split across reads, or
+            // queries held back while the client catches up on its answers.
+            MessageFramer framer;
+            // Framed responses, sent from outputOffset onwards.
+            std::vector<uint8_t> output;
+            size_t outputOffset = 0;
+            // The client has shut down its side; close once the output has been sent.
+            bool peerClosed = false;
+            // The epoll events currently registered, 0 while the socket is out of the set.
+            uint32_t events = 0;
+            Clock::time_point lastActive;
+            // Answers promised through defer() and not yet delivered.
+            size_t deferred = 0;
+            // Bumped each time the slot is reused, to tell its connections apart.
+            uint32_t generation = 0;
+        };
+
+        void acceptConnections();
+        void readFrom(size_t slot);
+        // Answers one query, returning whether the connection may take more.
+        bool handleQuery(size_t slot, const uint8_t* request, size_t length);
+        void flush(size_t slot);
+        void updateEvents(size_t slot);
+        void closeConnection(size_t slot);
+        ConnectionId idOf(size_t slot) const;
+        // Returns the slot of an open connection, or false if it has closed.
+        bool slotOf(ConnectionId connection, size_t& slot) const;
+        void appendResponse(Connection& connection, const uint8_t* response, size_t length);
+
+        size_t maxConnections;
+        std::chrono::milliseconds idleTimeout;
+        QueryHandler handler;
+
+        int listenFd = -1;
+        int epollFd = -1;
+
+        std::vector<Connection> connections;
+        std::vector<size_t> freeSlots;
+        Clock::time_point nextSweep;
+        // Every connection reads into this, and its queries are handled straight from here.
+        std::vector<uint8_t> receiveBuffer;
+        // Scratch space for one response before it is framed into a connection's output.
+        std::vector<uint8_t> response;
+
+        TcpStats tcpStats;
+    };
+}
@@ -0,0 +1,241 @@
+#pragma once
+
+#include "AnswerCache.h"
+#include "DNS.h"
+#include "Edns.h"
+#include "Forwarder.h"
+#include "PacketView.h"
+#include "ScriptHost.h"
+#include "TcpServer.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/socket.h>
+
+namespace DNice {
+    enum class IoEngine {
+        // poll plus recvfrom/recvmmsg, available everywhere.
+        Portable,
+        // Multishot receives from a provided-buffer ring, falling back to Portable when the
+        // kernel can't do that.
+        IoUring,
+    };
+
+    // What a query arrived over, which decides how large its response may be.
+    enum class Transport {
+        Udp,
+        Tcp,
+    };
+
+    // Where a query came from, so an answer that is only ready after processQuery() returns
+    // can still find its way back.
+    struct QuerySource {
+        Transport transport = Transport::Udp;
+        // The UDP client.
+        const sockaddr_storage* peer = nullptr;
+        socklen_t peerLength = 0;
+        // The TCP client.
+        TcpServer::ConnectionId connection = 0;
+    };
+
+    enum class QueryResult {
+        // The response is ready to send.
+        Answered,
+        // Nothing should be sent back.
+        Dropped,
+        // The script sent the question upstream. The worker sends the response itself once the
+        // upstream answers or is given up on.
+        Forwarded,
+    };
+
+    struct ServerOptions {
+        std::string address = "0.0.0.0";
+        uint16_t port = 53;
+        // Zero means one worker per online CPU.
+        unsigned int threads = 0;
+        // Pins worker N to CPU N (modulo the CPU count).
+        bool pinThreads = false;
+        std::string scriptPath;
+        // Directory require() loads modules from. Defaults to the script's directory.
+        std::string modulePath;
+        // Datagrams moved per recvmmsg/sendmmsg call. One uses plain recvfrom/sendto.
+        size_t batchSize = 32;
+        IoEngine ioEngine = IoEngine::Portable;
+        // Bytes each worker's Duktape heap may hold. Zero means unlimited.
+        size_t heapBudget = 0;
+        // How long handleQuery may run before the query is answered with SERVFAIL. Zero
+        // means unlimited.
+        std::chrono::microseconds scriptTimeout{50000};
+        // Responses each worker keeps for repeated questions. Zero disables the answer cache.
+        size_t cacheSize = 10000;
+        // Where compiled policy scripts are persisted between runs. Empty disables the cache.
+        std::string bytecodeCacheDirectory;
+        // TCP connections each worker holds open at once. Zero disables TCP.
+        size_t tcpConnections = 256;
+        // How long a TCP connection may go without reading or writing before it is closed.
+        std::chrono::milliseconds tcpIdleTimeout{10000};
+        // The UDP payload size advertised in OPT records, and the most sent over UDP to a client
+        // that advertises at least as much. The default is the DNS Flag Day 2020 value, which
+        // avoids IP fragmentation on common paths. Zero disables EDNS, ignoring OPT in queries.
+        uint16_t ednsPayloadSize = 1232;
+        // Servers the script's forward() sends questions to, as ADDR, ADDR:PORT or [ADDR]:PORT.
+        // Empty disables forward().
+        std::vector<std::string> upstreams;
+        // How long a forwarded question may go unanswered, retries included, before its
+        // callback is run without an answer.
+        std::chrono::milliseconds forwardTimeout{2000};
+        // How many times an unanswered forwarded question is sent again.
+        unsigned int forwardRetries = 2;
+    };
+
+    struct WorkerStats {
+        uint64_t received = 0;
+        uint64_t answered = 0;
+        uint64_t dropped = 0;
+        uint64_t scriptErrors = 0;
+        // System calls made to receive and send, to see how well batching amortizes them.
+        uint64_t receiveCalls = 0;
+        uint64_t sendCalls = 0;
+        // Script heap allocator statistics, captured when the worker stops.
+        AllocatorStats heap;
+        // Script errors that were the handler running past scriptTimeout.
+        uint64_t scriptTimeouts = 0;
+        // Queries answered from the answer cache without running the script.
+        uint64_t cacheHits = 0;
+        // TCP connection statistics, captured when the worker stops. TCP queries are also
+        // counted in received, answered and dropped.
+        TcpStats tcp;
+        // Queries whose answer waited on an upstream server.
+        uint64_t forwarded = 0;
+        // Upstream statistics, captured when the worker stops.
+        ForwarderStats forward;
+    };
+
+    // One shard of the server. A worker owns its socket, its Duktape heap and its packet
+    // buffers, and nothing on the query path is shared with other workers.
+    class Worker {
+    public:
+        Worker(unsigned int index, const ServerOptions& options, const std::vector<uint8_t>& scriptBytecode);
+        ~Worker();
+
+        Worker(const Worker&) = delete;
+        Worker& operator=(const Worker&) = delete;
+
+        // Binds the worker's socket. Called on the main thread so bind errors surface at startup.
+        bool open(std::string& error);
+
+        // Serves queries until running is cleared. Runs on the worker's own thread.
+        void run(const std::atomic<bool>& running);
+
+        const WorkerStats& stats() const { return workerStats; }
+
+        // Builds the response to the query in request, writing it to response. A UDP response
+        // longer than the client accepts, 512 bytes unless it says otherwise with EDNS, is cut
+        // back to its question with TC set. A forwarded query is answered later through source.
+        QueryResult processQuery(const uint8_t* request, size_t requestLength, std::vector<uint8_t>& response, const QuerySource& source);
+
+    private:
+        // What is learnt about a query before its response is built.
+        struct QueryState {
+            bool hasEdns = false;
+            DnsError ednsError = DnsError::None;
+            bool badVersion = false;
+            size_t maxResponseSize = 0;
+            bool cacheable = false;
+            AnswerCache::Clock::time_point now;
+        };
+
+        // A forwarded query waiting for the script's callback, with a copy of everything needed
+        // to answer it.
+        struct ParkedQuery {
+            std::vector<uint8_t> request;
+            Transport transport = Transport::Udp;
+            sockaddr_storage peer;
+            socklen_t peerLength = 0;
+            TcpServer::ConnectionId connection = 0;
+        };
+
+        // Decodes the query's OPT record, works out how big its response may be and fills in
+        // cacheKey if the response can be cached.
+        void inspectQuery(const PacketView& query, Transport transport, QueryState& state);
+        // Starts responsePacket afresh, echoing query's header and questions. Returns false, with
+        // FORMERR set, when the query is malformed.
+        bool beginResponse(PacketView& query, const QueryState& state);
+        // Replaces whatever the script put in responsePacket with SERVFAIL.
+        void failScript(const std::string& error);
+        // Adds the OPT record and serializes responsePacket, caching it if the script answered.
+        // Returns false when nothing should be sent back.
+        bool finishResponse(const QueryState& state, bool scriptAnswered, std::vector<uint8_t>& outResponse);
+        // Holds on to the query until the script's forward() is answered, and sends it upstream.
+        void parkQuery(ParkedQuery&& query);
+        // Runs the script's callback for the forward() under token, then answers the query or
+        // parks it again.
+        void completeForward(uint64_t token, const uint8_t* reply, size_t length);
+        void sendForwardedResponse(const ParkedQuery& query, bool answered);
+
+        void pinToCpu();
+        void runPortable(const std::atomic<bool>& running);
+        // Returns false without serving anything if the kernel lacks the io_uring features used.
+        bool runUring(const std::atomic<bool>& running);
+        void drainSingle();
+        void prepareBatch();
+        void drainBatched();
+
+        unsigned int index;
+        const ServerOptions& options;
+        const std::vector<uint8_t>& scriptBytecode;
+        int socketFd = -1;
+
+        // Created on the worker thread so its memory is first touched by the CPU that uses it.
+        std::unique_ptr<ScriptHost> script;
+        bool scriptLoaded = false;
+
+        std::vector<uint8_t> receiveBuffer;
+        std::vector<uint8_t> sendBuffer;
+
+        // Backs the response Packet being built. Rewound for each query, by which point the
+        // previous response has been serialized and nothing refers to it. Left uninitialized so
+        // the worker thread is the first to touch it; a response that outgrows it spills to the
+        // heap until the next rewind.
+        alignas(std::max_align_t) uint8_t packetArenaBuffer[64 * 1024];
+        std::pmr::monotonic_buffer_resource packetArena;
+        std::optional<Packet> responsePacket;
+        // An upstream's answer being handed to a forward() callback, on the same arena.
+        std::optional<Packet> replyPacket;
+        std::vector<uint8_t> replyBuffer;
+        std::vector<uint8_t> forwardedResponse;
+
+        AnswerCache answerCache;
+        AnswerCache::Key cacheKey;
+        // The current query's OPT record. Kept so its option list reuses its storage.
+        Edns queryEdns;
+
+        TcpServer tcpServer;
+
+        Forwarder forwarder;
+        std::unordered_map<uint64_t, ParkedQuery> parkedQueries;
+
+        // Batched mode state, preallocated once so recvmmsg/sendmmsg never allocate per batch.
+        std::vector<sockaddr_storage> peers;
+        std::vector<iovec> receiveVectors;
+        std::vector<mmsghdr> receiveMessages;
+        std::vector<iovec> sendVectors;
+        std::vector<mmsghdr> sendMessages;
+        std::vector<std::vector<uint8_t>> sendBuffers;
+
+        WorkerStats workerStats;
+    };
+
+    // Parses a textual IPv4 or IPv6 address into address, returning the length to pass to bind().
+    bool parseSocketAddress(const std::string& text, uint16_t port, sockaddr_storage& address, socklen_t& length);
+    // Parses ADDR, ADDR:PORT or [ADDR]:PORT, defaulting to port 53.
+    bool parseUpstreamAddress(const std::string& text, sockaddr_storage& address, socklen_t& length);
+}
@@ -7,9 +7,10 @@
 extern "C" {
 #endif
 
-/* Maximum length of CommonJS module identifier to resolve.  Length includes
- * both current module ID, requested (possibly relative) module ID, and a
- * slash in between.
+/* Length of CommonJS module identifier resolved in a stack buffer.  Length
+ * includes both current module ID, requested (possibly relative) module ID,
+ * and a slash in between.  Longer identifiers are resolved in a heap buffer,
+ * and every resolution is cached per heap.
  */
 #define  DUK_COMMONJS_MODULE_ID_LIMIT  256
 
@@ -0,0 +1,785 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "DNS.h"
+#include "Edns.h"
+#include "MessageFramer.h"
+
+// Replays a query mix against a server at a fixed rate and reports the latency distribution.
+//
+// Pacing is open loop: query i is due at start + i / rate whether or not earlier queries have
+// been answered, and its latency is measured from when it was due rather than when it went
+// out. A server that stalls therefore shows up as latency on every query it delayed, not as a
+// quiet drop in the send rate.
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    // Query ids index the in-flight table, so at most this many can be outstanding at once.
+    const size_t ID_COUNT = 65536;
+    const size_t MAX_MESSAGE = 65535;
+
+    struct LoadOptions {
+        std::string address = "127.0.0.1";
+        uint16_t port = 53;
+        bool tcp = false;
+        double rate = 10000;
+        double duration = 10;
+        double timeout = 1;
+        std::string queryFile;
+        std::string qtypes = "A:80,AAAA:15,MX:5";
+        std::string suffix = "example.com";
+        size_t names = 1000;
+        double zipf = 0;
+        uint64_t seed = 1;
+        bool printHistogram = false;
+        // UDP payload size advertised in an OPT record on each query. Zero sends no OPT.
+        uint16_t ednsPayloadSize = 0;
+    };
+
+    struct Query {
+        DNice::DomainName name;
+        DNice::Type qtype = DNice::Type::A;
+        std::vector<uint8_t> bytes;
+    };
+
+    // A log-linear latency histogram in the manner of HdrHistogram: exact below 2048 ns, and
+    // above that 1024 buckets per power of two, so every recorded value is kept to within 0.1%
+    // however large it is.
+    class LatencyHistogram {
+    public:
+        LatencyHistogram() : counts(LINEAR_COUNT + 54 * SUB_BUCKET_COUNT, 0) {}
+
+        void record(uint64_t value) {
+            counts[indexOf(value)]++;
+            total++;
+            maxValue = std::max(maxValue, value);
+        }
+
+        uint64_t count() const { return total; }
+        uint64_t max() const { return maxValue; }
+
+        // The smallest value at least percentile percent of recordings are no greater than.
+        uint64_t valueAtPercentile(double percentile) const {
+            const auto wanted = std::max<uint64_t>(1, (uint64_t)std::ceil(percentile / 100.0 * (double)total));
+            uint64_t seen = 0;
+            for (size_t i = 0; i < counts.size(); i++) {
+                seen += counts[i];
+                if (seen >= wanted) {
+                    return std::min(highestEquivalent(i), maxValue);
+                }
+            }
+
+            return maxValue;
+        }
+
+        // The percentile distribution in HdrHistogram's .hgrm layout, which its plotters accept.
+        void printDistribution(std::ostream& out, double unitScale) const {
+            out << std::setw(12) << "Value" << " " << std::setw(14) << "Percentile" << " " << std::setw(10) << "TotalCount"
+                << " " << std::setw(14) << "1/(1-Percentile)" << std::endl << std::endl;
+
+            uint64_t seen = 0;
+            for (size_t i = 0; i < counts.size(); i++) {
+                if (counts[i] == 0) {
+                    continue;
+                }
+
+                seen += counts[i];
+                const auto fraction = (double)seen / (double)total;
+                out << std::fixed << std::setprecision(3)
+                    << std::setw(12) << (double)std::min(highestEquivalent(i), maxValue) / unitScale
+                    << " " << std::setprecision(12) << std::setw(14) << fraction
+                    << " " << std::setw(10) << seen;
+                if (seen < total) {
+                    out << " " << std::setprecision(2) << std::setw(14) << 1.0 / (1.0 - fraction);
+                }
+
+                out << std::endl;
+            }
+
+            out << "#[Max = " << std::setprecision(3) << (double)maxValue / unitScale << ", Total count = " << total << "]" << std::endl;
+        }
+
+    private:
+        static const size_t LINEAR_COUNT = 2048;
+        static const size_t SUB_BUCKET_COUNT = 1024;
+        static const int SUB_BUCKET_BITS = 10;
+
+        static size_t indexOf(uint64_t value) {
+            if (value < LINEAR_COUNT) {
+                return (size_t)value;
+            }
+
+            const int exponent = 63 - __builtin_clzll(value);
+            const int shift = exponent - SUB_BUCKET_BITS;
+            return LINEAR_COUNT + (size_t)(exponent - 11) * SUB_BUCKET_COUNT + (size_t)((value >> shift) - SUB_BUCKET_COUNT);
+        }
+
+        static uint64_t highestEquivalent(size_t index) {
+            if (index < LINEAR_COUNT) {
+                return index;
+            }
+
+            const auto exponent = (int)((index - LINEAR_COUNT) / SUB_BUCKET_COUNT) + 11;
+            const auto subBucket = (uint64_t)((index - LINEAR_COUNT) % SUB_BUCKET_COUNT + SUB_BUCKET_COUNT);
+            const int shift = exponent - SUB_BUCKET_BITS;
+            return ((subBucket + 1) << shift) - 1;
+        }
+
+        std::vector<uint64_t> counts;
+        uint64_t total = 0;
+        uint64_t maxValue = 0;
+    };
+
+    // Shared between the sender and the receiver. A slot holds the time its query was due, in
+    // nanoseconds since the run started plus one, or zero when nothing is outstanding on that id.
+    struct InFlight {
+        std::atomic<uint64_t> due { 0 };
+        std::atomic<uint32_t> query { 0 };
+    };
+
+    struct Results {
+        uint64_t sent = 0;
+        uint64_t received = 0;
+        // Answers the sender gave up on because their id was needed again.
+        uint64_t overwritten = 0;
+        // Answers that did not parse, or did not match an outstanding query.
+        uint64_t invalid = 0;
+        uint64_t truncated = 0;
+        uint64_t noError = 0;
+        uint64_t nameError = 0;
+        uint64_t serverFailure = 0;
+        uint64_t otherCode = 0;
+        LatencyHistogram latency;
+    };
+
+    // Like strtoull, but the whole of text must be a number between min and max.
+    bool parseNumber(const char* text, unsigned long long min, unsigned long long max, unsigned long long& out) {
+        if (*text < '0' || *text > '9') {
+            return false;
+        }
+
+        char* end = nullptr;
+        errno = 0;
+        out = strtoull(text, &end, 10);
+        return errno == 0 && *end == '\0' && out >= min && out <= max;
+    }
+
+    // A finite, non-negative decimal taking up the whole of text.
+    bool parseReal(const char* text, double& out) {
+        if ((*text < '0' || *text > '9') && *text != '.') {
+            return false;
+        }
+
+        char* end = nullptr;
+        errno = 0;
+        out = strtod(text, &end);
+        return errno == 0 && *end == '\0' && std::isfinite(out);
+    }
+
+    void printUsage(const char* program) {
+        std::cerr
+            << "Usage: " << program << " [options]" << std::endl
+            << "  -a, --address ADDR   server address (default 127.0.0.1)" << std::endl
+            << "  -p, --port PORT      server port (default 53)" << std::endl
+            << "      --tcp            send over one pipelined TCP connection instead of UDP" << std::endl
+            << "  -r, --rate QPS       queries per second to send (default 10000)" << std::endl
+            << "  -d, --duration S     seconds to send for (default 10)" << std::endl
+            << "      --timeout S      seconds to wait for answers after the last send (default 1)" << std::endl
+            << "  -f, --queries FILE   replay queries from FILE, one \"name type\" per line" << std::endl
+            << "      --qtypes MIX     synthesized query types and weights (default A:80,AAAA:15,MX:5)" << std::endl
+            << "      --names N        distinct synthesized names (default 1000)" << std::endl
+            << "      --suffix NAME    zone the synthesized names are under (default example.com)" << std::endl
+            << "      --zipf S         Zipf exponent for name popularity, 0 for uniform (default 0)" << std::endl
+            << "      --seed N         seed for the synthesized mix (default 1)" << std::endl
+            << "      --histogram      print the full percentile distribution" << std::endl
+            << "      --edns SIZE      advertise SIZE bytes of UDP payload with EDNS (default: no EDNS)" << std::endl
+            << "  -h, --help           show this message" << std::endl;
+    }
+
+    bool parseOptions(int argc, char** argv, LoadOptions& options) {
+        enum { TCP = 256, TIMEOUT, QTYPES, NAMES, SUFFIX, ZIPF, SEED, HISTOGRAM, EDNS };
+
+        const option longOptions[] = {
+            { "address", required_argument, nullptr, 'a' },
+            { "port", required_argument, nullptr, 'p' },
+            { "tcp", no_argument, nullptr, TCP },
+            { "rate", required_argument, nullptr, 'r' },
+            { "duration", required_argument, nullptr, 'd' },
+            { "timeout", required_argument, nullptr, TIMEOUT },
+            { "queries", required_argument, nullptr, 'f' },
+            { "qtypes", required_argument, nullptr, QTYPES },
+            { "names", required_argument, nullptr, NAMES },
+            { "suffix", required_argument, nullptr, SUFFIX },
+            { "zipf", required_argument, nullptr, ZIPF },
+            { "seed", required_argument, nullptr, SEED },
+            { "histogram", no_argument, nullptr, HISTOGRAM },
+            { "edns", required_argument, nullptr, EDNS },
+            { "help", no_argument, nullptr, 'h' },
+            { nullptr, 0, nullptr, 0 },
+        };
+
+        int opt;
+        unsigned long long value = 0;
+        while ((opt = getopt_long(argc, argv, "a:p:r:d:f:h", longOptions, nullptr)) != -1) {
+            switch (opt) {
+                case 'a':
+                    options.address = optarg;
+                    break;
+                case 'p':
+                    if (!parseNumber(optarg, 1, UINT16_MAX, value)) {
+                        return false;
+                    }
+
+                    options.port = (uint16_t)value;
+                    break;
+                case TCP:
+                    options.tcp = true;
+                    break;
+                case 'r':
+                    if (!parseReal(optarg, options.rate)) {
+                        return false;
+                    }
+
+                    break;
+                case 'd':
+                    if (!parseReal(optarg, options.duration)) {
+                        return false;
+                    }
+
+                    break;
+                case TIMEOUT:
+                    if (!parseReal(optarg, options.timeout)) {
+                        return false;
+                    }
+
+                    break;
+                case 'f':
+                    options.queryFile = optarg;
+                    break;
+                case QTYPES:
+                    options.qtypes = optarg;
+                    break;
+                case NAMES:
+                    if (!parseNumber(optarg, 1, SIZE_MAX, value)) {
+                        return false;
+                    }
+
+                    options.names = (size_t)value;
+                    break;
+                case SUFFIX:
+                    options.suffix = optarg;
+                    break;
+                case ZIPF:
+                    if (!parseReal(optarg, options.zipf)) {
+                        return false;
+                    }
+
+                    break;
+                case SEED:
+                    if (!parseNumber(optarg, 0, ULLONG_MAX, value)) {
+                        return false;
+                    }
+
+                    options.seed = value;
+                    break;
+                case HISTOGRAM:
+                    options.printHistogram = true;
+                    break;
+                case EDNS:
+                    // As for the server: 0 for no EDNS, otherwise what RFC 6891 allows.
+                    if (!parseNumber(optarg, 0, UINT16_MAX, value) || (value != 0 && value < DNice::MIN_UDP_PAYLOAD_SIZE)) {
+                        return false;
+                    }
+
+                    options.ednsPayloadSize = (uint16_t)value;
+                    break;
+                default:
+                    return false;
+            }
+        }
+
+        return options.rate > 0 && options.duration > 0 && options.names > 0;
+    }
+
+    bool parseType(const std::string& text, DNice::Type& type) {
+        static const std::pair<const char*, DNice::Type> mnemonics[] = {
+            { "A", DNice::Type::A },
+            { "NS", DNice::Type::NS },
+            { "CNAME", DNice::Type::CNAME },
+            { "SOA", DNice::Type::SOA },
+            { "PTR", DNice::Type::PTR },
+            { "MX", DNice::Type::MX },
+            { "TXT", DNice::Type::TXT },
+            { "AAAA", DNice::Type::AAAA },
+            { "SRV", DNice::Type::SRV },
+            { "ANY", DNice::Type::ANY },
+        };
+
+        for (const auto& mnemonic : mnemonics) {
+            if (strcasecmp(text.c_str(), mnemonic.first) == 0) {
+                type = mnemonic.second;
+                return true;
+            }
+        }
+
+        char* end = nullptr;
+        const auto value = strtoul(text.c_str(), &end, 10);
+        if (text.empty() || *end != '\0' || value > 0xFFFF) {
+            return false;
+        }
+
+        type = (DNice::Type)value;
+        return true;
+    }
+
+    bool makeQuery(const std::string& name, DNice::Type qtype, uint16_t ednsPayloadSize, Query& query, std::string& error) {
+        const auto nameError = query.name.assign(name);
+        if (nameError != DNice::DnsError::None) {
+            error = "invalid name \"" + name + "\": " + DNice::describeError(nameError);
+            return false;
+        }
+
+        query.qtype = qtype;
+
+        DNice::Packet packet;
+        packet.recursionDesired = true;
+        DNice::Question question;
+        question.label.domainName = query.name;
+        question.qtype = qtype;
+        packet.questions.push_back(question);
+
+        if (ednsPayloadSize > 0) {
+            DNice::Edns edns;
+            edns.udpPayloadSize = ednsPayloadSize;
+            DNice::encodeEdns(edns, packet.additionalRecords.emplace_back());
+        }
+
+        const auto serializeError = DNice::serializeDnsPacket(packet, query.bytes);
+        if (serializeError != DNice::DnsError::None) {
+            error = "can't encode \"" + name + "\": " + DNice::describeError(serializeError);
+            return false;
+        }
+
+        return true;
+    }
+
+    // dnsperf's format: one "name type" per line, the type defaulting to A. Blank lines and
+    // lines starting with '#' are skipped.
+    bool loadQueries(const LoadOptions& options, std::vector<Query>& queries, std::string& error) {
+        const auto& path = options.queryFile;
+        std::ifstream file(path);
+        if (!file) {
+            error = "can't open " + path;
+            return false;
+        }
+
+        std::string line;
+        while (std::getline(file, line)) {
+            std::istringstream fields(line);
+            std::string name;
+            std::string typeText = "A";
+            if (!(fields >> name) || name[0] == '#') {
+                continue;
+            }
+
+            fields >> typeText;
+
+            Query query;
+            DNice::Type qtype;
+            if (!parseType(typeText, qtype)) {
+                error = "unknown type \"" + typeText + "\" in " + path;
+                return false;
+            }
+
+            if (!makeQuery(name, qtype, options.ednsPayloadSize, query, error)) {
+                return false;
+            }
+
+            queries.push_back(std::move(query));
+        }
+
+        if (queries.empty()) {
+            error = "no queries in " + path;
+            return false;
+        }
+
+        return true;
+    }
+
+    // A sequence of queries for names host<rank>.<suffix>, with rank drawn from a Zipf
+    // distribution and the type from the weighted mix, long enough to cover a run without
+    // repeating a short cycle.
+    bool synthesizeQueries(const LoadOptions& options, std::vector<Query>& queries, std::string& error) {
+        std::vector<DNice::Type> types;
+        std::vector<double> typeWeights;
+
+        std::istringstream mix(options.qtypes);
+        std::string entry;
+        while (std::getline(mix, entry, ',')) {
+            const auto colon = entry.find(':');
+            DNice::Type qtype;
+            if (!parseType(entry.substr(0, colon), qtype)) {
+                error = "unknown type in \"" + entry + "\"";
+                return false;
+            }
+
+            types.push_back(qtype);
+            typeWeights.push_back(colon == std::string::npos ? 1.0 : strtod(entry.c_str() + colon + 1, nullptr));
+        }
+
+        if (types.empty()) {
+            error = "empty --qtypes";
+            return false;
+        }
+
+        std::vector<double> nameWeights(options.names);
+        for (size_t i = 0; i < options.names; i++) {
+            nameWeights[i] = 1.0 / std::pow((double)(i + 1), options.zipf);
+        }
+
+        std::mt19937_64 random(options.seed);
+        std::discrete_distribution<size_t> pickType(typeWeights.begin(), typeWeights.end());
+        std::discrete_distribution<size_t> pickName(nameWeights.begin(), nameWeights.end());
+
+        const auto count = (size_t)std::min(std::max(options.rate * options.duration, 1.0), (double)(1 << 20));
+        for (size_t i = 0; i < count; i++) {
+            Query query;
+            const auto name = "host" + std::to_string(pickName(random)) + "." + options.suffix;
+            if (!makeQuery(name, types[pickType(random)], options.ednsPayloadSize, query, error)) {
+                return false;
+            }
+
+            queries.push_back(std::move(query));
+        }
+
+        return true;
+    }
+
+    int connectTo(const LoadOptions& options, std::string& error) {
+        addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+        hints.ai_socktype = options.tcp ? SOCK_STREAM : SOCK_DGRAM;
+
+        addrinfo* address = nullptr;
+        const auto port = std::to_string(options.port);
+        const auto lookup = getaddrinfo(options.address.c_str(), port.c_str(), &hints, &address);
+        if (lookup != 0) {
+            error = "invalid address " + options.address + ": " + gai_strerror(lookup);
+            return -1;
+        }
+
+        const int fd = socket(address->ai_family, address->ai_socktype, 0);
+        if (fd < 0 || connect(fd, address->ai_addr, address->ai_addrlen) < 0) {
+            error = "can't connect to " + options.address + ": " + strerror(errno);
+            freeaddrinfo(address);
+            if (fd >= 0) {
+                close(fd);
+            }
+
+            return -1;
+        }
+
+        freeaddrinfo(address);
+
+        // Wake the receiver periodically so it notices the end of the run.
+        timeval receiveTimeout { 0, 100000 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &receiveTimeout, sizeof(receiveTimeout));
+
+        int size = 4 * 1024 * 1024;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+        if (options.tcp) {
+            int noDelay = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        }
+
+        return fd;
+    }
+
+    uint64_t elapsedNanoseconds(Clock::time_point start) {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    }
+
+    // Scratch space for checkAnswer, kept by the receiver so answers are checked without allocating.
+    struct AnswerScratch {
+        std::vector<uint8_t> bytes;
+        DNice::Packet answer;
+    };
+
+    void checkAnswer(
+        const uint8_t* message,
+        size_t length,
+        const std::vector<Query>& queries,
+        std::vector<InFlight>& inFlight,
+        Clock::time_point start,
+        AnswerScratch& scratch,
+        Results& results
+    ) {
+        const auto now = elapsedNanoseconds(start);
+
+        const auto& bytes = scratch.bytes;
+        auto& answer = scratch.answer;
+        scratch.bytes.assign(message, message + length);
+        if (DNice::parseDnsPacket(bytes, answer) != DNice::DnsError::None || !answer.isResponse) {
+            results.invalid++;
+            return;
+        }
+
+        auto& slot = inFlight[answer.id];
+        const auto due = slot.due.exchange(0, std::memory_order_acquire);
+        if (due == 0) {
+            results.invalid++;
+            return;
+        }
+
+        // The answer must be for the question asked.
+        const auto& query = queries[slot.query.load(std::memory_order_relaxed)];
+        if (answer.questions.size() != 1 ||
+            answer.questions[0].label.domainName != query.name ||
+            answer.questions[0].qtype != query.qtype) {
+            results.invalid++;
+            return;
+        }
+
+        results.received++;
+        results.latency.record(now > due - 1 ? now - (due - 1) : 0);
+
+        if (answer.isTruncated) {
+            results.truncated++;
+        }
+
+        switch (answer.responseCode) {
+            case DNice::ResponseCode::NoError:
+                results.noError++;
+                break;
+            case DNice::ResponseCode::NameError:
+                results.nameError++;
+                break;
+            case DNice::ResponseCode::ServerFailure:
+                results.serverFailure++;
+                break;
+            default:
+                results.otherCode++;
+                break;
+        }
+    }
+
+    void receiveAnswers(
+        int fd,
+        const LoadOptions& options,
+        const std::vector<Query>& queries,
+        std::vector<InFlight>& inFlight,
+        Clock::time_point start,
+        const std::atomic<bool>& running,
+        std::atomic<uint64_t>& handled,
+        Results& results
+    ) {
+        AnswerScratch scratch;
+        std::vector<uint8_t> buffer(MAX_MESSAGE + DNice::MessageFramer::LENGTH_PREFIX_SIZE);
+        DNice::MessageFramer framer;
+
+        while (running.load(std::memory_order_relaxed)) {
+            const auto received = recv(fd, buffer.data(), buffer.size(), 0);
+            if (received <= 0) {
+                if (received == 0) {
+                    std::cerr << "server closed the connection" << std::endl;
+                    return;
+                }
+
+                continue;
+            }
+
+            if (!options.tcp) {
+                checkAnswer(buffer.data(), (size_t)received, queries, inFlight, start, scratch, results);
+                handled.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+
+            framer.consume(buffer.data(), (size_t)received, [&](const uint8_t* answer, size_t length) {
+                checkAnswer(answer, length, queries, inFlight, start, scratch, results);
+                handled.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            });
+        }
+    }
+
+    void sendQueries(
+        int fd,
+        const LoadOptions& options,
+        const std::vector<Query>& queries,
+        std::vector<InFlight>& inFlight,
+        Clock::time_point start,
+        Results& results
+    ) {
+        const auto interval = 1e9 / options.rate;
+        const auto end = (uint64_t)(options.duration * 1e9);
+        std::vector<uint8_t> message;
+        message.reserve(MAX_MESSAGE + 2);
+
+        for (uint64_t i = 0;; i++) {
+            const auto due = (uint64_t)((double)i * interval);
+            if (due >= end) {
+                break;
+            }
+
+            // Sleep until shortly before the query is due, then spin the rest of the way.
+            auto now = elapsedNanoseconds(start);
+            if (due > now + 100000) {
+                std::this_thread::sleep_for(std::chrono::nanoseconds(due - now - 50000));
+            }
+
+            while (elapsedNanoseconds(start) < due) {
+            }
+
+            const auto queryIndex = (uint32_t)(i % queries.size());
+            const auto& query = queries[queryIndex];
+            const auto id = (uint16_t)(i % ID_COUNT);
+
+            auto& slot = inFlight[id];
+            if (slot.due.exchange(0, std::memory_order_acquire) != 0) {
+                results.overwritten++;
+            }
+
+            slot.query.store(queryIndex, std::memory_order_relaxed);
+            slot.due.store(due + 1, std::memory_order_release);
+
+            message.clear();
+            if (options.tcp) {
+                DNice::pushValue(message, (uint16_t)query.bytes.size());
+            }
+
+            DNice::pushValue(message, id);
+            message.insert(message.end(), query.bytes.begin() + 2, query.bytes.end());
+
+            if (send(fd, message.data(), message.size(), MSG_NOSIGNAL) < 0) {
+                slot.due.store(0, std::memory_order_relaxed);
+                if (options.tcp) {
+                    std::cerr << "send failed: " << strerror(errno) << std::endl;
+                    return;
+                }
+
+                continue;
+            }
+
+            results.sent++;
+        }
+    }
+
+    void printResults(const LoadOptions& options, const Results& sender, const Results& receiver, double seconds) {
+        const auto lost = sender.sent - std::min(sender.sent, receiver.received);
+
+        std::cout
+            << "sent " << sender.sent
+            << ", answered " << receiver.received
+            << ", lost " << lost
+            << " (" << sender.overwritten << " given up when their id was reused)"
+            << ", invalid " << receiver.invalid
+            << ", truncated " << receiver.truncated << std::endl;
+
+        std::cout
+            << "rcodes: NOERROR " << receiver.noError
+            << ", NXDOMAIN " << receiver.nameError
+            << ", SERVFAIL " << receiver.serverFailure
+            << ", other " << receiver.otherCode << std::endl;
+
+        std::cout << std::fixed << std::setprecision(0)
+            << "rate: target " << options.rate
+            << " qps, sent " << (double)sender.sent / seconds
+            << " qps, answered " << (double)receiver.received / seconds << " qps" << std::endl;
+
+        const auto& latency = receiver.latency;
+        if (latency.count() == 0) {
+            return;
+        }
+
+        std::cout << std::setprecision(1) << "latency (us):";
+        const std::pair<const char*, double> percentiles[] = {
+            { "p50", 50.0 }, { "p90", 90.0 }, { "p99", 99.0 }, { "p99.9", 99.9 }, { "p99.99", 99.99 },
+        };
+
+        for (const auto& percentile : percentiles) {
+            std::cout << " " << percentile.first << " " << (double)latency.valueAtPercentile(percentile.second) / 1000.0;
+        }
+
+        std::cout << " max " << (double)latency.max() / 1000.0 << std::endl;
+
+        if (options.printHistogram) {
+            std::cout << std::endl;
+            latency.printDistribution(std::cout, 1000.0);
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    LoadOptions options;
+    if (!parseOptions(argc, argv, options)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    std::string error;
+    std::vector<Query> queries;
+    const bool loaded = options.queryFile.empty() ?
+        synthesizeQueries(options, queries, error) :
+        loadQueries(options, queries, error);
+    if (!loaded) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+
+    const int fd = connectTo(options, error);
+    if (fd < 0) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+
+    std::vector<InFlight> inFlight(ID_COUNT);
+    Results sender;
+    Results receiver;
+    std::atomic<bool> running { true };
+    std::atomic<uint64_t> handled { 0 };
+
+    const auto start = Clock::now();
+    std::thread receiverThread(
+        receiveAnswers, fd, std::cref(options), std::cref(queries), std::ref(inFlight), start, std::cref(running), std::ref(handled), std::ref(receiver)
+    );
+
+    sendQueries(fd, options, queries, inFlight, start, sender);
+    const auto sendSeconds = (double)elapsedNanoseconds(start) / 1e9;
+
+    // Give the last queries their chance to be answered.
+    const auto drainEnd = Clock::now() + std::chrono::duration<double>(options.timeout);
+    while (Clock::now() < drainEnd && handled.load(std::memory_order_relaxed) < sender.sent) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    running = false;
+    receiverThread.join();
+    close(fd);
+
+    printResults(options, sender, receiver, sendSeconds);
+    return 0;
+}
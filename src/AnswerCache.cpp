@@ -0,0 +1,168 @@
+#include "AnswerCache.h"
+
+#include <algorithm>
+
+namespace DNice {
+    namespace {
+        // Records the offset of each TTL field in the serialized response and returns the
+        // smallest TTL, which bounds how long the whole response stays valid. OPT pseudo-records
+        // are skipped, as their TTL field holds EDNS flags.
+        bool findTtls(const std::vector<uint8_t>& bytes, std::vector<uint16_t>& offsets, uint32_t& ttl) {
+            PacketView view(bytes.data(), bytes.size());
+            if (view.index() != DnsError::None) {
+                return false;
+            }
+
+            offsets.clear();
+            ttl = UINT32_MAX;
+
+            for (const auto& section : { view.answers(), view.authorities(), view.additionalRecords() }) {
+                for (const auto& resource : section) {
+                    if (resource.rtype == Type::OPT) {
+                        continue;
+                    }
+
+                    // TTL, then the RDATA length, sit just before the RDATA.
+                    offsets.push_back((uint16_t)(resource.data.offset - 6));
+                    ttl = std::min(ttl, resource.ttl);
+                }
+            }
+
+            return !offsets.empty();
+        }
+    }
+
+    AnswerCache::AnswerCache(size_t capacity) :
+        capacity(capacity) {
+        entries.reserve(capacity);
+    }
+
+    bool AnswerCache::Key::operator==(const Key& other) const {
+        return qtype == other.qtype && qclass == other.qclass && recursionDesired == other.recursionDesired &&
+            checkingDisabled == other.checkingDisabled && edns == other.edns && dnssecOk == other.dnssecOk &&
+            name == other.name;
+    }
+
+    size_t AnswerCache::KeyHash::operator()(const Key& key) const {
+        const auto extra = ((size_t)key.qtype << 20) | ((size_t)key.qclass << 4) | ((size_t)key.edns << 3) |
+            ((size_t)key.dnssecOk << 2) | ((size_t)key.recursionDesired << 1) | (size_t)key.checkingDisabled;
+        return key.name.hash() ^ (extra * 0x9e3779b97f4a7c15ull);
+    }
+
+    bool AnswerCache::makeKey(const PacketView& query, const Edns* edns, Key& key) const {
+        if (!enabled() || query.size() < DNS_HEADER_SIZE || query.opcode() != Opcode::Query ||
+            query.questionCount() != 1) {
+            return false;
+        }
+
+        size_t offset = DNS_HEADER_SIZE;
+        QuestionView question;
+        if (!query.readQuestion(offset, question) || !query.readDomainName(question.name, key.name)) {
+            return false;
+        }
+
+        // Query names are never compressed in practice, so a pointer just makes the query
+        // uncacheable. That keeps the name's span the same length as the cached copy in find().
+        if (question.name.length != key.name.wireLength()) {
+            return false;
+        }
+
+        key.qtype = question.qtype;
+        key.qclass = question.qclass;
+        key.recursionDesired = query.recursionDesired();
+        key.checkingDisabled = query.checkingDisabled();
+        key.edns = edns != nullptr;
+        key.dnssecOk = edns != nullptr && edns->dnssecOk;
+        return true;
+    }
+
+    bool AnswerCache::find(const PacketView& query, const Key& key, Clock::time_point now, size_t maxLength, std::vector<uint8_t>& out) {
+        const auto existing = entries.find(key);
+        if (existing == entries.end()) {
+            return false;
+        }
+
+        if (existing->second.expires <= now) {
+            entries.erase(existing);
+            return false;
+        }
+
+        const auto& entry = existing->second;
+        if (entry.response.size() > maxLength) {
+            return false;
+        }
+
+        out.assign(entry.response.begin(), entry.response.end());
+
+        const auto id = query.id();
+        out[0] = (uint8_t)(id >> 8);
+        out[1] = (uint8_t)(id & 0xff);
+
+        // The response's first name is the uncompressed question, which only differs from the
+        // query's in case, so the query's spelling can be copied straight over it. Resolvers
+        // that randomize the case of their queries check that it comes back unchanged.
+        const auto nameLength = key.name.wireLength();
+        std::copy(query.data() + DNS_HEADER_SIZE, query.data() + DNS_HEADER_SIZE + nameLength,
+            out.begin() + DNS_HEADER_SIZE);
+
+        // Count TTLs down by the time spent in the cache. None can reach zero, since the entry
+        // expires with the smallest of them.
+        const auto age = (uint32_t)std::chrono::duration_cast<std::chrono::seconds>(now - entry.stored).count();
+        if (age > 0) {
+            for (const auto offset : entry.ttlOffsets) {
+                const auto ttl = getValue<uint32_t>(entry.response.data(), offset) - age;
+                out[offset] = (uint8_t)(ttl >> 24);
+                out[offset + 1] = (uint8_t)(ttl >> 16);
+                out[offset + 2] = (uint8_t)(ttl >> 8);
+                out[offset + 3] = (uint8_t)ttl;
+            }
+        }
+
+        return true;
+    }
+
+    void AnswerCache::insert(const Key& key, const Packet& response, const std::vector<uint8_t>& bytes, Clock::time_point now) {
+        if (!enabled() || bytes.size() < DNS_HEADER_SIZE ||
+            (response.responseCode != ResponseCode::NoError && response.responseCode != ResponseCode::NameError)) {
+            return;
+        }
+
+        // TC is set while serializing when the answer didn't fit, so only the bytes show it. A
+        // client with more room must not be handed the cut-down copy.
+        if (PacketView(bytes.data(), bytes.size()).isTruncated()) {
+            return;
+        }
+
+        uint32_t ttl = 0;
+        if (!findTtls(bytes, ttlOffsets, ttl) || ttl == 0) {
+            return;
+        }
+
+        if (entries.size() >= capacity && entries.find(key) == entries.end()) {
+            evict(now);
+        }
+
+        auto& entry = entries[key];
+        entry.response = bytes;
+        entry.ttlOffsets = ttlOffsets;
+        entry.stored = now;
+        entry.expires = now + std::chrono::seconds(ttl);
+    }
+
+    void AnswerCache::evict(Clock::time_point now) {
+        for (auto entry = entries.begin(); entry != entries.end();) {
+            if (entry->second.expires <= now) {
+                entry = entries.erase(entry);
+            } else {
+                ++entry;
+            }
+        }
+
+        // Too little had expired. Drop an arbitrary eighth of the cache rather than a single
+        // entry, so the scan above runs once per many inserts instead of on every one.
+        const auto target = capacity - capacity / 8 - 1;
+        while (entries.size() > target) {
+            entries.erase(entries.begin());
+        }
+    }
+}
@@ -0,0 +1,140 @@
+#include "BytecodeCache.h"
+
+#include "DNS.h"
+
+#include "duktape.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+namespace DNice {
+    namespace {
+        const char CACHE_MAGIC[4] = { 'D', 'N', 'B', 'C' };
+        const size_t CACHE_HEADER_SIZE = 16;
+
+        // The duk_config.h choices that change what a dumped function looks like or how the
+        // executor reads it, so a binary rebuilt with different ones never loads stale bytecode.
+        const char BUILD_FINGERPRINT[] =
+#if defined(DUK_USE_PACKED_TVAL)
+            "packed-tval "
+#endif
+#if defined(DUK_USE_FASTINT)
+            "fastint "
+#endif
+#if defined(DUK_USE_64BIT_OPS)
+            "64bit-ops "
+#endif
+#if defined(DUK_USE_INTERRUPT_COUNTER)
+            "interrupt-counter "
+#endif
+#if defined(DUK_USE_EXEC_TIMEOUT_CHECK)
+            "exec-timeout-check "
+#endif
+#if defined(DUK_USE_DEBUGGER_SUPPORT)
+            "debugger "
+#endif
+#if defined(DUK_USE_PC2LINE)
+            "pc2line "
+#endif
+#if defined(DUK_USE_REFERENCE_COUNTING)
+            "refcount "
+#endif
+#if defined(DUK_USE_ROM_OBJECTS)
+            "rom-objects "
+#endif
+#if defined(DUK_USE_LIGHTFUNC_BUILTINS)
+            "lightfunc-builtins "
+#endif
+            ;
+
+        uint64_t fnv1a(uint64_t hash, const void* data, size_t length) {
+            auto bytes = (const uint8_t*)data;
+            for (size_t i = 0; i < length; i++) {
+                hash ^= bytes[i];
+                hash *= 0x100000001b3ULL;
+            }
+
+            return hash;
+        }
+    }
+
+    BytecodeCache::BytecodeCache(const std::string& directory) :
+        directory(directory) {
+    }
+
+    uint64_t BytecodeCache::key(const std::string& source, const std::string& fileName) {
+        const long version = DUK_VERSION;
+        const char* describe = DUK_GIT_DESCRIBE;
+
+        // Hashed as raw bytes, 0x01020304 also records the native byte order.
+        const uint32_t markers[] = { DUK_USE_BYTEORDER, (uint32_t)sizeof(void*), (uint32_t)sizeof(duk_double_t), 0x01020304 };
+
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        hash = fnv1a(hash, &version, sizeof(version));
+        hash = fnv1a(hash, describe, strlen(describe));
+        hash = fnv1a(hash, BUILD_FINGERPRINT, sizeof(BUILD_FINGERPRINT));
+        hash = fnv1a(hash, markers, sizeof(markers));
+        // Bytecode embeds the file name for stack traces, so it is part of the key too.
+        hash = fnv1a(hash, fileName.data(), fileName.length() + 1);
+        hash = fnv1a(hash, source.data(), source.length());
+
+        return hash;
+    }
+
+    std::string BytecodeCache::pathFor(uint64_t key) const {
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.dukbc", (unsigned long long)key);
+        return directory + "/" + name;
+    }
+
+    bool BytecodeCache::load(uint64_t key, std::vector<uint8_t>& bytecode) const {
+        std::ifstream file(pathFor(key), std::ios::binary);
+        if (!file) {
+            return false;
+        }
+
+        std::vector<uint8_t> contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if (contents.size() < CACHE_HEADER_SIZE || memcmp(contents.data(), CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0) {
+            return false;
+        }
+
+        // Duktape trusts loaded bytecode completely, so anything that doesn't match exactly is
+        // treated as a miss rather than handed to duk_load_function.
+        const auto storedKey = getValue<uint64_t>(contents, 4);
+        const auto length = getValue<uint32_t>(contents, 12);
+        if (storedKey != key || length != contents.size() - CACHE_HEADER_SIZE) {
+            return false;
+        }
+
+        bytecode.assign(contents.begin() + CACHE_HEADER_SIZE, contents.end());
+        return true;
+    }
+
+    bool BytecodeCache::store(uint64_t key, const std::vector<uint8_t>& bytecode, std::string& error) const {
+        std::vector<uint8_t> contents(CACHE_MAGIC, CACHE_MAGIC + sizeof(CACHE_MAGIC));
+        pushValue(contents, key);
+        pushValue(contents, (uint32_t)bytecode.size());
+        pushValue(contents, bytecode);
+
+        // Write next to the final path and rename, so a concurrent reader never sees half a file.
+        const auto path = pathFor(key);
+        const auto temporaryPath = path + ".tmp";
+
+        {
+            std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+            if (!file.write((const char*)contents.data(), (std::streamsize)contents.size())) {
+                error = "Could not write bytecode cache: " + temporaryPath;
+                return false;
+            }
+        }
+
+        if (rename(temporaryPath.c_str(), path.c_str()) != 0) {
+            error = "Could not write bytecode cache: " + path;
+            return false;
+        }
+
+        return true;
+    }
+}
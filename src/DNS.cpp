@@ -1,10 +1,33 @@
 #include "DNS.h"
 
-#include <sstream>
+#include "Rdata.h"
+
+#include <algorithm>
 
 namespace DNice {
-    void pushValue(std::vector<uint8_t>& receiver, const std::vector<uint8_t>& value) {
-        receiver.insert(receiver.end(), value.begin(), value.end());
+    Resource::Resource(const Resource& other, const allocator_type& allocator) :
+        label(other.label),
+        rtype(other.rtype),
+        rclass(other.rclass),
+        ttl(other.ttl),
+        length(other.length),
+        data(other.data, allocator) {
+    }
+
+    Resource::Resource(Resource&& other, const allocator_type& allocator) :
+        label(other.label),
+        rtype(other.rtype),
+        rclass(other.rclass),
+        ttl(other.ttl),
+        length(other.length),
+        data(std::move(other.data), allocator) {
+    }
+
+    Packet::Packet(std::pmr::memory_resource* resource) :
+        questions(resource),
+        answers(resource),
+        authorities(resource),
+        additionalRecords(resource) {
     }
 
     bool getFlag(uint8_t byte, uint8_t index) {
@@ -17,115 +40,331 @@ namespace DNice {
         if (value) {
             byte |= mask;
         } else {
-            byte &= !mask;
+            byte &= ~mask;
         }
     }
 
-    std::tuple<Label, size_t> parseLabel(const std::vector<uint8_t>& bytes, size_t start) {
-        // If the first two bits are set, this is a pointer.
-        if ((bytes[start] & LABEL_POINTER_FLAGS) == LABEL_POINTER_FLAGS) {
+    const char* describeError(DnsError error) {
+        switch (error) {
+            case DnsError::None:
+                return "No error.";
+            case DnsError::Truncated:
+                return "Message ends in the middle of a field.";
+            case DnsError::BadLabelType:
+                return "Label uses a reserved type.";
+            case DnsError::BadPointer:
+                return "Compression pointer does not point back into the message.";
+            case DnsError::TooManyPointers:
+                return "Name chains through too many compression pointers.";
+            case DnsError::LabelTooLong:
+                return "Label is longer than 63 bytes.";
+            case DnsError::NameTooLong:
+                return "Name is longer than 255 bytes.";
+            case DnsError::EmptyLabel:
+                return "Name has an empty label.";
+            case DnsError::DataLengthMismatch:
+                return "Resource length does not match its data.";
+            case DnsError::BadRdata:
+                return "Record data does not match its type.";
+            case DnsError::TypeMismatch:
+                return "Record is not of the requested type.";
+            case DnsError::BufferTooSmall:
+                return "Message does not fit in the buffer.";
+            case DnsError::BadOpt:
+                return "Message has a misplaced or repeated OPT record.";
+        }
+
+        return "Unknown error.";
+    }
+
+    namespace {
+        DnsError decodeName(const uint8_t* bytes, size_t size, size_t& index, Label& label, NameMemo* memo, int hops, int& pointers);
+
+        // The dotted form of the name a compression pointer refers to. hops counts the pointers
+        // already followed for the name being decoded, and pointers is set to how many were
+        // followed from this one on, itself included.
+        DnsError resolvePointer(const uint8_t* bytes, size_t size, uint16_t address, DomainName& name, NameMemo* memo, int hops, int& pointers) {
+            if (++hops > MAX_POINTER_HOPS) {
+                return DnsError::TooManyPointers;
+            }
+
+            if (memo != nullptr) {
+                if (const auto existing = memo->find(address)) {
+                    if (hops + existing->pointers > MAX_POINTER_HOPS) {
+                        return DnsError::TooManyPointers;
+                    }
+
+                    name = existing->name;
+                    pointers = existing->pointers + 1;
+                    return DnsError::None;
+                }
+            }
+
+            // decodeName only accepts pointers to before themselves, so this recursion always
+            // moves backward through the message as well as being capped by hops.
             Label label;
-            label.isPointer = true;
+            size_t index = address;
+            int inner = 0;
+            auto error = decodeName(bytes, size, index, label, memo, hops, inner);
+            if (error == DnsError::None) {
+                if (label.isPointer) {
+                    error = resolvePointer(bytes, size, label.pointerAddress, name, memo, hops, inner);
+                } else {
+                    name = std::move(label.domainName);
+                }
+            }
 
-            uint16_t address = (uint16_t)(bytes[start] & ~LABEL_POINTER_FLAGS);
-            address <<= 8;
-            address |= bytes[start + 1];
-            label.pointerAddress = address;
+            if (error != DnsError::None) {
+                return error;
+            }
 
-            return std::make_tuple(label, start + 2);
+            if (memo != nullptr) {
+                memo->add(address, name, inner);
+            }
+
+            pointers = inner + 1;
+            return DnsError::None;
         }
 
-        std::stringstream domain;
+        DnsError decodeName(const uint8_t* bytes, size_t size, size_t& index, Label& label, NameMemo* memo, int hops, int& pointers) {
+            const auto start = index;
+            pointers = 0;
+            if (index >= size) {
+                return DnsError::Truncated;
+            }
 
-        auto i = start;
-        bool isEmpty = true;
+            // If the first two bits are set, this is a pointer.
+            if ((bytes[index] & LABEL_POINTER_FLAGS) == LABEL_POINTER_FLAGS) {
+                if (index + 2 > size) {
+                    return DnsError::Truncated;
+                }
 
-        while (i < bytes.size()) {
-            auto len = (size_t)bytes[i];
-            if (len == 0) {
-                i += 1;
-                break;
-            }
+                label.isPointer = true;
+                label.pointerAddress = getValue<uint16_t>(bytes, index) & MAX_POINTER_ADDRESS;
+                label.domainName.clear();
+
+                if (label.pointerAddress >= start) {
+                    return DnsError::BadPointer;
+                }
 
-            if (!isEmpty) {
-                domain << '.';
+                index += 2;
+                return DnsError::None;
             }
 
-            auto end = i + len;
-            i += 1;
+            label.isPointer = false;
+            label.pointerAddress = 0;
+
+            auto& domain = label.domainName;
+            domain.clear();
+
+            while (true) {
+                if (index >= size) {
+                    return DnsError::Truncated;
+                }
+
+                const auto len = (size_t)bytes[index];
+
+                // A name may end in a pointer to a suffix written earlier in the packet.
+                if ((len & LABEL_POINTER_FLAGS) == LABEL_POINTER_FLAGS) {
+                    if (index + 2 > size) {
+                        return DnsError::Truncated;
+                    }
+
+                    const auto address = (uint16_t)(getValue<uint16_t>(bytes, index) & MAX_POINTER_ADDRESS);
+                    if (address >= start) {
+                        return DnsError::BadPointer;
+                    }
 
-            while (i <= end) {
-                domain << (char)bytes[i];
-                i += 1;
-                isEmpty = false;
+                    DomainName suffix;
+                    auto error = resolvePointer(bytes, size, address, suffix, memo, hops, pointers);
+                    if (error == DnsError::None) {
+                        error = domain.append(suffix);
+                    }
+
+                    if (error != DnsError::None) {
+                        return error;
+                    }
+
+                    index += 2;
+                    return DnsError::None;
+                }
+
+                // 0x40 and 0x80 are reserved label types.
+                if ((len & LABEL_POINTER_FLAGS) != 0) {
+                    return DnsError::BadLabelType;
+                }
+
+                index += 1;
+                if (len == 0) {
+                    break;
+                }
+
+                if (index + len > size) {
+                    return DnsError::Truncated;
+                }
+
+                const auto error = domain.appendLabel(bytes + index, len);
+                if (error != DnsError::None) {
+                    return error;
+                }
+
+                index += len;
             }
+
+            return DnsError::None;
         }
+    }
+
+    DnsError parseLabel(const std::vector<uint8_t>& bytes, size_t& index, Label& label, NameMemo* memo) {
+        int pointers = 0;
+        return decodeName(bytes.data(), bytes.size(), index, label, memo, 0, pointers);
+    }
 
+    DnsError decodeDomainName(const uint8_t* bytes, size_t size, size_t index, DomainName& name, NameMemo* memo) {
         Label label;
-        label.isPointer = false;
-        label.domainName = domain.str();
+        int pointers = 0;
+        const auto error = decodeName(bytes, size, index, label, memo, 0, pointers);
+        if (error != DnsError::None) {
+            return error;
+        }
+
+        if (label.isPointer) {
+            return resolvePointer(bytes, size, label.pointerAddress, name, memo, 0, pointers);
+        }
+
+        name = label.domainName;
+        return DnsError::None;
+    }
+
+    bool NameCompressionTable::find(std::string_view suffix, uint16_t& offset) const {
+        for (size_t i = 0; i < count; i++) {
+            if (suffixes[i].suffix == suffix) {
+                offset = suffixes[i].offset;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void NameCompressionTable::add(std::string_view suffix, uint16_t offset) {
+        if (count < MAX_SUFFIXES) {
+            suffixes[count++] = { suffix, offset };
+        }
+    }
+
+    const NameMemo::Entry* NameMemo::find(uint16_t address) const {
+        for (size_t i = 0; i < count; i++) {
+            if (names[i].address == address) {
+                return &names[i];
+            }
+        }
 
-        return std::make_tuple(label, i);
+        return nullptr;
     }
 
-    void serializeLabel(std::vector<uint8_t>& bytes, const Label& label) {
+    void NameMemo::add(uint16_t address, const DomainName& name, int pointers) {
+        if (count < MAX_NAMES) {
+            auto& entry = names[count++];
+            entry.address = address;
+            entry.pointers = pointers;
+            new (&entry.name) DomainName(name);
+        }
+    }
+
+    DnsError serializeLabel(WireWriter& bytes, const Label& label, NameCompressionTable* compression) {
         if (label.isPointer) {
-            pushValue(bytes, label.pointerAddress | LABEL_POINTER_FLAGS);
-        } else {
-            std::string part;
-            std::stringstream domainStream(label.domainName);
-            bool isFirst = true;
-            while (getline(domainStream, part, '.')) {
-                const auto partLength = part.length();
-
-                if (isFirst) {
-                    isFirst = false;
-                    // Label part lengths are a single byte. However, having the first
-                    // two bits of the first byte set signifies a QNAME pointer, so the
-                    // actual range is 6 bits, 0-63.
-                    if (partLength >= 64) {
-                        // IMPROVE: This whole interface could do better with errors.
-                        exit(-1);
-                    }
+            if (label.pointerAddress > MAX_POINTER_ADDRESS) {
+                return DnsError::BadPointer;
+            }
+
+            pushValue(bytes, (uint16_t)(label.pointerAddress | (LABEL_POINTER_FLAGS << 8)));
+            return DnsError::None;
+        }
+
+        return serializeName(bytes, label.domainName, label.domainName.wire(), compression);
+    }
+
+    DnsError serializeName(WireWriter& bytes, const DomainName& name, const uint8_t* wire, NameCompressionTable* compression) {
+        for (size_t i = 0; i < name.labelCount(); i++) {
+            if (compression != nullptr) {
+                const auto nameSuffix = name.wireSuffix(i);
+                const auto suffix = std::string_view((const char*)wire + (nameSuffix.data() - (const char*)name.wire()), nameSuffix.length());
+                uint16_t existing = 0;
+                if (compression->find(suffix, existing)) {
+                    pushValue(bytes, (uint16_t)(existing | (LABEL_POINTER_FLAGS << 8)));
+                    return DnsError::None;
                 }
 
-                bytes.push_back((uint8_t)partLength);
-                pushValue(bytes, std::vector<uint8_t>(part.begin(), part.end()));
+                // Pointers only have 14 bits of address, so suffixes past that can't be referenced.
+                const auto offset = bytes.size() - compression->packetStart;
+                if (offset <= MAX_POINTER_ADDRESS) {
+                    compression->add(suffix, (uint16_t)offset);
+                }
             }
 
-            bytes.push_back(0);
+            const auto part = name.label(i);
+            bytes.push_back((uint8_t)part.length());
+            bytes.append(part.data(), part.length());
         }
+
+        bytes.push_back(0);
+        return DnsError::None;
     }
 
-    std::tuple<Question, size_t> parseQuestion(const std::vector<uint8_t>& bytes, size_t start) {
-        auto index = start;
-        auto labelResult = parseLabel(bytes, index);
-        index = std::get<1>(labelResult);
+    namespace {
+        DnsError parseOwner(const std::vector<uint8_t>& bytes, size_t& index, Label& label, NameMemo* memo) {
+            int pointers = 0;
+            auto error = decodeName(bytes.data(), bytes.size(), index, label, memo, 0, pointers);
+            if (error != DnsError::None || !label.isPointer) {
+                return error;
+            }
 
-        Question question;
+            const auto address = label.pointerAddress;
+            label.isPointer = false;
+            label.pointerAddress = 0;
+            return resolvePointer(bytes.data(), bytes.size(), address, label.domainName, memo, 0, pointers);
+        }
+    }
+
+    DnsError parseQuestion(const std::vector<uint8_t>& bytes, size_t& index, Question& question, NameMemo* memo) {
+        const auto error = parseOwner(bytes, index, question.label, memo);
+        if (error != DnsError::None) {
+            return error;
+        }
+
+        if (index + 4 > bytes.size()) {
+            return DnsError::Truncated;
+        }
 
         question.qtype = (Type)getValue<uint16_t>(bytes, index);
         index += 2;
         question.qclass = (Class)getValue<uint16_t>(bytes, index);
         index += 2;
 
-        return std::make_tuple(question, index);
+        return DnsError::None;
     }
 
-    void serializeQuestion(std::vector<uint8_t>& bytes, const Question& question) {
-        serializeLabel(bytes, question.label);
+    DnsError serializeQuestion(WireWriter& bytes, const Question& question, NameCompressionTable* compression) {
+        const auto error = serializeLabel(bytes, question.label, compression);
+        if (error != DnsError::None) {
+            return error;
+        }
+
         pushValue(bytes, (uint16_t)question.qtype);
         pushValue(bytes, (uint16_t)question.qclass);
+        return DnsError::None;
     }
 
-    std::tuple<Resource, size_t> parseResource(const std::vector<uint8_t>& bytes, size_t start) {
-        Resource resource;
-
-        auto index = start;
-        auto labelResult = parseLabel(bytes, index);
-        index = std::get<1>(labelResult);
+    DnsError parseResource(const std::vector<uint8_t>& bytes, size_t& index, Resource& resource, NameMemo* memo) {
+        const auto error = parseOwner(bytes, index, resource.label, memo);
+        if (error != DnsError::None) {
+            return error;
+        }
 
-        resource.label = std::get<0>(labelResult);
+        if (index + 10 > bytes.size()) {
+            return DnsError::Truncated;
+        }
 
         resource.rtype = (Type)getValue<uint16_t>(bytes, index);
         index += 2;
@@ -138,27 +377,55 @@ namespace DNice {
         resource.length = getValue<uint16_t>(bytes, index);
         index += 2;
 
-        for (uint16_t dataIndex = 0; dataIndex < resource.length; dataIndex++) {
-            resource.data.push_back(bytes[index]);
-            index += 1;
+        if (index + resource.length > bytes.size()) {
+            return DnsError::Truncated;
         }
 
-        return std::make_tuple(resource, index);
+        // Names in the data may point elsewhere in this message, so they are expanded to keep
+        // the record meaningful on its own.
+        RdataLayout layout;
+        if (rdataLayout(resource.rtype, layout)) {
+            const auto rdataError = expandRdata(bytes, index, resource.length, layout, memo, resource.data);
+            if (rdataError != DnsError::None) {
+                return rdataError;
+            }
+        } else {
+            resource.data.assign(bytes.begin() + index, bytes.begin() + index + resource.length);
+        }
+
+        index += resource.length;
+        resource.length = (uint16_t)resource.data.size();
+
+        return DnsError::None;
     }
 
-    void serializeResource(std::vector<uint8_t>& bytes, const Resource& resource) {
-        serializeLabel(bytes, resource.label);
+    DnsError serializeResource(WireWriter& bytes, const Resource& resource, NameCompressionTable* compression) {
+        if (resource.length != resource.data.size()) {
+            return DnsError::DataLengthMismatch;
+        }
+
+        const auto error = serializeLabel(bytes, resource.label, compression);
+        if (error != DnsError::None) {
+            return error;
+        }
+
         pushValue(bytes, (uint16_t)resource.rtype);
         pushValue(bytes, (uint16_t)resource.rclass);
         pushValue(bytes, resource.ttl);
+
+        RdataLayout layout;
+        if (compression != nullptr && rdataLayout(resource.rtype, layout) && layout.compressible) {
+            return compressRdata(bytes, resource, layout, compression);
+        }
+
         pushValue(bytes, resource.length);
-        pushValue(bytes, resource.data);
+        bytes.append(resource.data.data(), resource.data.size());
+        return DnsError::None;
     }
 
-    bool parseDnsPacket(const std::vector<uint8_t>& rawPacket, Packet& outPacket, std::string& error) {
-        if (rawPacket.size() < 12) {
-            error = "Packet is less than the size of a header.";
-            return false;
+    DnsError parseDnsPacket(const std::vector<uint8_t>& rawPacket, Packet& outPacket) {
+        if (rawPacket.size() < DNS_HEADER_SIZE) {
+            return DnsError::Truncated;
         }
 
         outPacket.id = getValue<uint16_t>(rawPacket, 0);
@@ -185,90 +452,169 @@ namespace DNice {
         const auto authorityCount = getValue<uint16_t>(rawPacket, 8);
         const auto additionalRecordCount = getValue<uint16_t>(rawPacket, 10);
 
-        size_t packetIndex = 12;
-
-        packetIndex = collectResources<Question>(
-            outPacket.questions,
-            [](const std::vector<uint8_t>& bytes, uint8_t start) { return parseQuestion(bytes, start); },
-            rawPacket,
-            packetIndex,
-            questionCount
-        );
-
-        packetIndex = collectResources<Resource>(
-            outPacket.answers,
-            [](const std::vector<uint8_t>& bytes, uint8_t start) { return parseResource(bytes, start); },
-            rawPacket,
-            packetIndex,
-            answerCount
-        );
-
-        packetIndex = collectResources<Resource>(
-            outPacket.authorities,
-            [](const std::vector<uint8_t>& bytes, uint8_t start) { return parseResource(bytes, start); },
-            rawPacket,
-            packetIndex,
-            authorityCount
-        );
-
-        collectResources<Resource>(
-            outPacket.additionalRecords,
-            [](const std::vector<uint8_t>& bytes, uint8_t start) { return parseResource(bytes, start); },
-            rawPacket,
-            packetIndex,
-            additionalRecordCount
-        );
-
-        return true;
+        outPacket.questions.clear();
+        outPacket.answers.clear();
+        outPacket.authorities.clear();
+        outPacket.additionalRecords.clear();
+
+        size_t packetIndex = DNS_HEADER_SIZE;
+
+        // Every owner name in a typical answer points at the question, so share its decoding.
+        NameMemo memo;
+        const auto question = [&memo](const std::vector<uint8_t>& bytes, size_t& index, Question& item) {
+            return parseQuestion(bytes, index, item, &memo);
+        };
+
+        const auto resource = [&memo](const std::vector<uint8_t>& bytes, size_t& index, Resource& item) {
+            return parseResource(bytes, index, item, &memo);
+        };
+
+        auto error = collectResources(outPacket.questions, question, rawPacket, packetIndex, questionCount);
+        if (error == DnsError::None) {
+            error = collectResources(outPacket.answers, resource, rawPacket, packetIndex, answerCount);
+        }
+
+        if (error == DnsError::None) {
+            error = collectResources(outPacket.authorities, resource, rawPacket, packetIndex, authorityCount);
+        }
+
+        if (error == DnsError::None) {
+            error = collectResources(outPacket.additionalRecords, resource, rawPacket, packetIndex, additionalRecordCount);
+        }
+
+        return error;
     }
 
-    void serializeDnsPacket(const Packet& packet, std::vector<uint8_t>& outRawPacket) {
-        pushValue(outRawPacket, packet.id);
+    namespace {
+        // Room made for a message before its size is known: a full classic UDP response.
+        const size_t DEFAULT_MESSAGE_CAPACITY = 512;
+
+        // Writes packet from the writer's current position. When truncate is set only the
+        // header, questions and any OPT record are written, with TC set. The OPT record stays
+        // so the client still learns the server's EDNS parameters (RFC 6891 section 7).
+        DnsError writePacket(const Packet& packet, WireWriter& bytes, bool truncate) {
+            NameCompressionTable compression;
+            compression.packetStart = bytes.size();
+
+            pushValue(bytes, packet.id);
+
+            uint8_t flagsPart1 = 0;
+            setFlag(flagsPart1, 7, packet.isResponse);
+            flagsPart1 |= ((uint8_t)packet.opcode << 3);
+            setFlag(flagsPart1, 2, packet.isAuthoritative);
+            setFlag(flagsPart1, 1, packet.isTruncated || truncate);
+            setFlag(flagsPart1, 0, packet.recursionDesired);
+            bytes.push_back(flagsPart1);
+
+            uint8_t flagsPart2 = 0;
+            setFlag(flagsPart2, 7, packet.recursionAvailable);
+            setFlag(flagsPart2, 6, packet.zBit);
+            setFlag(flagsPart2, 5, packet.isAuthenticData);
+            setFlag(flagsPart2, 4, packet.checkingDisabled);
+            flagsPart2 |= ((uint8_t)packet.responseCode & 0x0F);
+            bytes.push_back(flagsPart2);
+
+            pushValue(bytes, (uint16_t)packet.questions.size());
+            pushValue(bytes, (uint16_t)(truncate ? 0 : packet.answers.size()));
+            pushValue(bytes, (uint16_t)(truncate ? 0 : packet.authorities.size()));
+            uint16_t additionalCount = (uint16_t)packet.additionalRecords.size();
+            if (truncate) {
+                additionalCount = (uint16_t)std::count_if(packet.additionalRecords.begin(), packet.additionalRecords.end(),
+                    [](const Resource& resource) { return resource.rtype == Type::OPT; });
+            }
+
+            pushValue(bytes, additionalCount);
+
+            for (const auto& question : packet.questions) {
+                const auto error = serializeQuestion(bytes, question, &compression);
+                if (error != DnsError::None) {
+                    return error;
+                }
+            }
+
+            if (truncate) {
+                for (const auto& resource : packet.additionalRecords) {
+                    if (resource.rtype == Type::OPT) {
+                        const auto error = serializeResource(bytes, resource, &compression);
+                        if (error != DnsError::None) {
+                            return error;
+                        }
+                    }
+                }
 
-        uint8_t flagsPart1 = 0;
-        setFlag(flagsPart1, 7, packet.isResponse);
-        flagsPart1 |= ((uint8_t)packet.opcode << 3);
-        setFlag(flagsPart1, 2, packet.isAuthoritative);
-        setFlag(flagsPart1, 1, packet.isTruncated);
-        setFlag(flagsPart1, 0, packet.recursionDesired);
-        outRawPacket.push_back(flagsPart1);
+                return DnsError::None;
+            }
 
-        uint8_t flagsPart2 = 0;
-        setFlag(flagsPart2, 7, packet.recursionAvailable);
-        setFlag(flagsPart2, 6, packet.zBit);
-        setFlag(flagsPart2, 5, packet.isAuthenticData);
-        setFlag(flagsPart2, 4, packet.checkingDisabled);
-        flagsPart2 |= ((uint8_t)packet.responseCode & 0x0F);
-        outRawPacket.push_back(flagsPart2);
+            for (const auto section : { &packet.answers, &packet.authorities, &packet.additionalRecords }) {
+                for (const auto& resource : *section) {
+                    const auto error = serializeResource(bytes, resource, &compression);
+                    if (error != DnsError::None) {
+                        return error;
+                    }
+                }
+            }
 
-        pushValue(outRawPacket, (uint16_t)packet.questions.size());
-        pushValue(outRawPacket, (uint16_t)packet.answers.size());
-        pushValue(outRawPacket, (uint16_t)packet.authorities.size());
-        pushValue(outRawPacket, (uint16_t)packet.additionalRecords.size());
+            return DnsError::None;
+        }
+    }
 
-        for (const auto& question : packet.questions) {
-            serializeQuestion(outRawPacket, question);
+    DnsError serializeDnsPacket(const Packet& packet, std::vector<uint8_t>& outRawPacket) {
+        const auto packetStart = outRawPacket.size();
+
+        // Write into whatever room the vector has, and if the message needs more, grow it to
+        // the size the first attempt reported and write again.
+        outRawPacket.resize(std::max(outRawPacket.capacity(), packetStart + DEFAULT_MESSAGE_CAPACITY));
+        auto available = outRawPacket.size() - packetStart;
+
+        WireWriter writer(outRawPacket.data() + packetStart, available);
+        auto error = writePacket(packet, writer, false);
+        if (error == DnsError::None && writer.overflowed()) {
+            available = writer.size();
+            outRawPacket.resize(packetStart + available);
+            writer = WireWriter(outRawPacket.data() + packetStart, available);
+            error = writePacket(packet, writer, false);
         }
 
-        for (const auto& answer : packet.answers) {
-            serializeResource(outRawPacket, answer);
+        outRawPacket.resize(packetStart + std::min(writer.size(), available));
+        return error;
+    }
+
+    DnsError serializeDnsPacket(const Packet& packet, uint8_t* buffer, size_t capacity, size_t& outLength) {
+        outLength = 0;
+
+        WireWriter writer(buffer, capacity);
+        auto error = writePacket(packet, writer, false);
+        if (error == DnsError::None && writer.overflowed()) {
+            writer.rewind(0);
+            error = writePacket(packet, writer, true);
+            if (error == DnsError::None && writer.overflowed()) {
+                error = DnsError::BufferTooSmall;
+            }
         }
 
-        for (const auto& authority : packet.authorities) {
-            serializeResource(outRawPacket, authority);
+        if (error == DnsError::None) {
+            outLength = writer.size();
         }
 
-        for (const auto& additionalRecord : packet.additionalRecords) {
-            serializeResource(outRawPacket, additionalRecord);
+        return error;
+    }
+
+    DomainName resolveLabel(const std::vector<uint8_t>& rawPacket, const Label& label, NameMemo* memo) {
+        DomainName name;
+        if (resolveLabel(rawPacket, label, name, memo) != DnsError::None) {
+            name.clear();
         }
+
+        return name;
     }
 
-    std::string resolveLabel(const std::vector<uint8_t>& rawPacket, const Label& label) {
-        Label currentLabel = label;
-        while (currentLabel.isPointer) {
-            currentLabel = std::get<0>(parseLabel(rawPacket, (size_t)currentLabel.pointerAddress));
+    DnsError resolveLabel(const std::vector<uint8_t>& rawPacket, const Label& label, DomainName& name, NameMemo* memo) {
+        if (!label.isPointer) {
+            name = label.domainName;
+            return DnsError::None;
         }
 
-        return currentLabel.domainName;
+        int pointers = 0;
+        return resolvePointer(rawPacket.data(), rawPacket.size(), label.pointerAddress, name, memo, 0, pointers);
     }
 }
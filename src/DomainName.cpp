@@ -0,0 +1,151 @@
+#include "DomainName.h"
+
+#include "DNS.h"
+
+#include <cstring>
+
+namespace DNice {
+    namespace {
+        const size_t FNV_OFFSET_BASIS = (size_t)14695981039346656037ull;
+        const size_t FNV_PRIME = (size_t)1099511628211ull;
+
+        uint8_t foldCase(uint8_t c) {
+            return c >= 'A' && c <= 'Z' ? (uint8_t)(c - 'A' + 'a') : c;
+        }
+
+        size_t hashByte(size_t hash, uint8_t c) {
+            return (hash ^ foldCase(c)) * FNV_PRIME;
+        }
+    }
+
+    DomainName::DomainName() {
+        clear();
+    }
+
+    void DomainName::clear() {
+        size = 0;
+        labels = 0;
+        bytes[0] = 0;
+        nameHash = FNV_OFFSET_BASIS;
+    }
+
+    DnsError DomainName::assign(std::string_view dotted) {
+        clear();
+
+        // A trailing dot only marks the name as fully qualified, which every name here is.
+        if (!dotted.empty() && dotted.back() == '.') {
+            dotted.remove_suffix(1);
+        }
+
+        size_t partStart = 0;
+        while (partStart < dotted.length()) {
+            auto partEnd = dotted.find('.', partStart);
+            if (partEnd == std::string_view::npos) {
+                partEnd = dotted.length();
+            }
+
+            // A zero length would read as the end of the name.
+            if (partEnd == partStart) {
+                clear();
+                return DnsError::EmptyLabel;
+            }
+
+            const auto error = appendLabel((const uint8_t*)dotted.data() + partStart, partEnd - partStart);
+            if (error != DnsError::None) {
+                clear();
+                return error;
+            }
+
+            partStart = partEnd + 1;
+        }
+
+        return DnsError::None;
+    }
+
+    DnsError DomainName::appendLabel(const uint8_t* label, size_t length) {
+        if (length == 0) {
+            return DnsError::EmptyLabel;
+        }
+
+        // Label part lengths are a single byte. However, having the first
+        // two bits of the first byte set signifies a QNAME pointer, so the
+        // actual range is 6 bits, 0-63.
+        if (length > MAX_LABEL_LENGTH) {
+            return DnsError::LabelTooLong;
+        }
+
+        if (size + 1 + length + 1 > MAX_WIRE_LENGTH) {
+            return DnsError::NameTooLong;
+        }
+
+        labelOffsets[labels++] = size;
+        bytes[size++] = (uint8_t)length;
+        nameHash = hashByte(nameHash, (uint8_t)length);
+
+        for (size_t i = 0; i < length; i++) {
+            bytes[size++] = label[i];
+            nameHash = hashByte(nameHash, label[i]);
+        }
+
+        bytes[size] = 0;
+        return DnsError::None;
+    }
+
+    DnsError DomainName::append(const DomainName& suffix) {
+        if ((size_t)size + suffix.size + 1 > MAX_WIRE_LENGTH) {
+            return DnsError::NameTooLong;
+        }
+
+        for (size_t i = 0; i < suffix.labels; i++) {
+            labelOffsets[labels++] = (uint8_t)(size + suffix.labelOffsets[i]);
+        }
+
+        for (size_t i = 0; i < suffix.size; i++) {
+            nameHash = hashByte(nameHash, suffix.bytes[i]);
+        }
+
+        memcpy(bytes + size, suffix.bytes, suffix.size + 1);
+        size = (uint8_t)(size + suffix.size);
+        return DnsError::None;
+    }
+
+    std::string_view DomainName::label(size_t index) const {
+        const auto offset = labelOffsets[index];
+        return std::string_view((const char*)bytes + offset + 1, bytes[offset]);
+    }
+
+    std::string_view DomainName::wireSuffix(size_t index) const {
+        const size_t offset = index < labels ? labelOffsets[index] : size;
+        return std::string_view((const char*)bytes + offset, size + 1 - offset);
+    }
+
+    std::string DomainName::toString() const {
+        std::string out;
+        appendTo(out);
+        return out;
+    }
+
+    void DomainName::appendTo(std::string& out) const {
+        for (size_t i = 0; i < labels; i++) {
+            if (i > 0) {
+                out.push_back('.');
+            }
+
+            out += label(i);
+        }
+    }
+
+    bool DomainName::operator==(const DomainName& other) const {
+        if (nameHash != other.nameHash || size != other.size) {
+            return false;
+        }
+
+        for (size_t i = 0; i < size; i++) {
+            if (foldCase(bytes[i]) != foldCase(other.bytes[i])) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+}
@@ -0,0 +1,121 @@
+#include "Edns.h"
+
+namespace DNice {
+    namespace {
+        const size_t OPTION_HEADER_SIZE = 4;
+        const uint32_t DNSSEC_OK_FLAG = 0x8000;
+
+        DnsError decodeFields(uint16_t payloadSize, uint32_t ttl, const uint8_t* data, size_t length, Edns& out) {
+            out.udpPayloadSize = payloadSize;
+            out.extendedResponseCode = (uint8_t)(ttl >> 24);
+            out.version = (uint8_t)(ttl >> 16);
+            out.dnssecOk = (ttl & DNSSEC_OK_FLAG) != 0;
+            out.options.clear();
+
+            size_t index = 0;
+            while (index < length) {
+                if (length - index < OPTION_HEADER_SIZE) {
+                    return DnsError::BadRdata;
+                }
+
+                EdnsOption option;
+                option.code = getValue<uint16_t>(data, index);
+                option.length = getValue<uint16_t>(data, index + 2);
+                index += OPTION_HEADER_SIZE;
+                if (length - index < option.length) {
+                    return DnsError::BadRdata;
+                }
+
+                option.data = data + index;
+                out.options.push_back(option);
+                index += option.length;
+            }
+
+            return DnsError::None;
+        }
+    }
+
+    DnsError decodeEdns(const Resource& resource, Edns& out) {
+        if (resource.rtype != Type::OPT) {
+            return DnsError::TypeMismatch;
+        }
+
+        return decodeFields((uint16_t)resource.rclass, resource.ttl, resource.data.data(), resource.data.size(), out);
+    }
+
+    DnsError decodeEdns(const PacketView& message, const ResourceView& resource, Edns& out) {
+        if (resource.rtype != Type::OPT) {
+            return DnsError::TypeMismatch;
+        }
+
+        return decodeFields((uint16_t)resource.rclass, resource.ttl, message.data() + resource.data.offset,
+            resource.data.length, out);
+    }
+
+    DnsError encodeEdns(const Edns& edns, Resource& resource) {
+        resource.label = Label();
+        resource.rtype = Type::OPT;
+        resource.rclass = (Class)edns.udpPayloadSize;
+        resource.ttl = ((uint32_t)edns.extendedResponseCode << 24) | ((uint32_t)edns.version << 16) |
+            (edns.dnssecOk ? DNSSEC_OK_FLAG : 0);
+
+        resource.data.clear();
+        for (const auto& option : edns.options) {
+            pushValue(resource.data, option.code);
+            pushValue(resource.data, option.length);
+            resource.data.insert(resource.data.end(), option.data, option.data + option.length);
+        }
+
+        if (resource.data.size() > UINT16_MAX) {
+            resource.data.clear();
+            resource.length = 0;
+            return DnsError::BadRdata;
+        }
+
+        resource.length = (uint16_t)resource.data.size();
+        return DnsError::None;
+    }
+
+    DnsError findEdns(const PacketView& message, Edns& out, bool& present) {
+        present = false;
+        if (message.size() < DNS_HEADER_SIZE) {
+            return DnsError::Truncated;
+        }
+
+        size_t offset = DNS_HEADER_SIZE;
+        for (uint16_t i = 0; i < message.questionCount(); i++) {
+            QuestionView question;
+            if (!message.readQuestion(offset, question)) {
+                return DnsError::Truncated;
+            }
+        }
+
+        const uint32_t additionalStart = (uint32_t)message.answerCount() + message.authorityCount();
+        const uint32_t resourceCount = additionalStart + message.additionalRecordCount();
+        for (uint32_t i = 0; i < resourceCount; i++) {
+            ResourceView resource;
+            if (!message.readResource(offset, resource)) {
+                return DnsError::Truncated;
+            }
+
+            if (resource.rtype != Type::OPT) {
+                continue;
+            }
+
+            // Only one OPT, in the additional section, with the root as its owner.
+            const bool rootOwner = resource.name.length == 1 && message.data()[resource.name.offset] == 0;
+            if (present || i < additionalStart || !rootOwner) {
+                return DnsError::BadOpt;
+            }
+
+            const auto error = decodeEdns(message, resource, out);
+            if (error != DnsError::None) {
+                return error;
+            }
+
+            present = true;
+        }
+
+        return DnsError::None;
+    }
+}
@@ -0,0 +1,361 @@
+#include "Forwarder.h"
+
+#include "Edns.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/random.h>
+#include <unistd.h>
+
+namespace DNice {
+    namespace {
+        // Each socket has its own source port and its own 16 bits of id, so a few of them
+        // multiply what a forger has to guess and how many questions can be outstanding.
+        const size_t SOCKETS_PER_UPSTREAM = 4;
+        const size_t MAX_OUTSTANDING = 4096;
+        const size_t MAX_REPLY = 65535;
+        const int EVENTS_PER_WAIT = 64;
+        // Tries at finding an id not already outstanding before giving the question up.
+        const int ID_ATTEMPTS = 16;
+
+        // Retransmission timeouts. RFC 6298's one second minimum suits TCP over the internet;
+        // DNS resolvers conventionally go much lower.
+        const std::chrono::microseconds INITIAL_RTO(200000);
+        const std::chrono::microseconds MIN_RTO(50000);
+
+        uint32_t inFlightKey(size_t socket, uint16_t id) {
+            return ((uint32_t)socket << 16) | id;
+        }
+
+        // Whether reply asks the question at the start of query, which ends at questionEnd. The
+        // name may come back in a different case; the type and class must match exactly.
+        bool sameQuestion(const std::vector<uint8_t>& query, size_t questionEnd, const uint8_t* reply, size_t length) {
+            if (length < questionEnd || getValue<uint16_t>(reply, 4) != 1) {
+                return false;
+            }
+
+            const auto nameEnd = questionEnd - 4;
+            for (size_t i = DNS_HEADER_SIZE; i < nameEnd; i++) {
+                if (tolower(query[i]) != tolower(reply[i])) {
+                    return false;
+                }
+            }
+
+            return memcmp(query.data() + nameEnd, reply + nameEnd, 4) == 0;
+        }
+    }
+
+    Forwarder::Forwarder(std::chrono::milliseconds timeout, unsigned int retries, uint16_t payloadSize, ReplyHandler handler) :
+        timeout(timeout),
+        retries(retries),
+        payloadSize(payloadSize),
+        handler(std::move(handler)) {
+    }
+
+    Forwarder::~Forwarder() {
+        for (const auto& socket : sockets) {
+            close(socket.fd);
+        }
+
+        if (epollFd >= 0) {
+            close(epollFd);
+        }
+    }
+
+    bool Forwarder::open(const std::vector<sockaddr_storage>& addresses, std::string& error) {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFd < 0) {
+            error = std::string("epoll_create1: ") + strerror(errno);
+            return false;
+        }
+
+        for (const auto& address : addresses) {
+            Upstream upstream;
+            upstream.address = address;
+            upstream.addressLength = address.ss_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+
+            for (size_t i = 0; i < SOCKETS_PER_UPSTREAM; i++) {
+                Socket socket;
+                socket.upstream = upstreams.size();
+                socket.fd = ::socket(address.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+                if (socket.fd < 0) {
+                    error = std::string("upstream socket: ") + strerror(errno);
+                    return false;
+                }
+
+                sockets.push_back(socket);
+
+                // Connecting picks a random source port and makes the kernel drop datagrams
+                // from anywhere but the upstream.
+                if (connect(socket.fd, (const sockaddr*)&upstream.address, upstream.addressLength) != 0) {
+                    error = std::string("upstream connect: ") + strerror(errno);
+                    return false;
+                }
+
+                epoll_event event;
+                event.events = EPOLLIN;
+                event.data.u64 = sockets.size() - 1;
+                if (epoll_ctl(epollFd, EPOLL_CTL_ADD, socket.fd, &event) != 0) {
+                    error = std::string("epoll_ctl: ") + strerror(errno);
+                    return false;
+                }
+            }
+
+            upstreams.push_back(upstream);
+        }
+
+        receiveBuffer.resize(MAX_REPLY);
+        return true;
+    }
+
+    void Forwarder::forward(const Question& question, uint64_t token) {
+        forwarderStats.queries++;
+        if (upstreams.empty() || (freeSlots.empty() && pending.size() >= MAX_OUTSTANDING)) {
+            forwarderStats.failed++;
+            failedTokens.push_back(token);
+            return;
+        }
+
+        size_t slot = 0;
+        if (freeSlots.empty()) {
+            slot = pending.size();
+            pending.emplace_back();
+        } else {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+        }
+
+        Packet packet;
+        packet.recursionDesired = true;
+        packet.questions.push_back(question);
+        if (payloadSize > 0) {
+            Edns edns;
+            edns.udpPayloadSize = payloadSize;
+            encodeEdns(edns, packet.additionalRecords.emplace_back());
+        }
+
+        auto& entry = pending[slot];
+        entry.token = token;
+        entry.active = true;
+        entry.attempts = 0;
+        entry.query.clear();
+        entry.questionEnd = DNS_HEADER_SIZE + question.label.domainName.wireLength() + 4;
+        entry.giveUp = Clock::now() + timeout;
+
+        if (serializeDnsPacket(packet, entry.query) != DnsError::None || !send(slot, false)) {
+            entry.active = false;
+            freeSlots.push_back(slot);
+            forwarderStats.failed++;
+            failedTokens.push_back(token);
+        }
+    }
+
+    bool Forwarder::send(size_t slot, bool retry) {
+        auto& entry = pending[slot];
+        const auto upstream = chooseUpstream(retry, retry ? sockets[entry.socket].upstream : 0);
+
+        // Pick a socket of the upstream and an id that isn't already outstanding on it.
+        bool placed = false;
+        size_t socket = 0;
+        uint16_t id = 0;
+        for (int i = 0; i < ID_ATTEMPTS && !placed; i++) {
+            const auto bits = randomBits();
+            socket = upstream * SOCKETS_PER_UPSTREAM + (bits >> 16) % SOCKETS_PER_UPSTREAM;
+            id = (uint16_t)bits;
+            placed = inFlight.emplace(inFlightKey(socket, id), slot).second;
+        }
+
+        if (!placed) {
+            return false;
+        }
+
+        const auto now = Clock::now();
+        entry.socket = socket;
+        entry.query[0] = (uint8_t)(id >> 8);
+        entry.query[1] = (uint8_t)(id & 0xff);
+        entry.attempts++;
+        entry.attempt = nextAttempt++;
+        entry.sent = now;
+
+        Timer timer;
+        timer.due = std::min(now + retransmitTimeout(upstreams[upstream]), entry.giveUp);
+        timer.slot = slot;
+        timer.attempt = entry.attempt;
+        timers.push(timer);
+
+        // A send that fails is treated like a lost datagram, and retried when its timer fires.
+        ::send(sockets[socket].fd, entry.query.data(), entry.query.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        return true;
+    }
+
+    void Forwarder::finish(size_t slot, const uint8_t* reply, size_t length) {
+        auto& entry = pending[slot];
+        const auto token = entry.token;
+        entry.active = false;
+        freeSlots.push_back(slot);
+
+        // The handler may forward again, reusing this slot, so nothing is touched afterwards.
+        handler(token, reply, length);
+    }
+
+    void Forwarder::service() {
+        epoll_event events[EVENTS_PER_WAIT];
+        const auto ready = epoll_wait(epollFd, events, EVENTS_PER_WAIT, 0);
+
+        for (int i = 0; i < ready; i++) {
+            const auto socket = (size_t)events[i].data.u64;
+
+            for (;;) {
+                const auto received = recv(sockets[socket].fd, receiveBuffer.data(), receiveBuffer.size(), MSG_DONTWAIT);
+                if (received < 0) {
+                    // An ICMP error from an earlier send is reported once; there may be more behind it.
+                    if (errno == ECONNREFUSED || errno == EINTR) {
+                        continue;
+                    }
+
+                    break;
+                }
+
+                handleReply(socket, receiveBuffer.data(), (size_t)received);
+            }
+        }
+    }
+
+    void Forwarder::handleReply(size_t socket, const uint8_t* reply, size_t length) {
+        if (length < DNS_HEADER_SIZE) {
+            forwarderStats.unmatched++;
+            return;
+        }
+
+        const auto found = inFlight.find(inFlightKey(socket, getValue<uint16_t>(reply, 0)));
+        const bool isResponse = (reply[2] & 0x80) != 0;
+        if (found == inFlight.end() || !isResponse ||
+            !sameQuestion(pending[found->second].query, pending[found->second].questionEnd, reply, length)) {
+            forwarderStats.unmatched++;
+            return;
+        }
+
+        const auto slot = found->second;
+        inFlight.erase(found);
+
+        // Every attempt has its own id, so the sample is unambiguous even after a retry.
+        sampleRtt(upstreams[sockets[socket].upstream],
+            std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - pending[slot].sent));
+
+        forwarderStats.answered++;
+        finish(slot, reply, length);
+    }
+
+    void Forwarder::expire() {
+        // Swapped out first, as the handler may forward again and fail straight away.
+        if (!failedTokens.empty()) {
+            std::vector<uint64_t> failed;
+            failed.swap(failedTokens);
+            for (const auto token : failed) {
+                handler(token, nullptr, 0);
+            }
+        }
+
+        const auto now = Clock::now();
+
+        while (!timers.empty() && timers.top().due <= now) {
+            const auto timer = timers.top();
+            timers.pop();
+
+            auto& entry = pending[timer.slot];
+            // Answered, or superseded by a later attempt.
+            if (!entry.active || entry.attempt != timer.attempt) {
+                continue;
+            }
+
+            inFlight.erase(inFlightKey(entry.socket, getValue<uint16_t>(entry.query.data(), 0)));
+
+            // Back off the upstream the way RFC 6298 backs off its timer, so a slow or dead
+            // upstream loses its turn to the others until answers bring it back down.
+            auto& upstream = upstreams[sockets[entry.socket].upstream];
+            upstream.smoothedRtt = std::min(std::max(upstream.smoothedRtt * 2, retransmitTimeout(upstream)),
+                std::chrono::duration_cast<std::chrono::microseconds>(timeout));
+
+            if (entry.attempts > retries || now >= entry.giveUp || !send(timer.slot, true)) {
+                forwarderStats.failed++;
+                finish(timer.slot, nullptr, 0);
+            } else {
+                forwarderStats.retries++;
+            }
+        }
+    }
+
+    std::chrono::milliseconds Forwarder::nextTimeout() const {
+        if (!failedTokens.empty()) {
+            return std::chrono::milliseconds(0);
+        }
+
+        if (timers.empty()) {
+            return std::chrono::milliseconds::max();
+        }
+
+        const auto remaining = timers.top().due - Clock::now();
+        return std::max(std::chrono::ceil<std::chrono::milliseconds>(remaining), std::chrono::milliseconds(0));
+    }
+
+    size_t Forwarder::chooseUpstream(bool avoidCurrent, size_t current) const {
+        // Upstreams that have never answered have no round-trip time yet, so they come first
+        // and get measured.
+        size_t best = upstreams.size();
+        for (size_t i = 0; i < upstreams.size(); i++) {
+            if (avoidCurrent && i == current && upstreams.size() > 1) {
+                continue;
+            }
+
+            if (best == upstreams.size() || upstreams[i].smoothedRtt < upstreams[best].smoothedRtt) {
+                best = i;
+            }
+        }
+
+        return best;
+    }
+
+    std::chrono::microseconds Forwarder::retransmitTimeout(const Upstream& upstream) const {
+        if (upstream.smoothedRtt.count() == 0) {
+            return INITIAL_RTO;
+        }
+
+        const auto limit = std::max(std::chrono::duration_cast<std::chrono::microseconds>(timeout), MIN_RTO);
+        return std::clamp(upstream.smoothedRtt + 4 * upstream.rttVariation, MIN_RTO, limit);
+    }
+
+    void Forwarder::sampleRtt(Upstream& upstream, std::chrono::microseconds sample) {
+        // RFC 6298 section 2, with alpha 1/8 and beta 1/4.
+        if (upstream.smoothedRtt.count() == 0) {
+            upstream.smoothedRtt = sample;
+            upstream.rttVariation = sample / 2;
+            return;
+        }
+
+        const auto difference = upstream.smoothedRtt > sample ? upstream.smoothedRtt - sample : sample - upstream.smoothedRtt;
+        upstream.rttVariation = (3 * upstream.rttVariation + difference) / 4;
+        upstream.smoothedRtt = (7 * upstream.smoothedRtt + sample) / 8;
+    }
+
+    uint32_t Forwarder::randomBits() {
+        if (randomLeft == 0) {
+            // Requests this small are always filled in full once the kernel's pool is ready.
+            if (getrandom(randomPool, sizeof(randomPool), 0) != (ssize_t)sizeof(randomPool)) {
+                // Not expected, but an id that is guessable beats one that repeats.
+                const auto now = (uint64_t)Clock::now().time_since_epoch().count();
+                for (size_t i = 0; i < sizeof(randomPool) / sizeof(randomPool[0]); i++) {
+                    randomPool[i] = (uint32_t)((now >> (i % 32)) + i) * 2654435761u;
+                }
+            }
+
+            randomLeft = sizeof(randomPool) / sizeof(randomPool[0]);
+        }
+
+        return randomPool[--randomLeft];
+    }
+}
@@ -0,0 +1,205 @@
+#include "IoUring.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace DNice {
+    namespace {
+        int ioUringSetup(unsigned int entries, io_uring_params* params) {
+            return (int)syscall(__NR_io_uring_setup, entries, params);
+        }
+
+        int ioUringEnter(int fd, unsigned int toSubmit, unsigned int minComplete, unsigned int flags) {
+            return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+        }
+
+        int ioUringRegister(int fd, unsigned int opcode, void* arg, unsigned int count) {
+            return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+        }
+    }
+
+    IoUring::IoUring() {
+    }
+
+    IoUring::~IoUring() {
+        if (bufferRing != nullptr) {
+            munmap(bufferRing, bufferRingSize);
+        }
+
+        if (sqes != nullptr) {
+            munmap(sqes, sqesSize);
+        }
+
+        if (cqRing != nullptr && cqRing != sqRing) {
+            munmap(cqRing, cqRingSize);
+        }
+
+        if (sqRing != nullptr) {
+            munmap(sqRing, sqRingSize);
+        }
+
+        if (ringFd >= 0) {
+            close(ringFd);
+        }
+    }
+
+    bool IoUring::init(unsigned int entries, std::string& error) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        ringFd = ioUringSetup(entries, &params);
+        if (ringFd < 0) {
+            error = std::string("io_uring_setup: ") + strerror(errno);
+            return false;
+        }
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+        // Newer kernels map both rings with a single mmap.
+        const bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (singleMap) {
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        }
+
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) {
+            sqRing = nullptr;
+            error = std::string("io_uring sq mmap: ") + strerror(errno);
+            return false;
+        }
+
+        if (singleMap) {
+            cqRing = sqRing;
+        } else {
+            cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+            if (cqRing == MAP_FAILED) {
+                cqRing = nullptr;
+                error = std::string("io_uring cq mmap: ") + strerror(errno);
+                return false;
+            }
+        }
+
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        auto mappedSqes = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (mappedSqes == MAP_FAILED) {
+            error = std::string("io_uring sqe mmap: ") + strerror(errno);
+            return false;
+        }
+
+        sqes = (io_uring_sqe*)mappedSqes;
+
+        auto sqBase = (uint8_t*)sqRing;
+        sqHead = (unsigned int*)(sqBase + params.sq_off.head);
+        sqTail = (unsigned int*)(sqBase + params.sq_off.tail);
+        sqMask = *(unsigned int*)(sqBase + params.sq_off.ring_mask);
+        sqEntries = *(unsigned int*)(sqBase + params.sq_off.ring_entries);
+        sqArray = (unsigned int*)(sqBase + params.sq_off.array);
+        sqLocalTail = *sqTail;
+        sqSubmitted = sqLocalTail;
+
+        auto cqBase = (uint8_t*)cqRing;
+        cqHead = (unsigned int*)(cqBase + params.cq_off.head);
+        cqTail = (unsigned int*)(cqBase + params.cq_off.tail);
+        cqMask = *(unsigned int*)(cqBase + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cqBase + params.cq_off.cqes);
+
+        return true;
+    }
+
+    bool IoUring::supportsOperation(uint8_t opcode) const {
+        const size_t opCount = 256;
+        std::vector<uint8_t> storage(sizeof(io_uring_probe) + opCount * sizeof(io_uring_probe_op), 0);
+        auto probe = (io_uring_probe*)storage.data();
+
+        if (ioUringRegister(ringFd, IORING_REGISTER_PROBE, probe, opCount) < 0) {
+            return false;
+        }
+
+        return opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED) != 0;
+    }
+
+    io_uring_sqe* IoUring::getSqe() {
+        const auto head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        if (sqLocalTail - head >= sqEntries) {
+            submitAndWait(0);
+            if (sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+                return nullptr;
+            }
+        }
+
+        const auto index = sqLocalTail & sqMask;
+        auto sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqArray[index] = index;
+        sqLocalTail++;
+
+        return sqe;
+    }
+
+    int IoUring::submitAndWait(unsigned int waitFor) {
+        const auto toSubmit = sqLocalTail - sqSubmitted;
+        __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+
+        const auto flags = waitFor > 0 ? IORING_ENTER_GETEVENTS : 0;
+        const auto result = ioUringEnter(ringFd, toSubmit, waitFor, flags);
+        if (result >= 0) {
+            sqSubmitted += (unsigned int)result;
+        }
+
+        return result;
+    }
+
+    bool IoUring::registerBufferRing(uint16_t groupId, uint8_t* base, size_t size, uint16_t count, std::string& error) {
+        bufferRingSize = count * sizeof(io_uring_buf);
+        auto mapped = mmap(nullptr, bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped == MAP_FAILED) {
+            error = std::string("buffer ring mmap: ") + strerror(errno);
+            return false;
+        }
+
+        bufferRing = (io_uring_buf_ring*)mapped;
+        bufferRingMask = (uint16_t)(count - 1);
+        bufferBase = base;
+        bufferSize = size;
+
+        io_uring_buf_reg registration;
+        memset(&registration, 0, sizeof(registration));
+        registration.ring_addr = (uint64_t)(uintptr_t)bufferRing;
+        registration.ring_entries = count;
+        registration.bgid = groupId;
+
+        if (ioUringRegister(ringFd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+            error = std::string("IORING_REGISTER_PBUF_RING: ") + strerror(errno);
+            return false;
+        }
+
+        for (uint16_t i = 0; i < count; i++) {
+            recycleBuffer(i);
+        }
+
+        commitBuffers();
+        return true;
+    }
+
+    void IoUring::recycleBuffer(uint16_t bufferId) {
+        // Index the entries through a plain pointer: in C++ the header's flexible array is
+        // preceded by an empty struct that shifts it off the start of the ring.
+        auto entries = (io_uring_buf*)bufferRing;
+        auto& buffer = entries[bufferRingTail & bufferRingMask];
+        buffer.addr = (uint64_t)(uintptr_t)bufferAddress(bufferId);
+        buffer.len = (uint32_t)bufferSize;
+        buffer.bid = bufferId;
+        bufferRingTail++;
+    }
+
+    void IoUring::commitBuffers() {
+        __atomic_store_n(&bufferRing->tail, bufferRingTail, __ATOMIC_RELEASE);
+    }
+}
@@ -0,0 +1,52 @@
+#include "MessageFramer.h"
+
+#include <algorithm>
+
+namespace DNice {
+    void MessageFramer::clear() {
+        buffer.clear();
+        offset = 0;
+        holding = false;
+    }
+
+    size_t MessageFramer::completeBuffered(const uint8_t* data, size_t length) {
+        size_t taken = 0;
+        if (buffer.size() < LENGTH_PREFIX_SIZE) {
+            taken = std::min(LENGTH_PREFIX_SIZE - buffer.size(), length);
+            buffer.insert(buffer.end(), data, data + taken);
+            if (buffer.size() < LENGTH_PREFIX_SIZE) {
+                return taken;
+            }
+        }
+
+        const auto wanted = LENGTH_PREFIX_SIZE + getValue<uint16_t>(buffer.data(), 0) - buffer.size();
+        const auto more = std::min(wanted, length - taken);
+        buffer.insert(buffer.end(), data + taken, data + taken + more);
+        return taken + more;
+    }
+
+    bool MessageFramer::bufferedMessageComplete() const {
+        return buffer.size() >= LENGTH_PREFIX_SIZE &&
+            buffer.size() == LENGTH_PREFIX_SIZE + getValue<uint16_t>(buffer.data(), 0);
+    }
+
+    void MessageFramer::hold(const uint8_t* data, size_t length) {
+        if (length == 0) {
+            return;
+        }
+
+        if (!holding) {
+            buffer.clear();
+            offset = 0;
+            holding = true;
+        }
+
+        buffer.insert(buffer.end(), data, data + length);
+    }
+
+    void MessageFramer::releaseHeld() {
+        buffer.erase(buffer.begin(), buffer.begin() + offset);
+        offset = 0;
+        holding = false;
+    }
+}
@@ -0,0 +1,98 @@
+#include "ModuleLoader.h"
+
+#include <fstream>
+#include <mutex>
+#include <sstream>
+
+namespace DNice {
+    namespace {
+        const char* MODULE_ROOT_KEY = "\xff" "moduleRoot";
+
+        // Compiles source as the function duk_module_duktape wraps modules in, and dumps it.
+        void compileModule(duk_context* ctx, CachedModule& module) {
+            const auto wrapped = "function (require, exports, module) {" + module.source + "\n}";
+
+            duk_push_lstring(ctx, wrapped.data(), wrapped.length());
+            duk_push_string(ctx, module.path.c_str());
+            duk_compile(ctx, DUK_COMPILE_FUNCTION);
+            duk_dump_function(ctx);
+
+            duk_size_t size = 0;
+            const auto data = (const uint8_t*)duk_get_buffer(ctx, -1, &size);
+            module.bytecode.assign(data, data + size);
+            duk_pop(ctx);
+        }
+
+        // Duktape.modSearch(id, require, exports, module)
+        duk_ret_t searchModule(duk_context* ctx) {
+            const auto id = duk_require_string(ctx, 0);
+
+            duk_push_current_function(ctx);
+            duk_get_prop_string(ctx, -1, MODULE_ROOT_KEY);
+            const std::string path = std::string(duk_require_string(ctx, -1)) + "/" + id + ".js";
+            duk_pop_2(ctx);
+
+            auto& cache = ModuleCache::shared();
+            auto module = cache.find(path);
+
+            if (!module) {
+                std::ifstream file(path, std::ios::binary);
+                if (!file) {
+                    return duk_error(ctx, DUK_ERR_ERROR, "module not found: %s", id);
+                }
+
+                std::stringstream contents;
+                contents << file.rdbuf();
+
+                auto loaded = std::make_shared<CachedModule>();
+                loaded->path = path;
+                loaded->source = contents.str();
+                compileModule(ctx, *loaded);
+
+                module = cache.insert(loaded);
+            }
+
+            duk_push_string(ctx, module->path.c_str());
+            duk_put_prop_string(ctx, 3, "filename");
+
+            // Hand the cached bytecode to duk__require without copying it. The cache keeps it
+            // alive for the life of the process and Duktape only reads it.
+            duk_push_external_buffer(ctx);
+            duk_config_buffer(ctx, -1, (void*)module->bytecode.data(), module->bytecode.size());
+
+            return 1;
+        }
+    }
+
+    ModuleCache& ModuleCache::shared() {
+        static ModuleCache cache;
+        return cache;
+    }
+
+    std::shared_ptr<const CachedModule> ModuleCache::find(const std::string& path) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+
+        const auto existing = modules.find(path);
+        if (existing == modules.end()) {
+            return nullptr;
+        }
+
+        return existing->second;
+    }
+
+    std::shared_ptr<const CachedModule> ModuleCache::insert(std::shared_ptr<const CachedModule> module) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+
+        const auto result = modules.emplace(module->path, module);
+        return result.first->second;
+    }
+
+    void installModuleSearch(duk_context* ctx, const std::string& root) {
+        duk_get_global_string(ctx, "Duktape");
+        duk_push_c_function(ctx, searchModule, 4);
+        duk_push_string(ctx, root.c_str());
+        duk_put_prop_string(ctx, -2, MODULE_ROOT_KEY);
+        duk_put_prop_string(ctx, -2, "modSearch");
+        duk_pop(ctx);
+    }
+}
@@ -0,0 +1,319 @@
+#include "PacketView.h"
+
+#include "Rdata.h"
+
+#include <cstring>
+
+namespace DNice {
+    PacketView::PacketView(const uint8_t* bytes, size_t size) :
+        bytes(bytes),
+        length(size) {
+    }
+
+    DnsError PacketView::index() {
+        if (length < DNS_HEADER_SIZE) {
+            return DnsError::Truncated;
+        }
+
+        size_t offset = DNS_HEADER_SIZE;
+        sectionStarts[0] = offset;
+
+        QuestionView question;
+        for (uint16_t i = 0; i < questionCount(); i++) {
+            if (!readQuestion(offset, question)) {
+                return DnsError::Truncated;
+            }
+        }
+
+        const uint16_t counts[] = { answerCount(), authorityCount(), additionalRecordCount() };
+        ResourceView resource;
+        for (size_t section = 0; section < 3; section++) {
+            sectionStarts[section + 1] = offset;
+
+            for (uint16_t i = 0; i < counts[section]; i++) {
+                if (!readResource(offset, resource)) {
+                    return DnsError::Truncated;
+                }
+            }
+        }
+
+        return DnsError::None;
+    }
+
+    uint16_t PacketView::id() const {
+        return getValue<uint16_t>(bytes, 0);
+    }
+
+    bool PacketView::isResponse() const {
+        return getFlag(bytes[2], 7);
+    }
+
+    Opcode PacketView::opcode() const {
+        return (Opcode)((bytes[2] & 0x78) >> 3);
+    }
+
+    bool PacketView::isAuthoritative() const {
+        return getFlag(bytes[2], 2);
+    }
+
+    bool PacketView::isTruncated() const {
+        return getFlag(bytes[2], 1);
+    }
+
+    bool PacketView::recursionDesired() const {
+        return getFlag(bytes[2], 0);
+    }
+
+    bool PacketView::recursionAvailable() const {
+        return getFlag(bytes[3], 7);
+    }
+
+    bool PacketView::zBit() const {
+        return getFlag(bytes[3], 6);
+    }
+
+    bool PacketView::isAuthenticData() const {
+        return getFlag(bytes[3], 5);
+    }
+
+    bool PacketView::checkingDisabled() const {
+        return getFlag(bytes[3], 4);
+    }
+
+    ResponseCode PacketView::responseCode() const {
+        return (ResponseCode)(bytes[3] & 0x0f);
+    }
+
+    uint16_t PacketView::questionCount() const {
+        return getValue<uint16_t>(bytes, 4);
+    }
+
+    uint16_t PacketView::answerCount() const {
+        return getValue<uint16_t>(bytes, 6);
+    }
+
+    uint16_t PacketView::authorityCount() const {
+        return getValue<uint16_t>(bytes, 8);
+    }
+
+    uint16_t PacketView::additionalRecordCount() const {
+        return getValue<uint16_t>(bytes, 10);
+    }
+
+    SectionRange<QuestionView> PacketView::questions() const {
+        return SectionRange<QuestionView>(this, sectionStarts[0], questionCount());
+    }
+
+    SectionRange<ResourceView> PacketView::answers() const {
+        return SectionRange<ResourceView>(this, sectionStarts[1], answerCount());
+    }
+
+    SectionRange<ResourceView> PacketView::authorities() const {
+        return SectionRange<ResourceView>(this, sectionStarts[2], authorityCount());
+    }
+
+    SectionRange<ResourceView> PacketView::additionalRecords() const {
+        return SectionRange<ResourceView>(this, sectionStarts[3], additionalRecordCount());
+    }
+
+    bool PacketView::readName(size_t& offset, Span& name) const {
+        auto index = offset;
+
+        while (index < length) {
+            const auto len = bytes[index];
+
+            if ((len & LABEL_POINTER_FLAGS) == LABEL_POINTER_FLAGS) {
+                if (index + 2 > length) {
+                    return false;
+                }
+
+                index += 2;
+                name.offset = offset;
+                name.length = index - offset;
+                offset = index;
+                return true;
+            }
+
+            // 0x40 and 0x80 are reserved label types.
+            if ((len & LABEL_POINTER_FLAGS) != 0) {
+                return false;
+            }
+
+            index += 1 + len;
+
+            if (len == 0) {
+                if (index - offset > MAX_NAME_LENGTH) {
+                    return false;
+                }
+
+                name.offset = offset;
+                name.length = index - offset;
+                offset = index;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    bool PacketView::readQuestion(size_t& offset, QuestionView& question) const {
+        auto index = offset;
+        if (!readName(index, question.name) || index + 4 > length) {
+            return false;
+        }
+
+        question.qtype = (Type)getValue<uint16_t>(bytes, index);
+        question.qclass = (Class)getValue<uint16_t>(bytes, index + 2);
+
+        offset = index + 4;
+        return true;
+    }
+
+    bool PacketView::readResource(size_t& offset, ResourceView& resource) const {
+        auto index = offset;
+        if (!readName(index, resource.name) || index + 10 > length) {
+            return false;
+        }
+
+        resource.rtype = (Type)getValue<uint16_t>(bytes, index);
+        resource.rclass = (Class)getValue<uint16_t>(bytes, index + 2);
+        resource.ttl = getValue<uint32_t>(bytes, index + 4);
+        resource.data.length = getValue<uint16_t>(bytes, index + 8);
+        resource.data.offset = index + 10;
+
+        if (resource.data.offset + resource.data.length > length) {
+            return false;
+        }
+
+        offset = resource.data.offset + resource.data.length;
+        return true;
+    }
+
+    int PacketView::decodeName(const Span& name, char* out, size_t capacity) const {
+        DomainName domain;
+        if (!readDomainName(name, domain)) {
+            return -1;
+        }
+
+        size_t written = 0;
+        for (size_t i = 0; i < domain.labelCount(); i++) {
+            const auto label = domain.label(i);
+            const size_t needed = label.length() + (written > 0 ? 1 : 0);
+            if (written + needed > capacity) {
+                return -1;
+            }
+
+            if (written > 0) {
+                out[written++] = '.';
+            }
+
+            memcpy(out + written, label.data(), label.length());
+            written += label.length();
+        }
+
+        return (int)written;
+    }
+
+    bool PacketView::appendName(const Span& name, std::string& out) const {
+        char buffer[MAX_NAME_LENGTH];
+        const auto written = decodeName(name, buffer, sizeof(buffer));
+        if (written < 0) {
+            return false;
+        }
+
+        out.append(buffer, (size_t)written);
+        return true;
+    }
+
+    bool PacketView::readDomainName(const Span& name, DomainName& out) const {
+        return decodeDomainName(bytes, length, name.offset, out) == DnsError::None;
+    }
+
+    bool PacketView::materialize(Packet& outPacket) const {
+        outPacket.id = id();
+        outPacket.isResponse = isResponse();
+        outPacket.opcode = opcode();
+        outPacket.isAuthoritative = isAuthoritative();
+        outPacket.isTruncated = isTruncated();
+        outPacket.recursionDesired = recursionDesired();
+        outPacket.recursionAvailable = recursionAvailable();
+        outPacket.zBit = zBit();
+        outPacket.isAuthenticData = isAuthenticData();
+        outPacket.checkingDisabled = checkingDisabled();
+        outPacket.responseCode = responseCode();
+
+        outPacket.questions.clear();
+        outPacket.questions.reserve(questionCount());
+        for (const auto& view : questions()) {
+            Question question;
+            if (!readDomainName(view.name, question.label.domainName)) {
+                return false;
+            }
+
+            question.qtype = view.qtype;
+            question.qclass = view.qclass;
+            outPacket.questions.push_back(std::move(question));
+        }
+
+        auto materializeSection = [this](const SectionRange<ResourceView>& section, std::pmr::vector<Resource>& receiver) {
+            receiver.clear();
+            receiver.reserve(section.size());
+            for (const auto& view : section) {
+                auto& resource = receiver.emplace_back();
+                if (!readDomainName(view.name, resource.label.domainName)) {
+                    return false;
+                }
+
+                resource.rtype = view.rtype;
+                resource.rclass = view.rclass;
+                resource.ttl = view.ttl;
+                if (!readRdata(view, resource)) {
+                    return false;
+                }
+            }
+
+            return true;
+        };
+
+        return materializeSection(answers(), outPacket.answers) &&
+            materializeSection(authorities(), outPacket.authorities) &&
+            materializeSection(additionalRecords(), outPacket.additionalRecords);
+    }
+
+    bool PacketView::readRdata(const ResourceView& view, Resource& resource) const {
+        const auto start = view.data.offset;
+        const auto end = start + view.data.length;
+
+        RdataLayout layout;
+        if (!rdataLayout(view.rtype, layout)) {
+            resource.data.assign(bytes + start, bytes + end);
+            resource.length = (uint16_t)resource.data.size();
+            return true;
+        }
+
+        if (start + layout.prefixLength > end) {
+            return false;
+        }
+
+        resource.data.assign(bytes + start, bytes + start + layout.prefixLength);
+
+        auto offset = start + layout.prefixLength;
+        for (uint8_t i = 0; i < layout.nameCount; i++) {
+            Span name;
+            DomainName expanded;
+            if (!readName(offset, name) || offset > end || !readDomainName(name, expanded)) {
+                return false;
+            }
+
+            resource.data.insert(resource.data.end(), expanded.wire(), expanded.wire() + expanded.wireLength());
+        }
+
+        if (offset + layout.suffixLength != end) {
+            return false;
+        }
+
+        resource.data.insert(resource.data.end(), bytes + offset, bytes + end);
+        resource.length = (uint16_t)resource.data.size();
+        return true;
+    }
+}
@@ -0,0 +1,186 @@
+#include "PoolAllocator.h"
+
+#include <cstdlib>
+#include <cstring>
+
+namespace DNice {
+    namespace {
+        // Block capacities, header excluded. Duktape's own allocations cluster at the small
+        // end (strings, property tables, activations), so the classes are densest there.
+        const size_t SIZE_CLASSES[] = { 16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 2048, 4096 };
+        const size_t CLASS_COUNT = sizeof(SIZE_CLASSES) / sizeof(SIZE_CLASSES[0]);
+        const uint32_t LARGE_BLOCK = (uint32_t)CLASS_COUNT;
+        const size_t SLAB_SIZE = 64 * 1024;
+
+        // Precedes every block. Sixteen bytes keeps the payload aligned for any type Duktape stores.
+        struct BlockHeader {
+            uint32_t sizeClass;
+            uint32_t reserved;
+            size_t size;
+        };
+
+        static_assert(sizeof(BlockHeader) == 16, "block header must preserve 16-byte alignment");
+
+        size_t classFor(size_t size) {
+            for (size_t i = 0; i < CLASS_COUNT; i++) {
+                if (size <= SIZE_CLASSES[i]) {
+                    return i;
+                }
+            }
+
+            return LARGE_BLOCK;
+        }
+
+        size_t capacityOf(const BlockHeader* header) {
+            return header->sizeClass == LARGE_BLOCK ? header->size : SIZE_CLASSES[header->sizeClass];
+        }
+
+        BlockHeader* headerOf(void* pointer) {
+            return (BlockHeader*)pointer - 1;
+        }
+    }
+
+    PoolAllocator::PoolAllocator(size_t budget) :
+        budget(budget),
+        freeLists(CLASS_COUNT, nullptr) {
+    }
+
+    PoolAllocator::~PoolAllocator() {
+        for (auto slab : slabs) {
+            free(slab);
+        }
+    }
+
+    bool PoolAllocator::reserve(size_t bytes, size_t credit) {
+        const auto taken = allocatorStats.slabBytes + allocatorStats.largeBytes - credit;
+        if (budget != 0 && taken + bytes > budget) {
+            allocatorStats.failures++;
+            return false;
+        }
+
+        return true;
+    }
+
+    void* PoolAllocator::allocateFromClass(size_t classIndex, size_t credit) {
+        auto freeBlock = freeLists[classIndex];
+        if (freeBlock != nullptr) {
+            freeLists[classIndex] = freeBlock->next;
+            return freeBlock;
+        }
+
+        const auto blockSize = sizeof(BlockHeader) + SIZE_CLASSES[classIndex];
+        if (slabRemaining < blockSize) {
+            // Whatever is left of the old slab is abandoned; it is always smaller than one block.
+            if (!reserve(SLAB_SIZE, credit)) {
+                return nullptr;
+            }
+
+            auto slab = (uint8_t*)malloc(SLAB_SIZE);
+            if (slab == nullptr) {
+                return nullptr;
+            }
+
+            slabs.push_back(slab);
+            allocatorStats.slabBytes += SLAB_SIZE;
+            slabCursor = slab;
+            slabRemaining = SLAB_SIZE;
+        }
+
+        auto block = slabCursor;
+        slabCursor += blockSize;
+        slabRemaining -= blockSize;
+        return block;
+    }
+
+    void* PoolAllocator::allocate(size_t size) {
+        return allocateBlock(size, 0);
+    }
+
+    void* PoolAllocator::allocateBlock(size_t size, size_t credit) {
+        const auto classIndex = classFor(size);
+        const auto capacity = classIndex == LARGE_BLOCK ? size : SIZE_CLASSES[classIndex];
+
+        void* block = nullptr;
+        if (classIndex != LARGE_BLOCK) {
+            block = allocateFromClass(classIndex, credit);
+        } else if (reserve(sizeof(BlockHeader) + size, credit)) {
+            block = malloc(sizeof(BlockHeader) + size);
+            if (block != nullptr) {
+                allocatorStats.largeBytes += sizeof(BlockHeader) + size;
+            }
+        }
+
+        if (block == nullptr) {
+            return nullptr;
+        }
+
+        auto header = (BlockHeader*)block;
+        header->sizeClass = (uint32_t)classIndex;
+        header->size = size;
+
+        allocatorStats.allocations++;
+        allocatorStats.bytesInUse += capacity;
+        if (allocatorStats.bytesInUse > allocatorStats.peakBytesInUse) {
+            allocatorStats.peakBytesInUse = allocatorStats.bytesInUse;
+        }
+
+        return header + 1;
+    }
+
+    void PoolAllocator::release(void* pointer) {
+        if (pointer == nullptr) {
+            return;
+        }
+
+        auto header = headerOf(pointer);
+        allocatorStats.bytesInUse -= capacityOf(header);
+        allocatorStats.frees++;
+
+        if (header->sizeClass == LARGE_BLOCK) {
+            allocatorStats.largeBytes -= sizeof(BlockHeader) + header->size;
+            free(header);
+            return;
+        }
+
+        // The free-list link overwrites the header, so read the class first.
+        const auto classIndex = header->sizeClass;
+        auto freeBlock = (FreeBlock*)header;
+        freeBlock->next = freeLists[classIndex];
+        freeLists[classIndex] = freeBlock;
+    }
+
+    void* PoolAllocator::reallocate(void* pointer, size_t size) {
+        if (pointer == nullptr) {
+            return allocate(size);
+        }
+
+        if (size == 0) {
+            release(pointer);
+            return nullptr;
+        }
+
+        allocatorStats.reallocations++;
+
+        auto header = headerOf(pointer);
+        const auto capacity = capacityOf(header);
+
+        // Growing or shrinking within the block's size class needs no copy. Large blocks are
+        // always moved so their accounting stays exact.
+        if (header->sizeClass != LARGE_BLOCK && size <= capacity && classFor(size) == header->sizeClass) {
+            header->size = size;
+            return pointer;
+        }
+
+        // A large block is given back once its contents have moved, so it doesn't count against
+        // the budget for its replacement. A small one stays in its slab either way.
+        const auto credit = header->sizeClass == LARGE_BLOCK ? sizeof(BlockHeader) + header->size : 0;
+        auto moved = allocateBlock(size, credit);
+        if (moved == nullptr) {
+            return nullptr;
+        }
+
+        memcpy(moved, pointer, header->size < size ? header->size : size);
+        release(pointer);
+        return moved;
+    }
+}
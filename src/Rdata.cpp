@@ -0,0 +1,331 @@
+#include "Rdata.h"
+
+namespace DNice {
+    namespace {
+        const size_t MAX_RDATA_LENGTH = 0xFFFF;
+        const size_t MAX_CHARACTER_STRING = 255;
+
+        // Reads an uncompressed name from RDATA. Pointers never appear in Resource::data, so
+        // one here means the data is corrupt rather than something to follow.
+        DnsError readName(const std::pmr::vector<uint8_t>& data, size_t& index, DomainName& name) {
+            name.clear();
+
+            while (true) {
+                if (index >= data.size()) {
+                    return DnsError::BadRdata;
+                }
+
+                const auto len = (size_t)data[index];
+                if ((len & LABEL_POINTER_FLAGS) != 0) {
+                    return DnsError::BadRdata;
+                }
+
+                index += 1;
+                if (len == 0) {
+                    return DnsError::None;
+                }
+
+                if (index + len > data.size()) {
+                    return DnsError::BadRdata;
+                }
+
+                const auto error = name.appendLabel(data.data() + index, len);
+                if (error != DnsError::None) {
+                    return error;
+                }
+
+                index += len;
+            }
+        }
+
+        void writeName(std::pmr::vector<uint8_t>& data, const DomainName& name) {
+            data.insert(data.end(), name.wire(), name.wire() + name.wireLength());
+        }
+
+        DnsError finish(Resource& resource) {
+            if (resource.data.size() > MAX_RDATA_LENGTH) {
+                resource.data.clear();
+                resource.length = 0;
+                return DnsError::BadRdata;
+            }
+
+            resource.length = (uint16_t)resource.data.size();
+            return DnsError::None;
+        }
+    }
+
+    DnsError decodeRdata(const Resource& resource, AddressRdata& out) {
+        const size_t expected = resource.rtype == Type::A ? 4 : resource.rtype == Type::AAAA ? 16 : 0;
+        if (expected == 0) {
+            return DnsError::TypeMismatch;
+        }
+
+        if (resource.data.size() != expected) {
+            return DnsError::BadRdata;
+        }
+
+        out.address = resource.data.data();
+        out.length = expected;
+        return DnsError::None;
+    }
+
+    DnsError decodeRdata(const Resource& resource, NameRdata& out) {
+        if (resource.rtype != Type::NS && resource.rtype != Type::CNAME && resource.rtype != Type::PTR) {
+            return DnsError::TypeMismatch;
+        }
+
+        size_t index = 0;
+        const auto error = readName(resource.data, index, out.name);
+        if (error != DnsError::None) {
+            return error;
+        }
+
+        return index == resource.data.size() ? DnsError::None : DnsError::BadRdata;
+    }
+
+    DnsError decodeRdata(const Resource& resource, MxRdata& out) {
+        if (resource.rtype != Type::MX) {
+            return DnsError::TypeMismatch;
+        }
+
+        if (resource.data.size() < 2) {
+            return DnsError::BadRdata;
+        }
+
+        out.preference = getValue<uint16_t>(resource.data, 0);
+
+        size_t index = 2;
+        const auto error = readName(resource.data, index, out.exchange);
+        if (error != DnsError::None) {
+            return error;
+        }
+
+        return index == resource.data.size() ? DnsError::None : DnsError::BadRdata;
+    }
+
+    DnsError decodeRdata(const Resource& resource, SrvRdata& out) {
+        if (resource.rtype != Type::SRV) {
+            return DnsError::TypeMismatch;
+        }
+
+        if (resource.data.size() < 6) {
+            return DnsError::BadRdata;
+        }
+
+        out.priority = getValue<uint16_t>(resource.data, 0);
+        out.weight = getValue<uint16_t>(resource.data, 2);
+        out.port = getValue<uint16_t>(resource.data, 4);
+
+        size_t index = 6;
+        const auto error = readName(resource.data, index, out.target);
+        if (error != DnsError::None) {
+            return error;
+        }
+
+        return index == resource.data.size() ? DnsError::None : DnsError::BadRdata;
+    }
+
+    DnsError decodeRdata(const Resource& resource, SoaRdata& out) {
+        if (resource.rtype != Type::SOA) {
+            return DnsError::TypeMismatch;
+        }
+
+        size_t index = 0;
+        auto error = readName(resource.data, index, out.primaryServer);
+        if (error == DnsError::None) {
+            error = readName(resource.data, index, out.responsibleMailbox);
+        }
+
+        if (error != DnsError::None) {
+            return error;
+        }
+
+        if (index + 20 != resource.data.size()) {
+            return DnsError::BadRdata;
+        }
+
+        out.serial = getValue<uint32_t>(resource.data, index);
+        out.refresh = getValue<uint32_t>(resource.data, index + 4);
+        out.retry = getValue<uint32_t>(resource.data, index + 8);
+        out.expire = getValue<uint32_t>(resource.data, index + 12);
+        out.minimum = getValue<uint32_t>(resource.data, index + 16);
+        return DnsError::None;
+    }
+
+    DnsError decodeRdata(const Resource& resource, TxtRdata& out) {
+        if (resource.rtype != Type::TXT) {
+            return DnsError::TypeMismatch;
+        }
+
+        out.strings.clear();
+
+        size_t index = 0;
+        while (index < resource.data.size()) {
+            const auto length = (size_t)resource.data[index];
+            if (index + 1 + length > resource.data.size()) {
+                return DnsError::BadRdata;
+            }
+
+            out.strings.emplace_back((const char*)resource.data.data() + index + 1, length);
+            index += 1 + length;
+        }
+
+        return DnsError::None;
+    }
+
+    DnsError encodeRdata(const AddressRdata& rdata, Resource& resource) {
+        if (rdata.length != 4 && rdata.length != 16) {
+            return DnsError::BadRdata;
+        }
+
+        resource.data.assign(rdata.address, rdata.address + rdata.length);
+        return finish(resource);
+    }
+
+    DnsError encodeRdata(const NameRdata& rdata, Resource& resource) {
+        resource.data.clear();
+        writeName(resource.data, rdata.name);
+        return finish(resource);
+    }
+
+    DnsError encodeRdata(const MxRdata& rdata, Resource& resource) {
+        resource.data.clear();
+        pushValue(resource.data, rdata.preference);
+        writeName(resource.data, rdata.exchange);
+        return finish(resource);
+    }
+
+    DnsError encodeRdata(const SrvRdata& rdata, Resource& resource) {
+        resource.data.clear();
+        pushValue(resource.data, rdata.priority);
+        pushValue(resource.data, rdata.weight);
+        pushValue(resource.data, rdata.port);
+        writeName(resource.data, rdata.target);
+        return finish(resource);
+    }
+
+    DnsError encodeRdata(const SoaRdata& rdata, Resource& resource) {
+        resource.data.clear();
+        writeName(resource.data, rdata.primaryServer);
+        writeName(resource.data, rdata.responsibleMailbox);
+        pushValue(resource.data, rdata.serial);
+        pushValue(resource.data, rdata.refresh);
+        pushValue(resource.data, rdata.retry);
+        pushValue(resource.data, rdata.expire);
+        pushValue(resource.data, rdata.minimum);
+        return finish(resource);
+    }
+
+    DnsError encodeRdata(const TxtRdata& rdata, Resource& resource) {
+        resource.data.clear();
+        for (const auto& text : rdata.strings) {
+            if (text.length() > MAX_CHARACTER_STRING) {
+                resource.data.clear();
+                resource.length = 0;
+                return DnsError::BadRdata;
+            }
+
+            resource.data.push_back((uint8_t)text.length());
+            resource.data.insert(resource.data.end(), text.begin(), text.end());
+        }
+
+        return finish(resource);
+    }
+
+    bool rdataLayout(Type type, RdataLayout& layout) {
+        switch (type) {
+            case Type::NS:
+            case Type::CNAME:
+            case Type::PTR:
+                layout = { 0, 1, 0, true };
+                return true;
+            case Type::MX:
+                layout = { 2, 1, 0, true };
+                return true;
+            case Type::SRV:
+                layout = { 6, 1, 0, false };
+                return true;
+            case Type::SOA:
+                layout = { 0, 2, 20, true };
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    DnsError expandRdata(const std::vector<uint8_t>& message, size_t index, size_t length, const RdataLayout& layout, NameMemo* memo, std::pmr::vector<uint8_t>& out) {
+        const auto end = index + length;
+        if (end > message.size() || index + layout.prefixLength > end) {
+            return DnsError::BadRdata;
+        }
+
+        out.assign(message.begin() + index, message.begin() + index + layout.prefixLength);
+        index += layout.prefixLength;
+
+        for (uint8_t i = 0; i < layout.nameCount; i++) {
+            Label label;
+            auto error = parseLabel(message, index, label, memo);
+            if (error != DnsError::None) {
+                return error;
+            }
+
+            if (index > end) {
+                return DnsError::BadRdata;
+            }
+
+            if (label.isPointer) {
+                // The parser only checks that a whole-name pointer points backward, not at what.
+                error = resolveLabel(message, label, label.domainName, memo);
+                if (error != DnsError::None) {
+                    return error;
+                }
+            }
+
+            writeName(out, label.domainName);
+        }
+
+        if (index + layout.suffixLength != end) {
+            return DnsError::BadRdata;
+        }
+
+        out.insert(out.end(), message.begin() + index, message.begin() + end);
+        return DnsError::None;
+    }
+
+    DnsError compressRdata(WireWriter& bytes, const Resource& resource, const RdataLayout& layout, NameCompressionTable* compression) {
+        const auto& data = resource.data;
+        if (data.size() < layout.prefixLength) {
+            return DnsError::BadRdata;
+        }
+
+        // The length goes first but isn't known until the names have been compressed.
+        const auto lengthOffset = bytes.size();
+        pushValue(bytes, (uint16_t)0);
+
+        bytes.append(data.data(), layout.prefixLength);
+
+        size_t index = layout.prefixLength;
+        for (uint8_t i = 0; i < layout.nameCount; i++) {
+            // The name is decoded into a temporary, but its bytes in data stay put for as long
+            // as compression refers to them.
+            const auto nameStart = index;
+            DomainName name;
+            auto error = readName(data, index, name);
+            if (error == DnsError::None) {
+                error = serializeName(bytes, name, data.data() + nameStart, compression);
+            }
+
+            if (error != DnsError::None) {
+                return error;
+            }
+        }
+
+        if (index + layout.suffixLength != data.size()) {
+            return DnsError::BadRdata;
+        }
+
+        bytes.append(data.data() + index, data.size() - index);
+        bytes.setValue(lengthOffset, (uint16_t)(bytes.size() - lengthOffset - 2));
+        return DnsError::None;
+    }
+}
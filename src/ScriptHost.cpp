@@ -0,0 +1,766 @@
+#include "ScriptHost.h"
+
+#include "ModuleLoader.h"
+#include "Rdata.h"
+
+#include "duk_module_duktape.h"
+
+#include <cstring>
+#include <iostream>
+
+#include <arpa/inet.h>
+
+namespace DNice {
+    namespace {
+        struct BytecodeLoad {
+            const std::vector<uint8_t>* bytecode;
+        };
+
+        // Where forward() callbacks wait in the global stash, keyed by token.
+        const char* const FORWARDS_KEY = "forwards";
+        // Marks the object forward() returns, holding its token.
+        const char* const FORWARD_MARKER = DUK_HIDDEN_SYMBOL("forward");
+        // Where the coroutine trampoline's functions are kept in the global stash.
+        const char* const COROUTINES_KEY = "coroutines";
+
+        // Runs handleQuery on a Duktape.Thread so that resolve() can yield out of it mid-handler.
+        // A yield is passed to suspend, which parks the thread like a forward() callback and
+        // returns the marker that tells the worker to wait. Threads that run to completion loop
+        // back to yield their result and are reused, so a query that never waits costs one
+        // resume and one yield rather than a new thread. Duktape unwinds both with a C++
+        // exception, which is why handlers only run this way when they ask to.
+        const char* const COROUTINE_TRAMPOLINE =
+            "(function (suspend) {\n"
+            "    var Thread = Duktape.Thread;\n"
+            "    var main = Thread.current();\n"
+            "    var idle = [];\n"
+            "    function Wait(question) { this.question = question; }\n"
+            "    function loop(query) {\n"
+            "        for (;;) {\n"
+            "            query = Thread.yield(handleQuery(query));\n"
+            "        }\n"
+            "    }\n"
+            "    function step(thread, value) {\n"
+            "        var result = Thread.resume(thread, value);\n"
+            "        if (result instanceof Wait) {\n"
+            "            return suspend(result.question, thread);\n"
+            "        }\n"
+            "        if (idle.length < 64) {\n"
+            "            idle.push(thread);\n"
+            "        }\n"
+            "        return result;\n"
+            "    }\n"
+            "    return {\n"
+            "        start: function (query) { return step(idle.pop() || new Thread(loop), query); },\n"
+            "        resume: step,\n"
+            "        resolve: function (question) {\n"
+            "            if (Thread.current() === main) {\n"
+            "                throw new Error('resolve() needs handleQuery.suspends = true');\n"
+            "            }\n"
+            "            return Thread.yield(new Wait(question));\n"
+            "        }\n"
+            "    };\n"
+            "})";
+
+        struct HandlerCall {
+            const PacketView* query = nullptr;
+            Packet* response = nullptr;
+            // When resuming a forward() callback, its token and the upstream's answer, if any.
+            uint64_t resumeToken = 0;
+            const Packet* reply = nullptr;
+            // The token of the forward() whose result was returned, leaving the response to its
+            // callback. Zero when the result was an answer.
+            uint64_t returnedForward = 0;
+        };
+
+        void onFatalError(void* udata, const char* message) {
+            (void)udata;
+            std::cerr << "Fatal script engine error: " << (message != nullptr ? message : "unknown") << std::endl;
+            abort();
+        }
+
+        duk_ret_t print(duk_context* ctx) {
+            duk_push_string(ctx, " ");
+            duk_insert(ctx, 0);
+            duk_join(ctx, duk_get_top(ctx) - 1);
+            std::cerr << duk_safe_to_string(ctx, -1) << std::endl;
+            return 0;
+        }
+
+        void pushQuestions(duk_context* ctx, const PacketView& query) {
+            duk_push_array(ctx);
+
+            duk_uarridx_t index = 0;
+            for (const auto& question : query.questions()) {
+                char name[PacketView::MAX_NAME_LENGTH];
+                const auto nameLength = query.decodeName(question.name, name, sizeof(name));
+
+                duk_push_object(ctx);
+                duk_push_lstring(ctx, name, nameLength < 0 ? 0 : (duk_size_t)nameLength);
+                duk_put_prop_string(ctx, -2, "name");
+                duk_push_uint(ctx, (duk_uint_t)question.qtype);
+                duk_put_prop_string(ctx, -2, "type");
+                duk_push_uint(ctx, (duk_uint_t)question.qclass);
+                duk_put_prop_string(ctx, -2, "class");
+                duk_put_prop_index(ctx, -2, index++);
+            }
+        }
+
+        void pushQuery(duk_context* ctx, const PacketView& query) {
+            duk_push_object(ctx);
+            duk_push_uint(ctx, query.id());
+            duk_put_prop_string(ctx, -2, "id");
+            duk_push_uint(ctx, (duk_uint_t)query.opcode());
+            duk_put_prop_string(ctx, -2, "opcode");
+            duk_push_boolean(ctx, query.recursionDesired());
+            duk_put_prop_string(ctx, -2, "recursionDesired");
+            duk_push_boolean(ctx, query.checkingDisabled());
+            duk_put_prop_string(ctx, -2, "checkingDisabled");
+            pushQuestions(ctx, query);
+            duk_put_prop_string(ctx, -2, "questions");
+        }
+
+        void pushName(duk_context* ctx, const DomainName& name) {
+            const auto text = name.toString();
+            duk_push_lstring(ctx, text.data(), text.size());
+        }
+
+        // Sets the type-specific fields that records returned by handlers may give instead of
+        // data, so a reply can be inspected without decoding data by hand.
+        void pushTypedData(duk_context* ctx, const Resource& resource) {
+            switch (resource.rtype) {
+                case Type::A:
+                case Type::AAAA: {
+                    AddressRdata rdata;
+                    char text[INET6_ADDRSTRLEN];
+                    if (decodeRdata(resource, rdata) == DnsError::None &&
+                        inet_ntop(rdata.length == 4 ? AF_INET : AF_INET6, rdata.address, text, sizeof(text)) != nullptr) {
+                        duk_push_string(ctx, text);
+                        duk_put_prop_string(ctx, -2, "address");
+                    }
+                    break;
+                }
+                case Type::NS:
+                case Type::CNAME:
+                case Type::PTR: {
+                    NameRdata rdata;
+                    if (decodeRdata(resource, rdata) == DnsError::None) {
+                        pushName(ctx, rdata.name);
+                        duk_put_prop_string(ctx, -2, "target");
+                    }
+                    break;
+                }
+                case Type::MX: {
+                    MxRdata rdata;
+                    if (decodeRdata(resource, rdata) == DnsError::None) {
+                        duk_push_uint(ctx, rdata.preference);
+                        duk_put_prop_string(ctx, -2, "preference");
+                        pushName(ctx, rdata.exchange);
+                        duk_put_prop_string(ctx, -2, "exchange");
+                    }
+                    break;
+                }
+                case Type::SRV: {
+                    SrvRdata rdata;
+                    if (decodeRdata(resource, rdata) == DnsError::None) {
+                        duk_push_uint(ctx, rdata.priority);
+                        duk_put_prop_string(ctx, -2, "priority");
+                        duk_push_uint(ctx, rdata.weight);
+                        duk_put_prop_string(ctx, -2, "weight");
+                        duk_push_uint(ctx, rdata.port);
+                        duk_put_prop_string(ctx, -2, "port");
+                        pushName(ctx, rdata.target);
+                        duk_put_prop_string(ctx, -2, "target");
+                    }
+                    break;
+                }
+                case Type::SOA: {
+                    SoaRdata rdata;
+                    if (decodeRdata(resource, rdata) == DnsError::None) {
+                        pushName(ctx, rdata.primaryServer);
+                        duk_put_prop_string(ctx, -2, "primaryServer");
+                        pushName(ctx, rdata.responsibleMailbox);
+                        duk_put_prop_string(ctx, -2, "responsibleMailbox");
+                        duk_push_uint(ctx, rdata.serial);
+                        duk_put_prop_string(ctx, -2, "serial");
+                        duk_push_uint(ctx, rdata.refresh);
+                        duk_put_prop_string(ctx, -2, "refresh");
+                        duk_push_uint(ctx, rdata.retry);
+                        duk_put_prop_string(ctx, -2, "retry");
+                        duk_push_uint(ctx, rdata.expire);
+                        duk_put_prop_string(ctx, -2, "expire");
+                        duk_push_uint(ctx, rdata.minimum);
+                        duk_put_prop_string(ctx, -2, "minimum");
+                    }
+                    break;
+                }
+                case Type::TXT: {
+                    TxtRdata rdata;
+                    if (decodeRdata(resource, rdata) == DnsError::None) {
+                        duk_push_array(ctx);
+                        for (size_t i = 0; i < rdata.strings.size(); i++) {
+                            duk_push_lstring(ctx, rdata.strings[i].data(), rdata.strings[i].size());
+                            duk_put_prop_index(ctx, -2, (duk_uarridx_t)i);
+                        }
+
+                        duk_put_prop_string(ctx, -2, "text");
+                    }
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+
+        // Records in the shape handlers return them, each with its data and, for the common
+        // types, its fields. OPT is left out, as the server adds its own.
+        void pushResources(duk_context* ctx, const std::pmr::vector<Resource>& resources) {
+            duk_push_array(ctx);
+
+            duk_uarridx_t index = 0;
+            for (const auto& resource : resources) {
+                if (resource.rtype == Type::OPT) {
+                    continue;
+                }
+
+                duk_push_object(ctx);
+                pushName(ctx, resource.label.domainName);
+                duk_put_prop_string(ctx, -2, "name");
+                duk_push_uint(ctx, (duk_uint_t)resource.rtype);
+                duk_put_prop_string(ctx, -2, "type");
+                duk_push_uint(ctx, (duk_uint_t)resource.rclass);
+                duk_put_prop_string(ctx, -2, "class");
+                duk_push_uint(ctx, resource.ttl);
+                duk_put_prop_string(ctx, -2, "ttl");
+
+                auto data = duk_push_fixed_buffer(ctx, resource.data.size());
+                if (!resource.data.empty()) {
+                    memcpy(data, resource.data.data(), resource.data.size());
+                }
+
+                duk_put_prop_string(ctx, -2, "data");
+                pushTypedData(ctx, resource);
+                duk_put_prop_index(ctx, -2, index++);
+            }
+        }
+
+        // An upstream's answer, in the same shape as a handler's result so it can be returned as it is.
+        void pushReply(duk_context* ctx, const Packet& reply) {
+            duk_push_object(ctx);
+            duk_push_uint(ctx, (duk_uint_t)reply.responseCode);
+            duk_put_prop_string(ctx, -2, "responseCode");
+            duk_push_boolean(ctx, reply.isAuthoritative);
+            duk_put_prop_string(ctx, -2, "isAuthoritative");
+            duk_push_boolean(ctx, reply.recursionAvailable);
+            duk_put_prop_string(ctx, -2, "recursionAvailable");
+            duk_push_boolean(ctx, reply.isTruncated);
+            duk_put_prop_string(ctx, -2, "isTruncated");
+            pushResources(ctx, reply.answers);
+            duk_put_prop_string(ctx, -2, "answers");
+            pushResources(ctx, reply.authorities);
+            duk_put_prop_string(ctx, -2, "authorities");
+            pushResources(ctx, reply.additionalRecords);
+            duk_put_prop_string(ctx, -2, "additionalRecords");
+        }
+
+        bool getBoolean(duk_context* ctx, duk_idx_t objectIndex, const char* key, bool fallback) {
+            duk_get_prop_string(ctx, objectIndex, key);
+            const auto value = duk_is_undefined(ctx, -1) ? fallback : (bool)duk_to_boolean(ctx, -1);
+            duk_pop(ctx);
+            return value;
+        }
+
+        uint32_t getUint(duk_context* ctx, duk_idx_t objectIndex, const char* key, uint32_t fallback) {
+            duk_get_prop_string(ctx, objectIndex, key);
+            const auto value = duk_is_undefined(ctx, -1) ? fallback : (uint32_t)duk_to_uint32(ctx, -1);
+            duk_pop(ctx);
+            return value;
+        }
+
+        // Reads the record data at the top of the stack, which may be a buffer or an array of bytes.
+        void readData(duk_context* ctx, std::pmr::vector<uint8_t>& data) {
+            if (duk_is_buffer_data(ctx, -1)) {
+                duk_size_t size = 0;
+                const auto bytes = (const uint8_t*)duk_get_buffer_data(ctx, -1, &size);
+                data.assign(bytes, bytes + size);
+            } else if (duk_is_array(ctx, -1)) {
+                const auto length = duk_get_length(ctx, -1);
+                data.reserve(length);
+                for (duk_size_t i = 0; i < length; i++) {
+                    duk_get_prop_index(ctx, -1, (duk_uarridx_t)i);
+                    data.push_back((uint8_t)duk_to_uint32(ctx, -1));
+                    duk_pop(ctx);
+                }
+            } else if (!duk_is_undefined(ctx, -1)) {
+                (void)duk_type_error(ctx, "record data must be a buffer or an array of bytes");
+            }
+        }
+
+        void getName(duk_context* ctx, duk_idx_t objectIndex, const char* key, DomainName& name) {
+            duk_get_prop_string(ctx, objectIndex, key);
+            const auto text = duk_to_string(ctx, -1);
+            const auto error = name.assign(text);
+            if (error != DnsError::None) {
+                (void)duk_range_error(ctx, "invalid %s \"%s\": %s", key, text, describeError(error));
+            }
+
+            duk_pop(ctx);
+        }
+
+        // Builds the record data from the type-specific fields of the record at recordIndex, for
+        // records that give those instead of raw data.
+        void readTypedData(duk_context* ctx, duk_idx_t recordIndex, Resource& resource) {
+            auto error = DnsError::None;
+
+            switch (resource.rtype) {
+                case Type::A:
+                case Type::AAAA: {
+                    uint8_t address[16];
+                    duk_get_prop_string(ctx, recordIndex, "address");
+                    const auto text = duk_to_string(ctx, -1);
+                    const auto family = resource.rtype == Type::A ? AF_INET : AF_INET6;
+                    if (inet_pton(family, text, address) != 1) {
+                        (void)duk_range_error(ctx, "invalid address \"%s\"", text);
+                    }
+
+                    duk_pop(ctx);
+
+                    AddressRdata rdata;
+                    rdata.address = address;
+                    rdata.length = resource.rtype == Type::A ? 4 : 16;
+                    error = encodeRdata(rdata, resource);
+                    break;
+                }
+                case Type::NS:
+                case Type::CNAME:
+                case Type::PTR: {
+                    NameRdata rdata;
+                    getName(ctx, recordIndex, "target", rdata.name);
+                    error = encodeRdata(rdata, resource);
+                    break;
+                }
+                case Type::MX: {
+                    MxRdata rdata;
+                    rdata.preference = (uint16_t)getUint(ctx, recordIndex, "preference", 0);
+                    getName(ctx, recordIndex, "exchange", rdata.exchange);
+                    error = encodeRdata(rdata, resource);
+                    break;
+                }
+                case Type::SRV: {
+                    SrvRdata rdata;
+                    rdata.priority = (uint16_t)getUint(ctx, recordIndex, "priority", 0);
+                    rdata.weight = (uint16_t)getUint(ctx, recordIndex, "weight", 0);
+                    rdata.port = (uint16_t)getUint(ctx, recordIndex, "port", 0);
+                    getName(ctx, recordIndex, "target", rdata.target);
+                    error = encodeRdata(rdata, resource);
+                    break;
+                }
+                case Type::SOA: {
+                    SoaRdata rdata;
+                    getName(ctx, recordIndex, "primaryServer", rdata.primaryServer);
+                    getName(ctx, recordIndex, "responsibleMailbox", rdata.responsibleMailbox);
+                    rdata.serial = getUint(ctx, recordIndex, "serial", 0);
+                    rdata.refresh = getUint(ctx, recordIndex, "refresh", 0);
+                    rdata.retry = getUint(ctx, recordIndex, "retry", 0);
+                    rdata.expire = getUint(ctx, recordIndex, "expire", 0);
+                    rdata.minimum = getUint(ctx, recordIndex, "minimum", 0);
+                    error = encodeRdata(rdata, resource);
+                    break;
+                }
+                case Type::TXT: {
+                    // A single string or an array of them. The views point into strings on the
+                    // value stack, which stay there until the data has been encoded.
+                    TxtRdata rdata;
+                    duk_get_prop_string(ctx, recordIndex, "text");
+                    const auto textIndex = duk_normalize_index(ctx, -1);
+                    const auto top = duk_get_top(ctx);
+
+                    if (duk_is_array(ctx, textIndex)) {
+                        // Every string stays pushed, so reserve room beyond the default 64 slots.
+                        // Each needs at least its length byte, which bounds a valid count.
+                        const auto count = duk_get_length(ctx, textIndex);
+                        if (count > UINT16_MAX) {
+                            (void)duk_range_error(ctx, "invalid record data: %s", describeError(DnsError::BadRdata));
+                        }
+                        duk_require_stack(ctx, (duk_idx_t)count);
+                        for (duk_size_t i = 0; i < count; i++) {
+                            duk_get_prop_index(ctx, textIndex, (duk_uarridx_t)i);
+                            duk_size_t length = 0;
+                            const auto text = duk_to_lstring(ctx, -1, &length);
+                            rdata.strings.emplace_back(text, length);
+                        }
+                    } else if (!duk_is_undefined(ctx, textIndex)) {
+                        duk_size_t length = 0;
+                        const auto text = duk_to_lstring(ctx, textIndex, &length);
+                        rdata.strings.emplace_back(text, length);
+                    }
+
+                    error = encodeRdata(rdata, resource);
+                    duk_set_top(ctx, top - 1);
+                    break;
+                }
+                default:
+                    break;
+            }
+
+            if (error != DnsError::None) {
+                (void)duk_range_error(ctx, "invalid record data: %s", describeError(error));
+            }
+        }
+
+        void readResources(duk_context* ctx, duk_idx_t resultIndex, const char* key, std::pmr::vector<Resource>& receiver) {
+            if (!duk_get_prop_string(ctx, resultIndex, key) || !duk_is_array(ctx, -1)) {
+                duk_pop(ctx);
+                return;
+            }
+
+            const auto count = duk_get_length(ctx, -1);
+            for (duk_size_t i = 0; i < count; i++) {
+                duk_get_prop_index(ctx, -1, (duk_uarridx_t)i);
+                const auto recordIndex = duk_require_normalize_index(ctx, -1);
+                duk_require_object(ctx, recordIndex);
+
+                auto& resource = receiver.emplace_back();
+                duk_get_prop_string(ctx, recordIndex, "name");
+                const auto name = duk_to_string(ctx, -1);
+                const auto nameError = resource.label.domainName.assign(name);
+                if (nameError != DnsError::None) {
+                    (void)duk_range_error(ctx, "invalid record name \"%s\": %s", name, describeError(nameError));
+                }
+
+                duk_pop(ctx);
+
+                resource.rtype = (Type)getUint(ctx, recordIndex, "type", (uint32_t)Type::A);
+                resource.rclass = (Class)getUint(ctx, recordIndex, "class", (uint32_t)Class::IN);
+                resource.ttl = getUint(ctx, recordIndex, "ttl", 0);
+
+                duk_get_prop_string(ctx, recordIndex, "data");
+                if (duk_is_undefined(ctx, -1)) {
+                    readTypedData(ctx, recordIndex, resource);
+                } else {
+                    readData(ctx, resource.data);
+                    resource.length = (uint16_t)resource.data.size();
+                }
+
+                duk_pop(ctx);
+                duk_pop(ctx);
+            }
+
+            duk_pop(ctx);
+        }
+
+        // duk_load_function throws on malformed input, so it runs inside duk_safe_call.
+        duk_ret_t runBytecode(duk_context* ctx, void* udata) {
+            auto load = (BytecodeLoad*)udata;
+
+            auto buffer = duk_push_fixed_buffer(ctx, load->bytecode->size());
+            memcpy(buffer, load->bytecode->data(), load->bytecode->size());
+            duk_load_function(ctx);
+            duk_call(ctx, 0);
+
+            return 0;
+        }
+
+        // Fills in the response from the result at the top of the stack, unless it is the
+        // result of forward().
+        duk_ret_t readResult(duk_context* ctx, HandlerCall* call, const char* function) {
+            const auto resultIndex = duk_normalize_index(ctx, -1);
+            if (!duk_is_object(ctx, resultIndex)) {
+                return duk_error(ctx, DUK_ERR_TYPE_ERROR, "%s must return an object", function);
+            }
+
+            if (duk_get_prop_string(ctx, resultIndex, FORWARD_MARKER)) {
+                call->returnedForward = (uint64_t)duk_get_number(ctx, -1);
+                return 0;
+            }
+
+            duk_pop(ctx);
+
+            auto& response = *call->response;
+            response.responseCode = (ResponseCode)(getUint(ctx, resultIndex, "responseCode", 0) & 0x0f);
+            response.isAuthoritative = getBoolean(ctx, resultIndex, "isAuthoritative", false);
+            response.recursionAvailable = getBoolean(ctx, resultIndex, "recursionAvailable", false);
+
+            readResources(ctx, resultIndex, "answers", response.answers);
+            readResources(ctx, resultIndex, "authorities", response.authorities);
+            readResources(ctx, resultIndex, "additionalRecords", response.additionalRecords);
+
+            return 0;
+        }
+
+        // Runs inside duk_safe_call so that errors thrown while building the query or reading
+        // the result are caught the same way as errors thrown by the script itself.
+        duk_ret_t runHandler(duk_context* ctx, void* udata) {
+            auto call = (HandlerCall*)udata;
+
+            if (!duk_get_global_string(ctx, "handleQuery") || !duk_is_function(ctx, -1)) {
+                return duk_error(ctx, DUK_ERR_REFERENCE_ERROR, "handleQuery is not defined");
+            }
+
+            duk_get_prop_string(ctx, -1, "suspends");
+            if (duk_to_boolean(ctx, -1)) {
+                // The trampoline's coroutine calls it.
+                duk_push_global_stash(ctx);
+                duk_get_prop_string(ctx, -1, COROUTINES_KEY);
+                duk_get_prop_string(ctx, -1, "start");
+            } else {
+                duk_pop(ctx);
+            }
+
+            pushQuery(ctx, *call->query);
+            duk_call(ctx, 1);
+            return readResult(ctx, call, "handleQuery");
+        }
+
+        void pushReplyOrNull(duk_context* ctx, const Packet* reply) {
+            if (reply != nullptr) {
+                pushReply(ctx, *reply);
+            } else {
+                duk_push_null(ctx);
+            }
+        }
+
+        duk_ret_t runForwardCallback(duk_context* ctx, void* udata) {
+            auto call = (HandlerCall*)udata;
+
+            // Take the callback out of the stash, so it runs once whatever happens next.
+            duk_push_global_stash(ctx);
+            duk_get_prop_string(ctx, -1, FORWARDS_KEY);
+            duk_push_number(ctx, (duk_double_t)call->resumeToken);
+            duk_get_prop(ctx, -2);
+            duk_push_number(ctx, (duk_double_t)call->resumeToken);
+            duk_del_prop(ctx, -3);
+            const auto continuation = duk_normalize_index(ctx, -1);
+
+            // A handler suspended in resolve() carries on from there, with the reply as its result.
+            if (duk_is_thread(ctx, continuation)) {
+                duk_get_prop_string(ctx, -3, COROUTINES_KEY);
+                duk_get_prop_string(ctx, -1, "resume");
+                duk_dup(ctx, continuation);
+                pushReplyOrNull(ctx, call->reply);
+                duk_call(ctx, 2);
+                return readResult(ctx, call, "handleQuery");
+            }
+
+            if (!duk_is_function(ctx, continuation)) {
+                return duk_error(ctx, DUK_ERR_REFERENCE_ERROR, "no forward() callback is waiting");
+            }
+
+            pushReplyOrNull(ctx, call->reply);
+            duk_call(ctx, 1);
+            return readResult(ctx, call, "forward() callback");
+        }
+    }
+
+    ScriptHost::ScriptHost(size_t heapBudget) :
+        allocator(heapBudget) {
+        ctx = duk_create_heap(allocateMemory, reallocateMemory, releaseMemory, this, onFatalError);
+
+        duk_module_duktape_init(ctx);
+
+        duk_push_c_function(ctx, print, DUK_VARARGS);
+        duk_put_global_string(ctx, "print");
+
+        duk_push_c_function(ctx, forwardQuery, 2);
+        duk_put_global_string(ctx, "forward");
+
+        duk_push_global_stash(ctx);
+        duk_push_object(ctx);
+        duk_put_prop_string(ctx, -2, FORWARDS_KEY);
+
+        duk_eval_string(ctx, COROUTINE_TRAMPOLINE);
+        duk_push_c_function(ctx, suspendQuery, 2);
+        duk_call(ctx, 1);
+        duk_get_prop_string(ctx, -1, "resolve");
+        duk_put_global_string(ctx, "resolve");
+        duk_put_prop_string(ctx, -2, COROUTINES_KEY);
+        duk_pop(ctx);
+    }
+
+    ScriptHost::~ScriptHost() {
+        duk_destroy_heap(ctx);
+    }
+
+    void* ScriptHost::allocateMemory(void* udata, duk_size_t size) {
+        return ((ScriptHost*)udata)->allocator.allocate(size);
+    }
+
+    void* ScriptHost::reallocateMemory(void* udata, void* pointer, duk_size_t size) {
+        return ((ScriptHost*)udata)->allocator.reallocate(pointer, size);
+    }
+
+    void ScriptHost::releaseMemory(void* udata, void* pointer) {
+        ((ScriptHost*)udata)->allocator.release(pointer);
+    }
+
+    void ScriptHost::setModuleRoot(const std::string& root) {
+        installModuleSearch(ctx, root);
+    }
+
+    bool ScriptHost::load(const std::string& source, const std::string& fileName, std::string& error) {
+        duk_push_string(ctx, fileName.c_str());
+        if (duk_pcompile_lstring_filename(ctx, 0, source.data(), source.length()) != DUK_EXEC_SUCCESS ||
+            duk_pcall(ctx, 0) != DUK_EXEC_SUCCESS) {
+            error = duk_safe_to_string(ctx, -1);
+            duk_pop(ctx);
+            return false;
+        }
+
+        duk_pop(ctx);
+        return true;
+    }
+
+    bool ScriptHost::compile(const std::string& source, const std::string& fileName, std::vector<uint8_t>& bytecode, std::string& error) {
+        duk_push_string(ctx, fileName.c_str());
+        if (duk_pcompile_lstring_filename(ctx, 0, source.data(), source.length()) != DUK_EXEC_SUCCESS) {
+            error = duk_safe_to_string(ctx, -1);
+            duk_pop(ctx);
+            return false;
+        }
+
+        duk_dump_function(ctx);
+
+        duk_size_t size = 0;
+        const auto data = (const uint8_t*)duk_get_buffer(ctx, -1, &size);
+        bytecode.assign(data, data + size);
+
+        duk_pop(ctx);
+        return true;
+    }
+
+    bool ScriptHost::loadBytecode(const std::vector<uint8_t>& bytecode, std::string& error) {
+        BytecodeLoad load;
+        load.bytecode = &bytecode;
+
+        if (duk_safe_call(ctx, runBytecode, &load, 0, 1) != DUK_EXEC_SUCCESS) {
+            error = duk_safe_to_string(ctx, -1);
+            duk_pop(ctx);
+            return false;
+        }
+
+        duk_pop(ctx);
+        return true;
+    }
+
+    bool ScriptHost::handleQuery(const PacketView& query, Packet& response, std::string& error) {
+        HandlerCall call;
+        call.query = &query;
+        call.response = &response;
+        return invoke(runHandler, &call, call.returnedForward, error);
+    }
+
+    bool ScriptHost::resumeForward(uint64_t token, const Packet* reply, Packet& response, std::string& error) {
+        HandlerCall call;
+        call.response = &response;
+        call.resumeToken = token;
+        call.reply = reply;
+        return invoke(runForwardCallback, &call, call.returnedForward, error);
+    }
+
+    bool ScriptHost::invoke(duk_safe_call_function function, void* call, const uint64_t& returnedForward, std::string& error) {
+        pendingForward = 0;
+        requestedForward = 0;
+        inCall = true;
+
+        deadlineExpired = false;
+        deadlineArmed = executionBudget.count() > 0;
+        if (deadlineArmed) {
+            deadline = std::chrono::steady_clock::now() + executionBudget;
+        }
+
+        const auto result = duk_safe_call(ctx, function, call, 0, 1);
+        deadlineArmed = false;
+        inCall = false;
+
+        bool succeeded = result == DUK_EXEC_SUCCESS;
+        if (!succeeded) {
+            error = duk_safe_to_string(ctx, -1);
+        } else if (returnedForward != 0 && returnedForward != requestedForward) {
+            error = "returned the result of a forward() from an earlier call";
+            succeeded = false;
+        }
+
+        duk_pop(ctx);
+
+        if (succeeded && returnedForward != 0) {
+            pendingForward = returnedForward;
+        } else if (requestedForward != 0) {
+            // forward() was called but its result not returned, so nothing waits on its callback.
+            duk_push_global_stash(ctx);
+            duk_get_prop_string(ctx, -1, FORWARDS_KEY);
+            duk_push_number(ctx, (duk_double_t)requestedForward);
+            duk_del_prop(ctx, -2);
+            duk_pop_2(ctx);
+        }
+
+        return succeeded;
+    }
+
+    duk_ret_t ScriptHost::forwardQuery(duk_context* ctx) {
+        duk_require_object(ctx, 0);
+        duk_require_function(ctx, 1);
+        return deferAnswer(ctx, "forward()");
+    }
+
+    duk_ret_t ScriptHost::suspendQuery(duk_context* ctx) {
+        duk_require_object(ctx, 0);
+        if (!duk_is_thread(ctx, 1)) {
+            return duk_error(ctx, DUK_ERR_TYPE_ERROR, "not a thread");
+        }
+
+        return deferAnswer(ctx, "resolve()");
+    }
+
+    duk_ret_t ScriptHost::deferAnswer(duk_context* ctx, const char* function) {
+        duk_memory_functions functions;
+        duk_get_memory_functions(ctx, &functions);
+        auto host = (ScriptHost*)functions.udata;
+
+        if (!host->forwardingEnabled) {
+            return duk_error(ctx, DUK_ERR_ERROR, "%s needs an upstream server", function);
+        }
+
+        if (!host->inCall) {
+            return duk_error(ctx, DUK_ERR_ERROR, "%s may only be called while a query is being handled", function);
+        }
+
+        if (host->requestedForward != 0) {
+            return duk_error(ctx, DUK_ERR_ERROR, "%s called after forward() in the same handler", function);
+        }
+
+        auto& question = host->forwardQuestion;
+        getName(ctx, 0, "name", question.label.domainName);
+        question.qtype = (Type)getUint(ctx, 0, "type", (uint32_t)Type::A);
+        question.qclass = (Class)getUint(ctx, 0, "class", (uint32_t)Class::IN);
+
+        const auto token = host->nextForwardToken++;
+
+        duk_push_global_stash(ctx);
+        duk_get_prop_string(ctx, -1, FORWARDS_KEY);
+        duk_push_number(ctx, (duk_double_t)token);
+        duk_dup(ctx, 1);
+        duk_put_prop(ctx, -3);
+        duk_pop_2(ctx);
+
+        host->requestedForward = token;
+
+        duk_push_object(ctx);
+        duk_push_number(ctx, (duk_double_t)token);
+        duk_put_prop_string(ctx, -2, FORWARD_MARKER);
+        return 1;
+    }
+}
+
+// Duktape's DUK_USE_EXEC_TIMEOUT_CHECK hook, polled from the bytecode executor's interrupt.
+duk_bool_t dnice_exec_timeout_check(void* udata) {
+    auto host = (DNice::ScriptHost*)udata;
+    if (!host->deadlineArmed) {
+        return 0;
+    }
+
+    if (!host->deadlineExpired && std::chrono::steady_clock::now() >= host->deadline) {
+        host->deadlineExpired = true;
+    }
+
+    return host->deadlineExpired ? 1 : 0;
+}
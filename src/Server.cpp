@@ -0,0 +1,138 @@
+#include "Server.h"
+
+#include "BytecodeCache.h"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+namespace DNice {
+    Server::Server(const ServerOptions& options) :
+        options(options),
+        running(false) {
+    }
+
+    bool Server::start(std::string& error) {
+        if (options.batchSize == 0) {
+            options.batchSize = 1;
+        }
+
+        if (options.threads == 0) {
+            options.threads = std::thread::hardware_concurrency();
+            if (options.threads == 0) {
+                options.threads = 1;
+            }
+        }
+
+        if (options.modulePath.empty()) {
+            const auto separator = options.scriptPath.find_last_of('/');
+            options.modulePath = separator == std::string::npos ? "." : options.scriptPath.substr(0, separator);
+        }
+
+        if (!options.scriptPath.empty()) {
+            std::ifstream scriptFile(options.scriptPath, std::ios::binary);
+            if (!scriptFile) {
+                error = "Could not open script: " + options.scriptPath;
+                return false;
+            }
+
+            std::stringstream contents;
+            contents << scriptFile.rdbuf();
+            const auto scriptSource = contents.str();
+
+            if (!prepareScript(scriptSource, error)) {
+                return false;
+            }
+        }
+
+        for (unsigned int i = 0; i < options.threads; i++) {
+            workers.emplace_back(new Worker(i, options, scriptBytecode));
+            if (!workers.back()->open(error)) {
+                workers.clear();
+                return false;
+            }
+        }
+
+        running = true;
+        return true;
+    }
+
+    bool Server::prepareScript(const std::string& source, std::string& error) {
+        BytecodeCache cache(options.bytecodeCacheDirectory);
+        const auto cacheKey = BytecodeCache::key(source, options.scriptPath);
+        const bool useCache = !options.bytecodeCacheDirectory.empty();
+
+        // Same budget as the workers, so a script that cannot even load within it fails here.
+        ScriptHost validator(options.heapBudget);
+        validator.setModuleRoot(options.modulePath);
+        const bool cached = useCache && cache.load(cacheKey, scriptBytecode);
+
+        if (!cached) {
+            if (!validator.compile(source, options.scriptPath, scriptBytecode, error)) {
+                return false;
+            }
+
+            // A cache that can't be written only costs startup time, so it isn't fatal.
+            std::string cacheError;
+            if (useCache && !cache.store(cacheKey, scriptBytecode, cacheError)) {
+                std::cerr << cacheError << std::endl;
+            }
+        }
+
+        // Run the program once up front so a broken script fails startup instead of every worker.
+        return validator.loadBytecode(scriptBytecode, error);
+    }
+
+    void Server::run() {
+        std::vector<std::thread> threads;
+        for (auto& worker : workers) {
+            auto workerPointer = worker.get();
+            threads.emplace_back([this, workerPointer]() { workerPointer->run(running); });
+        }
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    void Server::stop() {
+        running = false;
+    }
+
+    WorkerStats Server::totalStats() const {
+        WorkerStats total;
+        for (const auto& worker : workers) {
+            const auto& stats = worker->stats();
+            total.received += stats.received;
+            total.answered += stats.answered;
+            total.dropped += stats.dropped;
+            total.scriptErrors += stats.scriptErrors;
+            total.receiveCalls += stats.receiveCalls;
+            total.sendCalls += stats.sendCalls;
+            total.scriptTimeouts += stats.scriptTimeouts;
+            total.cacheHits += stats.cacheHits;
+            total.heap.allocations += stats.heap.allocations;
+            total.heap.frees += stats.heap.frees;
+            total.heap.reallocations += stats.heap.reallocations;
+            total.heap.failures += stats.heap.failures;
+            total.heap.bytesInUse += stats.heap.bytesInUse;
+            total.heap.peakBytesInUse += stats.heap.peakBytesInUse;
+            total.heap.slabBytes += stats.heap.slabBytes;
+            total.heap.largeBytes += stats.heap.largeBytes;
+            total.tcp.accepted += stats.tcp.accepted;
+            total.tcp.rejected += stats.tcp.rejected;
+            total.tcp.idleClosed += stats.tcp.idleClosed;
+            total.tcp.queries += stats.tcp.queries;
+            total.tcp.answered += stats.tcp.answered;
+            total.forwarded += stats.forwarded;
+            total.forward.queries += stats.forward.queries;
+            total.forward.answered += stats.forward.answered;
+            total.forward.retries += stats.forward.retries;
+            total.forward.failed += stats.forward.failed;
+            total.forward.unmatched += stats.forward.unmatched;
+        }
+
+        return total;
+    }
+}
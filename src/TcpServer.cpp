@@ -0,0 +1,351 @@
+#include "TcpServer.h"
+
+#include "DNS.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+namespace DNice {
+    namespace {
+        const uint64_t LISTENER_TAG = UINT64_MAX;
+        const int LISTEN_BACKLOG = 1024;
+        const int EVENTS_PER_WAIT = 64;
+        const size_t RECEIVE_BUFFER_SIZE = 64 * 1024;
+        // A client that sends queries without reading the answers is stopped being read from
+        // once this much output is waiting for it.
+        const size_t MAX_PENDING_OUTPUT = 128 * 1024;
+        const std::chrono::milliseconds SWEEP_INTERVAL(100);
+    }
+
+    TcpServer::TcpServer(size_t maxConnections, std::chrono::milliseconds idleTimeout, QueryHandler handler) :
+        maxConnections(maxConnections),
+        idleTimeout(idleTimeout),
+        handler(std::move(handler)) {
+    }
+
+    TcpServer::~TcpServer() {
+        for (size_t slot = 0; slot < connections.size(); slot++) {
+            if (connections[slot].fd >= 0) {
+                close(connections[slot].fd);
+            }
+        }
+
+        if (listenFd >= 0) {
+            close(listenFd);
+        }
+
+        if (epollFd >= 0) {
+            close(epollFd);
+        }
+    }
+
+    bool TcpServer::open(const sockaddr_storage& address, socklen_t addressLength, std::string& error) {
+        listenFd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listenFd < 0) {
+            error = std::string("TCP socket: ") + strerror(errno);
+            return false;
+        }
+
+        int enable = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+        if (setsockopt(listenFd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) != 0) {
+            error = std::string("TCP SO_REUSEPORT: ") + strerror(errno);
+            return false;
+        }
+
+        if (bind(listenFd, (const sockaddr*)&address, addressLength) != 0) {
+            error = std::string("TCP bind: ") + strerror(errno);
+            return false;
+        }
+
+        if (listen(listenFd, LISTEN_BACKLOG) != 0) {
+            error = std::string("listen: ") + strerror(errno);
+            return false;
+        }
+
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFd < 0) {
+            error = std::string("epoll_create1: ") + strerror(errno);
+            return false;
+        }
+
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = LISTENER_TAG;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event) != 0) {
+            error = std::string("epoll_ctl: ") + strerror(errno);
+            return false;
+        }
+
+        receiveBuffer.resize(RECEIVE_BUFFER_SIZE);
+        connections.resize(maxConnections);
+        for (size_t slot = maxConnections; slot > 0; slot--) {
+            freeSlots.push_back(slot - 1);
+        }
+
+        return true;
+    }
+
+    void TcpServer::service() {
+        epoll_event events[EVENTS_PER_WAIT];
+        const auto ready = epoll_wait(epollFd, events, EVENTS_PER_WAIT, 0);
+
+        for (int i = 0; i < ready; i++) {
+            const auto tag = events[i].data.u64;
+            if (tag == LISTENER_TAG) {
+                acceptConnections();
+                continue;
+            }
+
+            const auto slot = (size_t)tag;
+            // An earlier event in this batch may have closed it.
+            if (connections[slot].fd < 0) {
+                continue;
+            }
+
+            const auto flags = events[i].events;
+            if ((flags & EPOLLERR) != 0) {
+                closeConnection(slot);
+                continue;
+            }
+
+            if ((flags & EPOLLOUT) != 0) {
+                flush(slot);
+            }
+
+            if ((flags & (EPOLLIN | EPOLLHUP)) != 0 && connections[slot].fd >= 0) {
+                readFrom(slot);
+            }
+        }
+    }
+
+    void TcpServer::closeIdle() {
+        const auto now = Clock::now();
+        if (now < nextSweep) {
+            return;
+        }
+
+        nextSweep = now + SWEEP_INTERVAL;
+        for (size_t slot = 0; slot < connections.size(); slot++) {
+            const auto& connection = connections[slot];
+            if (connection.fd >= 0 && connection.deferred == 0 && now - connection.lastActive > idleTimeout) {
+                tcpStats.idleClosed++;
+                closeConnection(slot);
+            }
+        }
+    }
+
+    void TcpServer::defer(ConnectionId connection) {
+        size_t slot = 0;
+        if (slotOf(connection, slot)) {
+            connections[slot].deferred++;
+        }
+    }
+
+    bool TcpServer::deliver(ConnectionId connection, const uint8_t* response, size_t length) {
+        size_t slot = 0;
+        if (!slotOf(connection, slot)) {
+            return false;
+        }
+
+        auto& open = connections[slot];
+        open.deferred--;
+        appendResponse(open, response, length);
+        tcpStats.answered++;
+        flush(slot);
+        return true;
+    }
+
+    void TcpServer::abandon(ConnectionId connection) {
+        size_t slot = 0;
+        if (slotOf(connection, slot)) {
+            connections[slot].deferred--;
+            // The connection may only have been kept open for this answer.
+            flush(slot);
+        }
+    }
+
+    void TcpServer::acceptConnections() {
+        for (;;) {
+            const int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                return;
+            }
+
+            if (freeSlots.empty()) {
+                tcpStats.rejected++;
+                close(fd);
+                continue;
+            }
+
+            // Answers are written whole, so there is nothing to gain from Nagle's delay.
+            int enable = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+            const auto slot = freeSlots.back();
+            auto& connection = connections[slot];
+            connection.fd = fd;
+            connection.events = EPOLLIN;
+            connection.lastActive = Clock::now();
+
+            epoll_event event;
+            event.events = connection.events;
+            event.data.u64 = slot;
+            if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+                close(fd);
+                connection.fd = -1;
+                continue;
+            }
+
+            freeSlots.pop_back();
+            tcpStats.accepted++;
+        }
+    }
+
+    void TcpServer::readFrom(size_t slot) {
+        auto& connection = connections[slot];
+        const auto received = recv(connection.fd, receiveBuffer.data(), receiveBuffer.size(), 0);
+
+        if (received == 0) {
+            connection.peerClosed = true;
+        } else if (received < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                closeConnection(slot);
+            }
+
+            return;
+        } else {
+            connection.lastActive = Clock::now();
+            connection.framer.consume(receiveBuffer.data(), (size_t)received, [this, slot](const uint8_t* request, size_t length) {
+                return handleQuery(slot, request, length);
+            });
+        }
+
+        flush(slot);
+    }
+
+    bool TcpServer::handleQuery(size_t slot, const uint8_t* request, size_t length) {
+        auto& connection = connections[slot];
+        tcpStats.queries++;
+        if (handler(idOf(slot), request, length, response)) {
+            appendResponse(connection, response.data(), response.size());
+            tcpStats.answered++;
+        }
+
+        return connection.output.size() - connection.outputOffset < MAX_PENDING_OUTPUT;
+    }
+
+    void TcpServer::appendResponse(Connection& connection, const uint8_t* response, size_t length) {
+        pushValue(connection.output, (uint16_t)length);
+        connection.output.insert(connection.output.end(), response, response + length);
+    }
+
+    void TcpServer::flush(size_t slot) {
+        auto& connection = connections[slot];
+
+        while (connection.outputOffset < connection.output.size()) {
+            const auto sent = send(
+                connection.fd,
+                connection.output.data() + connection.outputOffset,
+                connection.output.size() - connection.outputOffset,
+                MSG_NOSIGNAL | MSG_DONTWAIT
+            );
+
+            if (sent < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                    break;
+                }
+
+                closeConnection(slot);
+                return;
+            }
+
+            connection.outputOffset += (size_t)sent;
+            connection.lastActive = Clock::now();
+        }
+
+        if (connection.outputOffset == connection.output.size()) {
+            connection.output.clear();
+            connection.outputOffset = 0;
+
+            // Queries held back while the client caught up on its answers can go now.
+            if (connection.framer.isHolding()) {
+                connection.framer.drain([this, slot](const uint8_t* request, size_t length) {
+                    return handleQuery(slot, request, length);
+                });
+
+                if (!connection.output.empty()) {
+                    flush(slot);
+                    return;
+                }
+            }
+
+            if (connection.peerClosed && connection.deferred == 0) {
+                closeConnection(slot);
+                return;
+            }
+        }
+
+        updateEvents(slot);
+    }
+
+    void TcpServer::updateEvents(size_t slot) {
+        auto& connection = connections[slot];
+
+        const auto pending = connection.output.size() - connection.outputOffset;
+        uint32_t events = 0;
+        if (!connection.peerClosed && !connection.framer.isHolding() && pending < MAX_PENDING_OUTPUT) {
+            events |= EPOLLIN;
+        }
+
+        if (pending > 0) {
+            events |= EPOLLOUT;
+        }
+
+        if (events == connection.events) {
+            return;
+        }
+
+        // Hangups are reported whatever was asked for, so a peer that closes while its answers
+        // are still being worked out would wake every wait until they arrive. Leave the socket
+        // out of the set until there is something to send.
+        int operation = EPOLL_CTL_MOD;
+        if (events == 0) {
+            operation = EPOLL_CTL_DEL;
+        } else if (connection.events == 0) {
+            operation = EPOLL_CTL_ADD;
+        }
+
+        epoll_event event;
+        event.events = events;
+        event.data.u64 = slot;
+        epoll_ctl(epollFd, operation, connection.fd, &event);
+        connection.events = events;
+    }
+
+    void TcpServer::closeConnection(size_t slot) {
+        auto& connection = connections[slot];
+        close(connection.fd);
+
+        // Drops the buffers too, so an idle slot holds no memory.
+        const auto generation = connection.generation;
+        connection = Connection();
+        connection.generation = generation + 1;
+        freeSlots.push_back(slot);
+    }
+
+    TcpServer::ConnectionId TcpServer::idOf(size_t slot) const {
+        return ((ConnectionId)connections[slot].generation << 32) | slot;
+    }
+
+    bool TcpServer::slotOf(ConnectionId connection, size_t& slot) const {
+        slot = (size_t)(connection & UINT32_MAX);
+        return slot < connections.size() && connections[slot].fd >= 0 &&
+            connections[slot].generation == (uint32_t)(connection >> 32);
+    }
+}
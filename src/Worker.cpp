@@ -0,0 +1,1011 @@
+#include "Worker.h"
+
+#include "IoUring.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+namespace DNice {
+    const size_t MAX_DATAGRAM = 65535;
+    // TCP messages carry a two byte length.
+    const size_t MAX_TCP_RESPONSE = 65535;
+    const int POLL_TIMEOUT_MS = 100;
+    // How long a batch flush waits for a full socket send buffer to drain before dropping
+    // the answers it still holds.
+    const int SEND_WAIT_MS = 10;
+    const uint16_t DEFAULT_UPSTREAM_PORT = 53;
+    // Per-datagram receive space in batched mode. Queries, even with EDNS options, are far
+    // smaller than this, and anything larger is dropped rather than truncated.
+    const size_t BATCH_SLOT_SIZE = 4096;
+
+    const unsigned int URING_ENTRIES = 1024;
+    // Must be a power of two.
+    const uint16_t URING_BUFFER_COUNT = 512;
+    const uint16_t URING_BUFFER_GROUP = 1;
+    const size_t MIN_URING_SEND_SLOTS = 256;
+
+    // The top three bits of a completion's user_data say which operation it belongs to. Sends
+    // keep their slot index in the remaining bits.
+    const uint64_t URING_TAG_MASK = 7ULL << 61;
+    const uint64_t URING_RECEIVE_TAG = 1ULL << 61;
+    const uint64_t URING_SEND_TAG = 2ULL << 61;
+    const uint64_t URING_TIMEOUT_TAG = 3ULL << 61;
+    const uint64_t URING_TCP_TAG = 4ULL << 61;
+    const uint64_t URING_FORWARD_TAG = 5ULL << 61;
+    const uint64_t URING_FORWARD_TIMER_TAG = 6ULL << 61;
+
+    namespace {
+        // An in-flight io_uring send. Everything the kernel reads must stay put until it completes.
+        struct UringSendSlot {
+            std::vector<uint8_t> buffer;
+            sockaddr_storage peer;
+            iovec vector;
+            msghdr header;
+        };
+
+        // Adds the server's OPT record to a response to an EDNS query.
+        void addOpt(Packet& response, uint16_t payloadSize, bool dnssecOk, bool badVersion) {
+            Edns edns;
+            edns.udpPayloadSize = payloadSize;
+            edns.extendedResponseCode = badVersion ? EDNS_BAD_VERSION : 0;
+            // The DO bit is echoed, per RFC 3225 section 3.
+            edns.dnssecOk = dnssecOk;
+            encodeEdns(edns, response.additionalRecords.emplace_back());
+        }
+
+        void reportUringFallback(unsigned int workerIndex, const std::string& reason) {
+            // Every worker hits the same limitation, so only the first one says so.
+            if (workerIndex == 0) {
+                std::cerr << "io_uring unavailable (" << reason << "), using the portable backend" << std::endl;
+            }
+        }
+    }
+
+    bool parseSocketAddress(const std::string& text, uint16_t port, sockaddr_storage& address, socklen_t& length) {
+        memset(&address, 0, sizeof(address));
+
+        auto ipv4 = (sockaddr_in*)&address;
+        if (inet_pton(AF_INET, text.c_str(), &ipv4->sin_addr) == 1) {
+            ipv4->sin_family = AF_INET;
+            ipv4->sin_port = htons(port);
+            length = sizeof(sockaddr_in);
+            return true;
+        }
+
+        auto ipv6 = (sockaddr_in6*)&address;
+        if (inet_pton(AF_INET6, text.c_str(), &ipv6->sin6_addr) == 1) {
+            ipv6->sin6_family = AF_INET6;
+            ipv6->sin6_port = htons(port);
+            length = sizeof(sockaddr_in6);
+            return true;
+        }
+
+        return false;
+    }
+
+    bool parseUpstreamAddress(const std::string& text, sockaddr_storage& address, socklen_t& length) {
+        auto host = text;
+        std::string port;
+
+        if (!text.empty() && text[0] == '[') {
+            const auto close = text.find(']');
+            if (close == std::string::npos || (close + 1 < text.size() && text[close + 1] != ':')) {
+                return false;
+            }
+
+            host = text.substr(1, close - 1);
+            if (close + 1 < text.size()) {
+                port = text.substr(close + 2);
+            }
+        } else if (std::count(text.begin(), text.end(), ':') == 1) {
+            // More than one colon is a bare IPv6 address.
+            const auto colon = text.find(':');
+            host = text.substr(0, colon);
+            port = text.substr(colon + 1);
+        }
+
+        auto portNumber = DEFAULT_UPSTREAM_PORT;
+        if (!port.empty()) {
+            char* end = nullptr;
+            const auto value = strtoul(port.c_str(), &end, 10);
+            if (*end != '\0' || value == 0 || value > UINT16_MAX) {
+                return false;
+            }
+
+            portNumber = (uint16_t)value;
+        } else if (host.size() != text.size() && text.back() == ':') {
+            return false;
+        }
+
+        return parseSocketAddress(host, portNumber, address, length);
+    }
+
+    Worker::Worker(unsigned int index, const ServerOptions& options, const std::vector<uint8_t>& scriptBytecode) :
+        index(index),
+        options(options),
+        scriptBytecode(scriptBytecode),
+        packetArena(packetArenaBuffer, sizeof(packetArenaBuffer)),
+        answerCache(options.cacheSize),
+        tcpServer(options.tcpConnections, options.tcpIdleTimeout,
+            [this](TcpServer::ConnectionId connection, const uint8_t* request, size_t length, std::vector<uint8_t>& response) {
+                workerStats.received++;
+
+                QuerySource source;
+                source.transport = Transport::Tcp;
+                source.connection = connection;
+                switch (processQuery(request, length, response, source)) {
+                    case QueryResult::Answered:
+                        workerStats.answered++;
+                        return true;
+                    case QueryResult::Dropped:
+                        workerStats.dropped++;
+                        return false;
+                    case QueryResult::Forwarded:
+                        break;
+                }
+
+                return false;
+            }),
+        forwarder(options.forwardTimeout, options.forwardRetries, options.ednsPayloadSize,
+            [this](uint64_t token, const uint8_t* reply, size_t length) {
+                completeForward(token, reply, length);
+            }) {
+    }
+
+    Worker::~Worker() {
+        if (socketFd >= 0) {
+            close(socketFd);
+        }
+    }
+
+    bool Worker::open(std::string& error) {
+        sockaddr_storage address;
+        socklen_t addressLength = 0;
+        if (!parseSocketAddress(options.address, options.port, address, addressLength)) {
+            error = "Invalid listen address: " + options.address;
+            return false;
+        }
+
+        socketFd = socket(address.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (socketFd < 0) {
+            error = std::string("socket: ") + strerror(errno);
+            return false;
+        }
+
+        int enable = 1;
+        if (setsockopt(socketFd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) != 0) {
+            error = std::string("SO_REUSEPORT: ") + strerror(errno);
+            return false;
+        }
+
+        if (bind(socketFd, (const sockaddr*)&address, addressLength) != 0) {
+            error = std::string("bind: ") + strerror(errno);
+            return false;
+        }
+
+        if (options.tcpConnections > 0 && !tcpServer.open(address, addressLength, error)) {
+            return false;
+        }
+
+        if (options.upstreams.empty()) {
+            return true;
+        }
+
+        std::vector<sockaddr_storage> upstreams(options.upstreams.size());
+        for (size_t i = 0; i < upstreams.size(); i++) {
+            socklen_t upstreamLength = 0;
+            if (!parseUpstreamAddress(options.upstreams[i], upstreams[i], upstreamLength)) {
+                error = "Invalid upstream address: " + options.upstreams[i];
+                return false;
+            }
+        }
+
+        return forwarder.open(upstreams, error);
+    }
+
+    void Worker::pinToCpu() {
+        const auto cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+        if (cpuCount <= 0) {
+            return;
+        }
+
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(index % (unsigned int)cpuCount, &cpus);
+
+        const auto result = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (result != 0) {
+            std::cerr << "Worker " << index << " could not be pinned: " << strerror(result) << std::endl;
+        }
+    }
+
+    void Worker::run(const std::atomic<bool>& running) {
+        if (options.pinThreads) {
+            pinToCpu();
+        }
+
+        script.reset(new ScriptHost(options.heapBudget));
+        script->setModuleRoot(options.modulePath);
+        script->setExecutionBudget(options.scriptTimeout);
+        script->enableForwarding(forwarder.isOpen());
+        if (!options.scriptPath.empty()) {
+            std::string error;
+            scriptLoaded = script->loadBytecode(scriptBytecode, error);
+            if (!scriptLoaded) {
+                std::cerr << "Worker " << index << " failed to load script: " << error << std::endl;
+            }
+        }
+
+        if (options.ioEngine != IoEngine::IoUring || !runUring(running)) {
+            runPortable(running);
+        }
+
+        workerStats.heap = script->allocatorStats();
+        workerStats.tcp = tcpServer.stats();
+        workerStats.forward = forwarder.stats();
+
+        // The heap is torn down on the thread that used it.
+        script.reset();
+    }
+
+    void Worker::runPortable(const std::atomic<bool>& running) {
+        const bool batched = options.batchSize > 1;
+        if (batched) {
+            prepareBatch();
+        } else {
+            receiveBuffer.resize(MAX_DATAGRAM);
+            sendBuffer.reserve(MAX_DATAGRAM);
+        }
+
+        // poll() skips the TCP and upstream entries when those are disabled, as their
+        // descriptors are then -1.
+        pollfd pollSockets[3];
+        pollSockets[0].fd = socketFd;
+        pollSockets[0].events = POLLIN;
+        pollSockets[1].fd = tcpServer.eventFd();
+        pollSockets[1].events = POLLIN;
+        pollSockets[2].fd = forwarder.eventFd();
+        pollSockets[2].events = POLLIN;
+
+        while (running.load(std::memory_order_relaxed)) {
+            // Wake up in time to retry forwarded questions that go unanswered.
+            const auto timeout = std::min(forwarder.nextTimeout(), std::chrono::milliseconds(POLL_TIMEOUT_MS));
+            const auto ready = poll(pollSockets, 3, (int)timeout.count());
+
+            if (ready > 0 && pollSockets[0].revents != 0) {
+                if (batched) {
+                    drainBatched();
+                } else {
+                    drainSingle();
+                }
+            }
+
+            if (tcpServer.isOpen()) {
+                if (ready > 0 && pollSockets[1].revents != 0) {
+                    tcpServer.service();
+                }
+
+                tcpServer.closeIdle();
+            }
+
+            if (forwarder.isOpen()) {
+                if (ready > 0 && pollSockets[2].revents != 0) {
+                    forwarder.service();
+                }
+
+                forwarder.expire();
+            }
+        }
+    }
+
+    bool Worker::runUring(const std::atomic<bool>& running) {
+        IoUring ring;
+        std::string error;
+
+        if (!ring.init(URING_ENTRIES, error)) {
+            reportUringFallback(index, error);
+            return false;
+        }
+
+        if (!ring.supportsOperation(IORING_OP_RECVMSG) ||
+            !ring.supportsOperation(IORING_OP_SENDMSG) ||
+            !ring.supportsOperation(IORING_OP_TIMEOUT) ||
+            !ring.supportsOperation(IORING_OP_POLL_ADD)) {
+            reportUringFallback(index, "kernel lacks required io_uring operations");
+            return false;
+        }
+
+        receiveBuffer.resize(URING_BUFFER_COUNT * BATCH_SLOT_SIZE);
+        if (!ring.registerBufferRing(URING_BUFFER_GROUP, receiveBuffer.data(), BATCH_SLOT_SIZE, URING_BUFFER_COUNT, error)) {
+            reportUringFallback(index, error);
+            return false;
+        }
+
+        // Multishot receives lay out each buffer as io_uring_recvmsg_out, then msg_namelen
+        // bytes of peer address, then the payload.
+        msghdr receiveTemplate;
+        memset(&receiveTemplate, 0, sizeof(receiveTemplate));
+        receiveTemplate.msg_namelen = sizeof(sockaddr_storage);
+
+        std::vector<UringSendSlot> sendSlots(std::max(options.batchSize * 2, MIN_URING_SEND_SLOTS));
+        std::vector<uint32_t> freeSendSlots;
+        // Received buffers waiting for a free send slot. Holding on to them starves the buffer
+        // ring, which makes the kernel stop receiving instead of us dropping answers.
+        std::vector<uint16_t> backlog;
+        backlog.reserve(URING_BUFFER_COUNT);
+        for (uint32_t i = 0; i < sendSlots.size(); i++) {
+            sendSlots[i].buffer.reserve(MAX_DATAGRAM);
+            freeSendSlots.push_back(i);
+        }
+
+        __kernel_timespec timeout;
+        timeout.tv_sec = 0;
+        timeout.tv_nsec = POLL_TIMEOUT_MS * 1000000LL;
+
+        // Armed alongside the standing timeout when a forwarded question is due a retry sooner.
+        __kernel_timespec forwardTimeout;
+        forwardTimeout.tv_sec = 0;
+        bool forwardTimerArmed = false;
+
+        auto armReceive = [&]() {
+            auto sqe = ring.getSqe();
+            if (sqe == nullptr) {
+                return false;
+            }
+
+            sqe->opcode = IORING_OP_RECVMSG;
+            sqe->fd = socketFd;
+            sqe->addr = (uint64_t)(uintptr_t)&receiveTemplate;
+            sqe->len = 1;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = URING_BUFFER_GROUP;
+            sqe->user_data = URING_RECEIVE_TAG;
+            return true;
+        };
+
+        // A standing timeout wakes the loop so it notices when running is cleared.
+        auto armTimeout = [&]() {
+            auto sqe = ring.getSqe();
+            if (sqe == nullptr) {
+                return false;
+            }
+
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->addr = (uint64_t)(uintptr_t)&timeout;
+            sqe->len = 1;
+            sqe->user_data = URING_TIMEOUT_TAG;
+            return true;
+        };
+
+        // TCP is served from its own epoll set, which the ring watches with a one-shot poll.
+        auto armTcpPoll = [&]() {
+            auto sqe = ring.getSqe();
+            if (sqe == nullptr) {
+                return false;
+            }
+
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = tcpServer.eventFd();
+            sqe->poll32_events = POLLIN;
+            sqe->user_data = URING_TCP_TAG;
+            return true;
+        };
+
+        // Likewise for the upstream sockets.
+        auto armForwardPoll = [&]() {
+            auto sqe = ring.getSqe();
+            if (sqe == nullptr) {
+                return false;
+            }
+
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = forwarder.eventFd();
+            sqe->poll32_events = POLLIN;
+            sqe->user_data = URING_FORWARD_TAG;
+            return true;
+        };
+
+        auto armForwardTimer = [&]() {
+            const auto due = forwarder.nextTimeout();
+            if (forwardTimerArmed || due >= std::chrono::milliseconds(POLL_TIMEOUT_MS)) {
+                return;
+            }
+
+            // Without a free entry the standing timeout still wakes the loop, only later.
+            auto sqe = ring.getSqe();
+            if (sqe == nullptr) {
+                return;
+            }
+
+            forwardTimeout.tv_nsec = std::max(due.count(), (decltype(due.count()))1) * 1000000LL;
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->addr = (uint64_t)(uintptr_t)&forwardTimeout;
+            sqe->len = 1;
+            sqe->user_data = URING_FORWARD_TIMER_TAG;
+            forwardTimerArmed = true;
+        };
+
+        auto handleDatagram = [&](uint16_t bufferId) {
+            const auto out = (const io_uring_recvmsg_out*)ring.bufferAddress(bufferId);
+            const auto name = (const uint8_t*)(out + 1);
+            const auto payload = name + receiveTemplate.msg_namelen + receiveTemplate.msg_controllen;
+
+            workerStats.received++;
+
+            if ((out->flags & MSG_TRUNC) != 0) {
+                workerStats.dropped++;
+                return;
+            }
+
+            const auto slotIndex = freeSendSlots.back();
+            auto& slot = sendSlots[slotIndex];
+
+            const auto nameLength = std::min((size_t)out->namelen, sizeof(slot.peer));
+            memcpy(&slot.peer, name, nameLength);
+
+            QuerySource source;
+            source.peer = &slot.peer;
+            source.peerLength = (socklen_t)nameLength;
+            const auto result = processQuery(payload, out->payloadlen, slot.buffer, source);
+            if (result != QueryResult::Answered) {
+                if (result == QueryResult::Dropped) {
+                    workerStats.dropped++;
+                }
+
+                return;
+            }
+
+            freeSendSlots.pop_back();
+            slot.vector.iov_base = slot.buffer.data();
+            slot.vector.iov_len = slot.buffer.size();
+            memset(&slot.header, 0, sizeof(slot.header));
+            slot.header.msg_name = &slot.peer;
+            slot.header.msg_namelen = (socklen_t)nameLength;
+            slot.header.msg_iov = &slot.vector;
+            slot.header.msg_iovlen = 1;
+
+            auto sqe = ring.getSqe();
+            if (sqe == nullptr) {
+                freeSendSlots.push_back(slotIndex);
+                workerStats.dropped++;
+                return;
+            }
+
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = socketFd;
+            sqe->addr = (uint64_t)(uintptr_t)&slot.header;
+            sqe->len = 1;
+            sqe->user_data = URING_SEND_TAG | slotIndex;
+        };
+
+        // What still has to be (re)armed. An arm that finds the submission ring full stays
+        // pending and is tried again on the next pass, once completions have made room.
+        bool needReceive = true;
+        bool needTimeout = true;
+        bool needTcpPoll = tcpServer.isOpen();
+        bool needForwardPoll = forwarder.isOpen();
+
+        auto armPending = [&]() {
+            needReceive = needReceive && !armReceive();
+            needTimeout = needTimeout && !armTimeout();
+            needTcpPoll = needTcpPoll && !armTcpPoll();
+            needForwardPoll = needForwardPoll && !armForwardPoll();
+        };
+
+        armPending();
+
+        bool receiveConfirmed = false;
+        bool sendsQueued = false;
+
+        while (running.load(std::memory_order_relaxed)) {
+            if (ring.submitAndWait(1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                std::cerr << "Worker " << index << " io_uring_enter: " << strerror(errno) << std::endl;
+                break;
+            }
+
+            workerStats.receiveCalls++;
+            if (sendsQueued) {
+                workerStats.sendCalls++;
+                sendsQueued = false;
+            }
+
+            bool serviceTcp = false;
+            bool serviceForwarder = false;
+            bool unsupported = false;
+
+            ring.forEachCompletion([&](const io_uring_cqe& completion) {
+                const auto tag = completion.user_data & URING_TAG_MASK;
+
+                if (tag == URING_RECEIVE_TAG) {
+                    if ((completion.flags & IORING_CQE_F_MORE) == 0) {
+                        needReceive = true;
+                    }
+
+                    if (completion.res < 0) {
+                        // Older kernels reject multishot recvmsg outright. ENOBUFS just means the
+                        // buffer ring ran dry and the receive needs re-arming.
+                        if (!receiveConfirmed && (completion.res == -EINVAL || completion.res == -EOPNOTSUPP)) {
+                            unsupported = true;
+                        }
+
+                        return;
+                    }
+
+                    receiveConfirmed = true;
+                    const auto bufferId = (uint16_t)(completion.flags >> IORING_CQE_BUFFER_SHIFT);
+                    backlog.push_back(bufferId);
+                } else if (tag == URING_SEND_TAG) {
+                    freeSendSlots.push_back((uint32_t)(completion.user_data & ~URING_TAG_MASK));
+                    if (completion.res >= 0) {
+                        workerStats.answered++;
+                    }
+                } else if (tag == URING_TIMEOUT_TAG) {
+                    needTimeout = true;
+                } else if (tag == URING_TCP_TAG) {
+                    serviceTcp = true;
+                } else if (tag == URING_FORWARD_TAG) {
+                    serviceForwarder = true;
+                } else if (tag == URING_FORWARD_TIMER_TAG) {
+                    forwardTimerArmed = false;
+                }
+            });
+
+            if (unsupported) {
+                reportUringFallback(index, "kernel lacks multishot recvmsg");
+                return false;
+            }
+
+            size_t handled = 0;
+            while (handled < backlog.size() && !freeSendSlots.empty()) {
+                handleDatagram(backlog[handled]);
+                ring.recycleBuffer(backlog[handled]);
+                handled++;
+            }
+
+            backlog.erase(backlog.begin(), backlog.begin() + handled);
+            ring.commitBuffers();
+            sendsQueued = freeSendSlots.size() < sendSlots.size();
+
+            if (serviceTcp) {
+                tcpServer.service();
+                needTcpPoll = true;
+            }
+
+            if (tcpServer.isOpen()) {
+                tcpServer.closeIdle();
+            }
+
+            if (forwarder.isOpen()) {
+                if (serviceForwarder) {
+                    forwarder.service();
+                    needForwardPoll = true;
+                }
+
+                forwarder.expire();
+            }
+
+            armPending();
+            if (forwarder.isOpen()) {
+                armForwardTimer();
+            }
+        }
+
+        return true;
+    }
+
+    void Worker::drainSingle() {
+        // Drain everything that is queued before going back to poll.
+        for (;;) {
+            sockaddr_storage peer;
+            socklen_t peerLength = sizeof(peer);
+            const auto received = recvfrom(
+                socketFd,
+                receiveBuffer.data(),
+                receiveBuffer.size(),
+                0,
+                (sockaddr*)&peer,
+                &peerLength
+            );
+
+            if (received < 0) {
+                break;
+            }
+
+            workerStats.received++;
+            workerStats.receiveCalls++;
+
+            QuerySource source;
+            source.peer = &peer;
+            source.peerLength = peerLength;
+            const auto result = processQuery(receiveBuffer.data(), (size_t)received, sendBuffer, source);
+            if (result != QueryResult::Answered) {
+                if (result == QueryResult::Dropped) {
+                    workerStats.dropped++;
+                }
+
+                continue;
+            }
+
+            workerStats.sendCalls++;
+            if (sendto(socketFd, sendBuffer.data(), sendBuffer.size(), 0, (const sockaddr*)&peer, peerLength) >= 0) {
+                workerStats.answered++;
+            } else {
+                workerStats.dropped++;
+            }
+        }
+    }
+
+    void Worker::prepareBatch() {
+        const auto batchSize = options.batchSize;
+
+        receiveBuffer.resize(batchSize * BATCH_SLOT_SIZE);
+        peers.resize(batchSize);
+        receiveVectors.resize(batchSize);
+        receiveMessages.resize(batchSize);
+        sendVectors.resize(batchSize);
+        sendMessages.resize(batchSize);
+        sendBuffers.resize(batchSize);
+
+        for (size_t i = 0; i < batchSize; i++) {
+            receiveVectors[i].iov_base = receiveBuffer.data() + i * BATCH_SLOT_SIZE;
+            receiveVectors[i].iov_len = BATCH_SLOT_SIZE;
+            sendBuffers[i].reserve(MAX_DATAGRAM);
+        }
+    }
+
+    void Worker::drainBatched() {
+        const auto batchSize = options.batchSize;
+
+        for (;;) {
+            // recvmmsg overwrites the lengths, so they are reset for every batch.
+            for (size_t i = 0; i < batchSize; i++) {
+                auto& header = receiveMessages[i].msg_hdr;
+                memset(&header, 0, sizeof(header));
+                header.msg_name = &peers[i];
+                header.msg_namelen = sizeof(sockaddr_storage);
+                header.msg_iov = &receiveVectors[i];
+                header.msg_iovlen = 1;
+            }
+
+            const auto received = recvmmsg(socketFd, receiveMessages.data(), (unsigned int)batchSize, MSG_DONTWAIT, nullptr);
+            if (received <= 0) {
+                break;
+            }
+
+            workerStats.received += (uint64_t)received;
+            workerStats.receiveCalls++;
+
+            // Run the whole batch through the pipeline, then flush every answer with one call.
+            unsigned int responseCount = 0;
+            for (int i = 0; i < received; i++) {
+                const auto& message = receiveMessages[i];
+
+                if ((message.msg_hdr.msg_flags & MSG_TRUNC) != 0) {
+                    workerStats.dropped++;
+                    continue;
+                }
+
+                QuerySource source;
+                source.peer = &peers[i];
+                source.peerLength = message.msg_hdr.msg_namelen;
+                const auto result = processQuery((const uint8_t*)receiveVectors[i].iov_base, message.msg_len, sendBuffers[i], source);
+                if (result != QueryResult::Answered) {
+                    if (result == QueryResult::Dropped) {
+                        workerStats.dropped++;
+                    }
+
+                    continue;
+                }
+
+                sendVectors[responseCount].iov_base = sendBuffers[i].data();
+                sendVectors[responseCount].iov_len = sendBuffers[i].size();
+
+                auto& header = sendMessages[responseCount].msg_hdr;
+                memset(&header, 0, sizeof(header));
+                header.msg_name = &peers[i];
+                header.msg_namelen = message.msg_hdr.msg_namelen;
+                header.msg_iov = &sendVectors[responseCount];
+                header.msg_iovlen = 1;
+
+                responseCount++;
+            }
+
+            unsigned int sent = 0;
+            while (sent < responseCount) {
+                workerStats.sendCalls++;
+                const auto result = sendmmsg(socketFd, sendMessages.data() + sent, responseCount - sent, 0);
+                if (result > 0) {
+                    sent += (unsigned int)result;
+                    workerStats.answered += (uint64_t)result;
+                    continue;
+                }
+
+                if (result < 0 && errno == EINTR) {
+                    continue;
+                }
+
+                // A full send buffer holds up every answer alike, so wait briefly for room
+                // and give up on the rest of the batch if none comes.
+                if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)) {
+                    pollfd writable;
+                    writable.fd = socketFd;
+                    writable.events = POLLOUT;
+                    if (poll(&writable, 1, SEND_WAIT_MS) > 0) {
+                        continue;
+                    }
+
+                    workerStats.dropped += responseCount - sent;
+                    break;
+                }
+
+                // Anything else is down to the first datagram's peer, so skip just that one.
+                workerStats.dropped++;
+                sent++;
+            }
+
+            if ((size_t)received < batchSize) {
+                break;
+            }
+        }
+    }
+
+    QueryResult Worker::processQuery(const uint8_t* request, size_t requestLength, std::vector<uint8_t>& outResponse, const QuerySource& source) {
+        PacketView query(request, requestLength);
+        std::string error;
+
+        if (requestLength < DNS_HEADER_SIZE || query.isResponse()) {
+            return QueryResult::Dropped;
+        }
+
+        QueryState state;
+        inspectQuery(query, source.transport, state);
+        if (state.cacheable && answerCache.find(query, cacheKey, state.now, state.maxResponseSize, outResponse)) {
+            workerStats.cacheHits++;
+            return QueryResult::Answered;
+        }
+
+        bool scriptAnswered = false;
+        if (beginResponse(query, state)) {
+            auto& response = *responsePacket;
+
+            if (state.badVersion) {
+                // BADVERS is carried in the OPT record, so the header's response code stays zero.
+                response.responseCode = ResponseCode::NoError;
+            } else if (!scriptLoaded) {
+                response.responseCode = ResponseCode::Refused;
+            } else if (!script->handleQuery(query, response, error)) {
+                failScript(error);
+            } else if (script->forwardToken() != 0) {
+                ParkedQuery parked;
+                parked.request.assign(request, request + requestLength);
+                parked.transport = source.transport;
+                if (source.peer != nullptr) {
+                    parked.peer = *source.peer;
+                    parked.peerLength = source.peerLength;
+                }
+
+                parked.connection = source.connection;
+                if (source.transport == Transport::Tcp) {
+                    tcpServer.defer(source.connection);
+                }
+
+                workerStats.forwarded++;
+                parkQuery(std::move(parked));
+                return QueryResult::Forwarded;
+            } else {
+                scriptAnswered = true;
+            }
+        }
+
+        return finishResponse(state, scriptAnswered, outResponse) ? QueryResult::Answered : QueryResult::Dropped;
+    }
+
+    void Worker::inspectQuery(const PacketView& query, Transport transport, QueryState& state) {
+        if (options.ednsPayloadSize > 0) {
+            state.ednsError = findEdns(query, queryEdns, state.hasEdns);
+            // A malformed OPT is answered with FORMERR and no OPT of our own.
+            state.hasEdns = state.hasEdns && state.ednsError == DnsError::None;
+        }
+
+        // Only EDNS version 0 exists. Anything newer gets BADVERS and no answer (RFC 6891
+        // section 6.1.3).
+        state.badVersion = state.hasEdns && queryEdns.version > 0;
+
+        // Over UDP, whatever the client advertises, held to at least the classic 512 bytes and at
+        // most what we advertise.
+        state.maxResponseSize = MAX_TCP_RESPONSE;
+        if (transport == Transport::Udp) {
+            state.maxResponseSize = MIN_UDP_PAYLOAD_SIZE;
+            if (state.hasEdns) {
+                state.maxResponseSize = std::max(MIN_UDP_PAYLOAD_SIZE, std::min(queryEdns.udpPayloadSize, options.ednsPayloadSize));
+            }
+        }
+
+        state.cacheable = state.ednsError == DnsError::None && !state.badVersion &&
+            answerCache.makeKey(query, state.hasEdns ? &queryEdns : nullptr, cacheKey);
+        state.now = state.cacheable ? AnswerCache::Clock::now() : AnswerCache::Clock::time_point();
+    }
+
+    bool Worker::beginResponse(PacketView& query, const QueryState& state) {
+        replyPacket.reset();
+        responsePacket.reset();
+        packetArena.release();
+        auto& response = responsePacket.emplace(&packetArena);
+
+        response.id = query.id();
+        response.isResponse = true;
+        response.opcode = query.opcode();
+        response.isAuthoritative = false;
+        response.isTruncated = false;
+        response.recursionDesired = query.recursionDesired();
+        response.recursionAvailable = false;
+        response.zBit = false;
+        response.isAuthenticData = false;
+        response.checkingDisabled = query.checkingDisabled();
+        response.responseCode = ResponseCode::NoError;
+
+        if (query.index() != DnsError::None || state.ednsError != DnsError::None) {
+            response.responseCode = ResponseCode::FormatError;
+            return false;
+        }
+
+        for (const auto& questionView : query.questions()) {
+            Question question;
+            // index() doesn't follow compression pointers, so a bad one only shows up here.
+            if (!query.readDomainName(questionView.name, question.label.domainName)) {
+                response.questions.clear();
+                response.responseCode = ResponseCode::FormatError;
+                return false;
+            }
+
+            question.qtype = questionView.qtype;
+            question.qclass = questionView.qclass;
+            response.questions.push_back(std::move(question));
+        }
+
+        return true;
+    }
+
+    void Worker::failScript(const std::string& error) {
+        if (workerStats.scriptErrors == 0) {
+            std::cerr << "Worker " << index << " script error: " << error << std::endl;
+        }
+
+        workerStats.scriptErrors++;
+        if (script->timedOut()) {
+            workerStats.scriptTimeouts++;
+        }
+
+        auto& response = *responsePacket;
+        response.responseCode = ResponseCode::ServerFailure;
+        response.answers.clear();
+        response.authorities.clear();
+        response.additionalRecords.clear();
+    }
+
+    bool Worker::finishResponse(const QueryState& state, bool scriptAnswered, std::vector<uint8_t>& outResponse) {
+        auto& response = *responsePacket;
+
+        // OPT describes this server's EDNS support, so the script doesn't get to add one.
+        auto& additional = response.additionalRecords;
+        additional.erase(std::remove_if(additional.begin(), additional.end(),
+            [](const Resource& resource) { return resource.rtype == Type::OPT; }), additional.end());
+        if (state.hasEdns) {
+            addOpt(response, options.ednsPayloadSize, queryEdns.dnssecOk, state.badVersion);
+        }
+
+        // Anything bigger than the client can take is cut back with TC set, so a UDP client
+        // knows to retry over TCP.
+        outResponse.resize(state.maxResponseSize);
+        size_t responseLength = 0;
+        const auto serializeError = serializeDnsPacket(response, outResponse.data(), outResponse.size(), responseLength);
+        if (serializeError != DnsError::None) {
+            // The questions came off the wire, so it is the script's records that can't be encoded.
+            if (workerStats.scriptErrors == 0) {
+                std::cerr << "Worker " << index << " script error: " << describeError(serializeError) << std::endl;
+            }
+
+            workerStats.scriptErrors++;
+            scriptAnswered = false;
+            response.responseCode = ResponseCode::ServerFailure;
+            response.answers.clear();
+            response.authorities.clear();
+            response.additionalRecords.clear();
+            if (state.hasEdns) {
+                addOpt(response, options.ednsPayloadSize, queryEdns.dnssecOk, state.badVersion);
+            }
+
+            // A question whose labels contain dots can't be echoed either; such a query gets nothing.
+            if (serializeDnsPacket(response, outResponse.data(), outResponse.size(), responseLength) != DnsError::None) {
+                return false;
+            }
+        }
+
+        outResponse.resize(responseLength);
+
+        if (state.cacheable && scriptAnswered) {
+            answerCache.insert(cacheKey, response, outResponse, state.now);
+        }
+
+        return true;
+    }
+
+    void Worker::parkQuery(ParkedQuery&& query) {
+        const auto token = script->forwardToken();
+        parkedQueries.emplace(token, std::move(query));
+        forwarder.forward(script->forwardedQuestion(), token);
+    }
+
+    void Worker::completeForward(uint64_t token, const uint8_t* reply, size_t length) {
+        const auto found = parkedQueries.find(token);
+        if (found == parkedQueries.end()) {
+            return;
+        }
+
+        auto parked = std::move(found->second);
+        parkedQueries.erase(found);
+
+        // The query was checked when it arrived, so this only rebuilds what was learnt then.
+        PacketView query(parked.request.data(), parked.request.size());
+        QueryState state;
+        std::string error;
+        inspectQuery(query, parked.transport, state);
+        beginResponse(query, state);
+
+        // An answer that doesn't parse is no more use to the script than none at all.
+        const Packet* upstreamReply = nullptr;
+        if (reply != nullptr) {
+            replyBuffer.assign(reply, reply + length);
+            auto& parsed = replyPacket.emplace(&packetArena);
+            if (parseDnsPacket(replyBuffer, parsed) == DnsError::None) {
+                upstreamReply = &parsed;
+            }
+        }
+
+        bool scriptAnswered = false;
+        if (!script->resumeForward(token, upstreamReply, *responsePacket, error)) {
+            failScript(error);
+        } else if (script->forwardToken() != 0) {
+            parkQuery(std::move(parked));
+            return;
+        } else {
+            scriptAnswered = true;
+        }
+
+        sendForwardedResponse(parked, finishResponse(state, scriptAnswered, forwardedResponse));
+    }
+
+    void Worker::sendForwardedResponse(const ParkedQuery& query, bool answered) {
+        if (query.transport == Transport::Tcp) {
+            if (!answered) {
+                tcpServer.abandon(query.connection);
+                workerStats.dropped++;
+            } else if (tcpServer.deliver(query.connection, forwardedResponse.data(), forwardedResponse.size())) {
+                workerStats.answered++;
+            }
+
+            return;
+        }
+
+        if (!answered) {
+            workerStats.dropped++;
+            return;
+        }
+
+        workerStats.sendCalls++;
+        if (sendto(socketFd, forwardedResponse.data(), forwardedResponse.size(), 0, (const sockaddr*)&query.peer, query.peerLength) >= 0) {
+            workerStats.answered++;
+        }
+    }
+}
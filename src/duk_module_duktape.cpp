@@ -28,16 +28,89 @@
 #define DUK__ASSERT_TOP(ctx,val) do { (void) ctx; (void) (val); } while (0)
 #endif
 
+/* Stash key of the per-heap resolution cache, see duk__resolve_module_id(). */
+#define DUK__RESOLVE_CACHE_KEY  "\xff" "module:resolveCache"
+/* Entry count, kept in the cache object under a key no module ID can take. */
+#define DUK__RESOLVE_COUNT_KEY  "\xff" "count"
+#define DUK__RESOLVE_CACHE_LIMIT  256
+
 static void duk__resolve_module_id(duk_context *ctx, const char *req_id, const char *mod_id) {
-	duk_uint8_t buf[DUK_COMMONJS_MODULE_ID_LIMIT];
+	duk_uint8_t stack_buf[DUK_COMMONJS_MODULE_ID_LIMIT];
+	duk_uint8_t *buf;
+	duk_size_t buf_size;
 	duk_uint8_t *p;
 	duk_uint8_t *q;
 	duk_uint8_t *q_last;  /* last component */
 	duk_int_t int_rc;
+	duk_idx_t top;
+	duk_idx_t resolved_idx;
+	duk_bool_t is_relative;
+	const char *resolved;
+	const char *last_comp;
+	duk_size_t resolved_len;
+	duk_uint_t cache_count;
 
 	DUK__ASSERT(req_id != NULL);
 	/* mod_id may be NULL */
 
+	/*
+	 *  Resolution cache.
+	 *
+	 *  require() calls inside handler functions run for every query, so
+	 *  resolved IDs are cached per heap in the global stash, keyed by the
+	 *  requested ID and, for relative IDs, the current module ID (joined
+	 *  by a NUL which cannot appear in either).  A hit still looks up the
+	 *  cache in the stash, builds the key (a concat for relative IDs) and
+	 *  looks that up, but skips the canonicalization pass.
+	 *
+	 *  IDs built at run time, like require('./zones/' + name), would grow
+	 *  the cache without bound, so it is emptied whenever it reaches
+	 *  DUK__RESOLVE_CACHE_LIMIT entries.
+	 *
+	 *  [ ... stash cache key ]
+	 */
+
+	top = duk_get_top(ctx);
+	is_relative = (mod_id != NULL && req_id[0] == '.');
+
+	duk_push_global_stash(ctx);
+	if (!duk_get_prop_string(ctx, top, DUK__RESOLVE_CACHE_KEY)) {
+		duk_pop(ctx);
+		duk_push_bare_object(ctx);
+		duk_dup_top(ctx);
+		duk_put_prop_string(ctx, top, DUK__RESOLVE_CACHE_KEY);
+	}
+
+	if (is_relative) {
+		duk_push_string(ctx, mod_id);
+		duk_push_lstring(ctx, "\0", 1);
+		duk_push_string(ctx, req_id);
+		duk_concat(ctx, 3);
+	} else {
+		duk_push_string(ctx, req_id);
+	}
+
+	duk_dup(ctx, top + 2);
+	if (duk_get_prop(ctx, top + 1)) {
+		resolved_idx = top + 3;
+		goto push_outputs;
+	}
+	duk_pop(ctx);
+
+	/*
+	 *  Cache miss.  Short IDs are resolved in a stack buffer; longer ones
+	 *  get a buffer on the value stack instead of failing, so that
+	 *  DUK_COMMONJS_MODULE_ID_LIMIT only sizes the fast path.
+	 */
+
+	buf_size = (mod_id != NULL ? strlen(mod_id) : 0) + strlen(req_id) + 5;  /* "/../" and NUL */
+	if (buf_size <= sizeof(stack_buf)) {
+		buf = stack_buf;
+		buf_size = sizeof(stack_buf);
+	} else {
+		buf = (duk_uint8_t *) duk_push_fixed_buffer(ctx, buf_size);
+	}
+
 	/*
 	 *  A few notes on the algorithm:
 	 *
@@ -67,18 +140,19 @@ static void duk__resolve_module_id(duk_context *ctx, const char *req_id, const c
 	 *  'foo/bar/.././quux'.
 	 */
 
-	if (mod_id != NULL && req_id[0] == '.') {
-		int_rc = snprintf((char *) buf, sizeof(buf), "%s/../%s", mod_id, req_id);
+	if (is_relative) {
+		int_rc = snprintf((char *) buf, buf_size, "%s/../%s", mod_id, req_id);
 	} else {
-		int_rc = snprintf((char *) buf, sizeof(buf), "%s", req_id);
+		int_rc = snprintf((char *) buf, buf_size, "%s", req_id);
 	}
-	if (int_rc >= (duk_int_t) sizeof(buf) || int_rc < 0) {
+	if (int_rc >= (duk_int_t) buf_size || int_rc < 0) {
 		/* Potentially truncated, NUL not guaranteed in any case.
-		 * The (int_rc < 0) case should not occur in practice.
+		 * Neither case should occur in practice as buf_size covers
+		 * the whole input.
 		 */
 		goto resolve_error;
 	}
-	DUK__ASSERT(strlen((const char *) buf) < sizeof(buf));  /* at most sizeof(buf) - 1 */
+	DUK__ASSERT(strlen((const char *) buf) < buf_size);  /* at most buf_size - 1 */
 
 	/*
 	 *  Resolution loop.  At the top of the loop we're expecting a valid
@@ -169,20 +243,61 @@ static void duk__resolve_module_id(duk_context *ctx, const char *req_id, const c
 		}
 	}
  loop_done:
-	/* Output #1: resolved absolute name. */
+	/* Resolved absolute name, also stored in the cache. */
 	DUK__ASSERT(q >= buf);
-	duk_push_lstring(ctx, (const char *) buf, (size_t) (q - buf));
-
-	/* Output #2: last component name. */
 	DUK__ASSERT(q >= q_last);
 	DUK__ASSERT(q_last >= buf);
-	duk_push_lstring(ctx, (const char *) q_last, (size_t) (q - q_last));
+	duk_push_lstring(ctx, (const char *) buf, (size_t) (q - buf));
+	resolved_idx = duk_get_top_index(ctx);
+
+	duk_get_prop_string(ctx, top + 1, DUK__RESOLVE_COUNT_KEY);
+	cache_count = duk_get_uint(ctx, -1);
+	duk_pop(ctx);
+	if (cache_count >= DUK__RESOLVE_CACHE_LIMIT) {
+		duk_push_bare_object(ctx);
+		duk_dup_top(ctx);
+		duk_put_prop_string(ctx, top, DUK__RESOLVE_CACHE_KEY);
+		duk_replace(ctx, top + 1);
+		cache_count = 0;
+	}
+
+	duk_dup(ctx, top + 2);
+	duk_dup(ctx, resolved_idx);
+	duk_put_prop(ctx, top + 1);  /* cache[key] = resolved */
+	duk_push_uint(ctx, cache_count + 1);
+	duk_put_prop_string(ctx, top + 1, DUK__RESOLVE_COUNT_KEY);
+
+ push_outputs:
+	/* The last component is everything after the final slash of the
+	 * resolved name, so a cache hit can derive it without resolving.
+	 */
+	resolved = duk_get_lstring(ctx, resolved_idx, &resolved_len);
+	last_comp = strrchr(resolved, '/');
+	last_comp = (last_comp != NULL ? last_comp + 1 : resolved);
+
+	/* Output #1: resolved absolute name.
+	 * Output #2: last component name.
+	 */
+	duk_dup(ctx, resolved_idx);
+	duk_push_lstring(ctx, last_comp, (duk_size_t) (resolved + resolved_len - last_comp));
+	duk_replace(ctx, top + 1);
+	duk_replace(ctx, top);
+	duk_set_top(ctx, top + 2);
 	return;
 
  resolve_error:
 	(void) duk_type_error(ctx, "cannot resolve module id: %s", (const char *) req_id);
 }
 
+/* Loads module wrapper bytecode returned by modSearch().  Run through
+ * duk_safe_call() because duk_load_function() throws on invalid input.
+ */
+static duk_ret_t duk__load_bytecode(duk_context *ctx, void *udata) {
+	(void) udata;
+	duk_load_function(ctx);
+	return 1;
+}
+
 /* Stack indices for better readability. */
 #define DUK__IDX_REQUESTED_ID   0   /* module id requested */
 #define DUK__IDX_REQUIRE        1   /* current require() function */
@@ -311,7 +426,8 @@ static duk_ret_t duk__require(duk_context *ctx) {
 	 *
 	 *  The module search function can operate on the exports table directly
 	 *  (e.g. DLL code can register values to it).  It can also return a
-	 *  string which is interpreted as module source code (if a non-string
+	 *  string which is interpreted as module source code, or a buffer
+	 *  holding bytecode of the compiled module wrapper function (if neither
 	 *  is returned the module is assumed to be a pure C one).  If a module
 	 *  cannot be found, an error must be thrown by the user callback.
 	 *
@@ -336,6 +452,21 @@ static duk_ret_t duk__require(duk_context *ctx) {
 		goto delete_rethrow;
 	}
 
+	/* If user callback returned a buffer, it holds the bytecode of an
+	 * already compiled module wrapper function (duk_dump_function() output
+	 * of 'function (require, exports, module) { ... }'), so there is
+	 * nothing to compile or evaluate: load it and continue as if the
+	 * wrapper had just been evaluated.
+	 */
+	if (duk_is_buffer_data(ctx, -1)) {
+		duk_remove(ctx, -2);  /* wrapper prefix string is not needed */
+		pcall_rc = duk_safe_call(ctx, duk__load_bytecode, NULL, 1 /*nargs*/, 1 /*nrets*/);
+		if (pcall_rc != DUK_EXEC_SUCCESS) {
+			goto delete_rethrow;
+		}
+		goto have_module_function;
+	}
+
 	/* If user callback did not return source code, module loading
 	 * is finished (user callback initialized exports table directly).
 	 */
@@ -372,6 +503,7 @@ static duk_ret_t duk__require(duk_context *ctx) {
 		goto delete_rethrow;
 	}
 
+ have_module_function:
 	/* Module has now evaluated to a wrapped module function.  Force its
 	 * .name to match module.name (defaults to last component of resolved
 	 * ID) so that it is shown in stack traces too.  Note that we must not
@@ -458,6 +590,9 @@ void duk_module_duktape_init(duk_context *ctx) {
 
 #undef DUK__ASSERT
 #undef DUK__ASSERT_TOP
+#undef DUK__RESOLVE_CACHE_KEY
+#undef DUK__RESOLVE_COUNT_KEY
+#undef DUK__RESOLVE_CACHE_LIMIT
 #undef DUK__IDX_REQUESTED_ID
 #undef DUK__IDX_REQUIRE
 #undef DUK__IDX_REQUIRE_ID
@@ -1,11 +1,266 @@
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 
-#include "duktape.h"
+#include <getopt.h>
 
-int main() {
-    std::cout << "Hello!" << std::endl;
+#include "Server.h"
 
-    duk_context* ctx = duk_create_heap_default();
+namespace {
+    DNice::Server* activeServer = nullptr;
+
+    void onStopSignal(int) {
+        if (activeServer != nullptr) {
+            activeServer->stop();
+        }
+    }
+
+    // Parses a whole decimal argument within [min, max]. strtoull alone accepts trailing junk
+    // and negative numbers, and wraps on overflow.
+    bool parseNumber(const char* text, unsigned long long min, unsigned long long max, unsigned long long& out) {
+        if (*text < '0' || *text > '9') {
+            return false;
+        }
+
+        char* end = nullptr;
+        errno = 0;
+        out = strtoull(text, &end, 10);
+        return errno == 0 && *end == '\0' && out >= min && out <= max;
+    }
+
+    void printUsage(const char* program) {
+        std::cerr
+            << "Usage: " << program << " [options]" << std::endl
+            << "  -a, --address ADDR   address to listen on (default 0.0.0.0)" << std::endl
+            << "  -p, --port PORT      port to listen on (default 53)" << std::endl
+            << "  -t, --threads N      worker threads, 0 for one per CPU (default 0)" << std::endl
+            << "      --pin-cpus       pin each worker thread to its own CPU" << std::endl
+            << "  -b, --batch-size N   datagrams per recvmmsg/sendmmsg, 1 to disable (default 32)" << std::endl
+            << "      --io-engine E    portable or uring (default portable)" << std::endl
+            << "  -s, --script FILE    policy script defining handleQuery(query)" << std::endl
+            << "      --heap-budget MB      memory limit for each worker's script heap (default unlimited)" << std::endl
+            << "      --script-timeout US   time limit for each handleQuery call, 0 for none (default 50000)" << std::endl
+            << "      --cache-size N        answers cached per worker, 0 to disable (default 10000)" << std::endl
+            << "      --module-path DIR     directory require() loads modules from (default: the script's)" << std::endl
+            << "      --bytecode-cache DIR  keep compiled scripts in DIR across restarts" << std::endl
+            << "      --tcp-connections N   TCP connections each worker holds open, 0 to disable TCP (default 256)" << std::endl
+            << "      --tcp-idle-timeout MS close TCP connections idle this long (default 10000)" << std::endl
+            << "      --edns-payload-size N largest UDP response to EDNS clients, 0 to disable EDNS (default 1232)" << std::endl
+            << "      --upstream ADDR       server forward() asks, as ADDR, ADDR:PORT or [ADDR]:PORT; repeatable" << std::endl
+            << "      --forward-timeout MS  give up on a forwarded question after this long (default 2000)" << std::endl
+            << "      --forward-retries N   times an unanswered forwarded question is resent (default 2)" << std::endl
+            << "  -h, --help           show this message" << std::endl;
+    }
+
+    bool parseOptions(int argc, char** argv, DNice::ServerOptions& options) {
+        enum { PIN_CPUS = 256, IO_ENGINE, BYTECODE_CACHE, MODULE_PATH, HEAP_BUDGET, SCRIPT_TIMEOUT, CACHE_SIZE, TCP_CONNECTIONS, TCP_IDLE_TIMEOUT, EDNS_PAYLOAD_SIZE,
+            UPSTREAM, FORWARD_TIMEOUT, FORWARD_RETRIES };
+
+        const option longOptions[] = {
+            { "address", required_argument, nullptr, 'a' },
+            { "port", required_argument, nullptr, 'p' },
+            { "threads", required_argument, nullptr, 't' },
+            { "pin-cpus", no_argument, nullptr, PIN_CPUS },
+            { "batch-size", required_argument, nullptr, 'b' },
+            { "io-engine", required_argument, nullptr, IO_ENGINE },
+            { "script", required_argument, nullptr, 's' },
+            { "bytecode-cache", required_argument, nullptr, BYTECODE_CACHE },
+            { "module-path", required_argument, nullptr, MODULE_PATH },
+            { "heap-budget", required_argument, nullptr, HEAP_BUDGET },
+            { "script-timeout", required_argument, nullptr, SCRIPT_TIMEOUT },
+            { "cache-size", required_argument, nullptr, CACHE_SIZE },
+            { "tcp-connections", required_argument, nullptr, TCP_CONNECTIONS },
+            { "tcp-idle-timeout", required_argument, nullptr, TCP_IDLE_TIMEOUT },
+            { "edns-payload-size", required_argument, nullptr, EDNS_PAYLOAD_SIZE },
+            { "upstream", required_argument, nullptr, UPSTREAM },
+            { "forward-timeout", required_argument, nullptr, FORWARD_TIMEOUT },
+            { "forward-retries", required_argument, nullptr, FORWARD_RETRIES },
+            { "help", no_argument, nullptr, 'h' },
+            { nullptr, 0, nullptr, 0 },
+        };
+
+        // recvmmsg and sendmmsg take at most UIO_MAXIOV messages per call.
+        const unsigned long long maxBatchSize = 1024;
+
+        unsigned long long value = 0;
+        int opt;
+        while ((opt = getopt_long(argc, argv, "a:p:t:b:s:h", longOptions, nullptr)) != -1) {
+            switch (opt) {
+                case 'a':
+                    options.address = optarg;
+                    break;
+                case 'p':
+                    if (!parseNumber(optarg, 1, UINT16_MAX, value)) {
+                        return false;
+                    }
+
+                    options.port = (uint16_t)value;
+                    break;
+                case 't':
+                    if (!parseNumber(optarg, 0, UINT_MAX, value)) {
+                        return false;
+                    }
+
+                    options.threads = (unsigned int)value;
+                    break;
+                case 'b':
+                    if (!parseNumber(optarg, 1, maxBatchSize, value)) {
+                        return false;
+                    }
+
+                    options.batchSize = (size_t)value;
+                    break;
+                case PIN_CPUS:
+                    options.pinThreads = true;
+                    break;
+                case IO_ENGINE:
+                    if (strcmp(optarg, "uring") == 0) {
+                        options.ioEngine = DNice::IoEngine::IoUring;
+                    } else if (strcmp(optarg, "portable") == 0) {
+                        options.ioEngine = DNice::IoEngine::Portable;
+                    } else {
+                        return false;
+                    }
+                    break;
+                case 's':
+                    options.scriptPath = optarg;
+                    break;
+                case HEAP_BUDGET:
+                    if (!parseNumber(optarg, 0, SIZE_MAX / (1024 * 1024), value)) {
+                        return false;
+                    }
+
+                    options.heapBudget = (size_t)value * 1024 * 1024;
+                    break;
+                case SCRIPT_TIMEOUT:
+                    if (!parseNumber(optarg, 0, UINT32_MAX, value)) {
+                        return false;
+                    }
+
+                    options.scriptTimeout = std::chrono::microseconds(value);
+                    break;
+                case CACHE_SIZE:
+                    if (!parseNumber(optarg, 0, UINT32_MAX, value)) {
+                        return false;
+                    }
+
+                    options.cacheSize = (size_t)value;
+                    break;
+                case TCP_CONNECTIONS:
+                    if (!parseNumber(optarg, 0, UINT32_MAX, value)) {
+                        return false;
+                    }
+
+                    options.tcpConnections = (size_t)value;
+                    break;
+                case TCP_IDLE_TIMEOUT:
+                    if (!parseNumber(optarg, 0, UINT32_MAX, value)) {
+                        return false;
+                    }
+
+                    options.tcpIdleTimeout = std::chrono::milliseconds(value);
+                    break;
+                case EDNS_PAYLOAD_SIZE:
+                    // RFC 6891 treats anything below 512 as 512, and UDP can't carry more than 65535.
+                    if (!parseNumber(optarg, 0, UINT16_MAX, value) || (value != 0 && value < DNice::MIN_UDP_PAYLOAD_SIZE)) {
+                        return false;
+                    }
+
+                    options.ednsPayloadSize = (uint16_t)value;
+                    break;
+                case UPSTREAM:
+                    options.upstreams.push_back(optarg);
+                    break;
+                case FORWARD_TIMEOUT:
+                    if (!parseNumber(optarg, 1, UINT32_MAX, value)) {
+                        return false;
+                    }
+
+                    options.forwardTimeout = std::chrono::milliseconds(value);
+                    break;
+                case FORWARD_RETRIES:
+                    if (!parseNumber(optarg, 0, UINT_MAX, value)) {
+                        return false;
+                    }
+
+                    options.forwardRetries = (unsigned int)value;
+                    break;
+                case MODULE_PATH:
+                    options.modulePath = optarg;
+                    break;
+                case BYTECODE_CACHE:
+                    options.bytecodeCacheDirectory = optarg;
+                    break;
+                default:
+                    return false;
+            }
+        }
+
+        return true;
+    }
+}
+
+int main(int argc, char** argv) {
+    DNice::ServerOptions options;
+    if (!parseOptions(argc, argv, options)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    DNice::Server server(options);
+
+    std::string error;
+    if (!server.start(error)) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+
+    activeServer = &server;
+    signal(SIGINT, onStopSignal);
+    signal(SIGTERM, onStopSignal);
+
+    server.run();
+
+    const auto stats = server.totalStats();
+    std::cout
+        << "received " << stats.received
+        << ", answered " << stats.answered
+        << ", dropped " << stats.dropped
+        << ", script errors " << stats.scriptErrors
+        << " (" << stats.scriptTimeouts << " timed out)"
+        << ", cache hits " << stats.cacheHits << std::endl;
+
+    const auto datagramsReceived = stats.received - stats.tcp.queries;
+    const auto datagramsAnswered = stats.answered - stats.tcp.answered;
+    std::cout
+        << "batch size " << options.batchSize
+        << ", datagrams per receive call " << (stats.receiveCalls > 0 ? (double)datagramsReceived / stats.receiveCalls : 0.0)
+        << ", per send call " << (stats.sendCalls > 0 ? (double)datagramsAnswered / stats.sendCalls : 0.0) << std::endl;
+
+    std::cout
+        << "script heaps: " << stats.heap.allocations << " allocations"
+        << ", " << stats.heap.reallocations << " reallocations"
+        << ", peak " << stats.heap.peakBytesInUse << " bytes"
+        << ", " << stats.heap.slabBytes << " slab bytes"
+        << ", " << stats.heap.largeBytes << " large bytes"
+        << ", " << stats.heap.failures << " over budget" << std::endl;
+
+    std::cout
+        << "tcp: " << stats.tcp.accepted << " connections"
+        << ", " << stats.tcp.rejected << " rejected at the limit"
+        << ", " << stats.tcp.idleClosed << " closed idle"
+        << ", " << stats.tcp.queries << " queries" << std::endl;
+
+    std::cout
+        << "forward: " << stats.forwarded << " queries forwarded"
+        << ", " << stats.forward.queries << " questions sent upstream"
+        << ", " << stats.forward.answered << " answered"
+        << ", " << stats.forward.retries << " retries"
+        << ", " << stats.forward.failed << " failed"
+        << ", " << stats.forward.unmatched << " unmatched replies" << std::endl;
 
     return 0;
 }
@@ -0,0 +1,503 @@
+// Crafted messages for every way the wire format code can reject its input, and round trips
+// for the record types whose data holds names.
+
+#include "DNS.h"
+#include "Edns.h"
+#include "PacketView.h"
+#include "Rdata.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace DNice;
+
+namespace {
+    int failures = 0;
+
+#define CHECK(condition) check((condition), #condition, __FILE__, __LINE__)
+
+    void check(bool condition, const char* expression, const char* file, int line) {
+        if (!condition) {
+            fprintf(stderr, "%s:%d: check failed: %s\n", file, line, expression);
+            failures++;
+        }
+    }
+
+    std::vector<uint8_t> header(uint16_t questions, uint16_t answers = 0, uint16_t authorities = 0, uint16_t additional = 0) {
+        std::vector<uint8_t> bytes;
+        pushValue(bytes, (uint16_t)0x1234);
+        pushValue(bytes, (uint16_t)0x8180);
+        pushValue(bytes, questions);
+        pushValue(bytes, answers);
+        pushValue(bytes, authorities);
+        pushValue(bytes, additional);
+        return bytes;
+    }
+
+    // Appends dotted as uncompressed labels, without the terminating root label.
+    void pushLabels(std::vector<uint8_t>& bytes, const std::string& dotted) {
+        size_t start = 0;
+        while (start < dotted.size()) {
+            auto end = dotted.find('.', start);
+            if (end == std::string::npos) {
+                end = dotted.size();
+            }
+
+            bytes.push_back((uint8_t)(end - start));
+            bytes.insert(bytes.end(), dotted.begin() + start, dotted.begin() + end);
+            start = end + 1;
+        }
+    }
+
+    void pushName(std::vector<uint8_t>& bytes, const std::string& dotted) {
+        pushLabels(bytes, dotted);
+        bytes.push_back(0);
+    }
+
+    void pushPointer(std::vector<uint8_t>& bytes, uint16_t address) {
+        pushValue(bytes, (uint16_t)(address | 0xc000));
+    }
+
+    void pushQuestionFields(std::vector<uint8_t>& bytes) {
+        pushValue(bytes, (uint16_t)Type::A);
+        pushValue(bytes, (uint16_t)Class::IN);
+    }
+
+    // Type, class, TTL and a data length, for a record whose owner has just been written.
+    void pushResourceFields(std::vector<uint8_t>& bytes, Type type, uint16_t length) {
+        pushValue(bytes, (uint16_t)type);
+        pushValue(bytes, (uint16_t)Class::IN);
+        pushValue(bytes, (uint32_t)300);
+        pushValue(bytes, length);
+    }
+
+    DnsError parse(const std::vector<uint8_t>& bytes) {
+        Packet packet;
+        return parseDnsPacket(bytes, packet);
+    }
+
+    bool viewIndexes(const std::vector<uint8_t>& bytes) {
+        PacketView view(bytes.data(), bytes.size());
+        return view.index() == DnsError::None;
+    }
+
+    DomainName name(const char* dotted) {
+        DomainName result;
+        result.assign(dotted);
+        return result;
+    }
+
+    void testTruncation() {
+        auto bytes = header(0);
+        bytes.pop_back();
+        CHECK(parse(bytes) == DnsError::Truncated);
+        CHECK(!viewIndexes(bytes));
+
+        // A label running past the end.
+        bytes = header(1);
+        bytes.insert(bytes.end(), { 3, 'w', 'w' });
+        CHECK(parse(bytes) == DnsError::Truncated);
+        CHECK(!viewIndexes(bytes));
+
+        // A name with no terminator.
+        bytes = header(1);
+        pushLabels(bytes, "www.example");
+        CHECK(parse(bytes) == DnsError::Truncated);
+
+        // Half a pointer.
+        bytes = header(1);
+        bytes.push_back(0xc0);
+        CHECK(parse(bytes) == DnsError::Truncated);
+
+        // A question cut off in its type.
+        bytes = header(1);
+        pushName(bytes, "example.com");
+        bytes.push_back(0);
+        CHECK(parse(bytes) == DnsError::Truncated);
+        CHECK(!viewIndexes(bytes));
+
+        // More questions than the message holds.
+        bytes = header(2);
+        pushName(bytes, "example.com");
+        pushQuestionFields(bytes);
+        CHECK(parse(bytes) == DnsError::Truncated);
+
+        // Record data longer than what is left.
+        bytes = header(1, 1);
+        pushName(bytes, "example.com");
+        pushQuestionFields(bytes);
+        pushPointer(bytes, DNS_HEADER_SIZE);
+        pushResourceFields(bytes, Type::A, 10);
+        bytes.insert(bytes.end(), { 192, 0, 2, 1 });
+        CHECK(parse(bytes) == DnsError::Truncated);
+        CHECK(!viewIndexes(bytes));
+    }
+
+    void testReservedLabelTypes() {
+        for (const uint8_t type : { 0x40, 0x80 }) {
+            auto bytes = header(1);
+            bytes.insert(bytes.end(), { (uint8_t)(type | 1), 'a', 0 });
+            pushQuestionFields(bytes);
+            CHECK(parse(bytes) == DnsError::BadLabelType);
+            CHECK(!viewIndexes(bytes));
+        }
+    }
+
+    void testBadPointers() {
+        // To after the name itself.
+        auto bytes = header(1);
+        pushPointer(bytes, DNS_HEADER_SIZE + 6);
+        pushQuestionFields(bytes);
+        CHECK(parse(bytes) == DnsError::BadPointer);
+
+        // A name ending in a pointer back to its own start, which would repeat forever.
+        bytes = header(1);
+        bytes.insert(bytes.end(), { 1, 'a' });
+        pushPointer(bytes, DNS_HEADER_SIZE);
+        pushQuestionFields(bytes);
+        CHECK(parse(bytes) == DnsError::BadPointer);
+
+        PacketView view(bytes.data(), bytes.size());
+        CHECK(view.index() == DnsError::None);
+        DomainName decoded;
+        char dotted[DomainName::MAX_WIRE_LENGTH];
+        CHECK(!view.readDomainName(view.questions().begin()->name, decoded));
+        CHECK(view.decodeName(view.questions().begin()->name, dotted, sizeof(dotted)) < 0);
+
+        // A whole owner name pointing into the header, where 0x81 is a reserved label type.
+        bytes = header(1, 1);
+        pushName(bytes, "example.com");
+        pushQuestionFields(bytes);
+        pushPointer(bytes, 2);
+        pushResourceFields(bytes, Type::A, 4);
+        bytes.insert(bytes.end(), { 192, 0, 2, 1 });
+
+        CHECK(parse(bytes) == DnsError::BadLabelType);
+    }
+
+    // count questions, each naming one more label in front of a pointer to the one before, so
+    // the last takes count - 1 hops to decode.
+    std::vector<uint8_t> pointerChain(int count) {
+        auto bytes = header((uint16_t)count);
+        size_t previous = bytes.size();
+        pushName(bytes, "a");
+        pushQuestionFields(bytes);
+        for (int i = 1; i < count; i++) {
+            const auto start = bytes.size();
+            bytes.insert(bytes.end(), { 1, 'a' });
+            pushPointer(bytes, (uint16_t)previous);
+            pushQuestionFields(bytes);
+            previous = start;
+        }
+
+        return bytes;
+    }
+
+    void testPointerHops() {
+        // Both chains run through more distinct pointer targets than NameMemo holds.
+        CHECK(parse(pointerChain(MAX_POINTER_HOPS + 2)) == DnsError::TooManyPointers);
+
+        Packet packet;
+        CHECK(parseDnsPacket(pointerChain(MAX_POINTER_HOPS + 1), packet) == DnsError::None);
+        CHECK(packet.questions.size() == (size_t)MAX_POINTER_HOPS + 1);
+        CHECK(packet.questions.back().label.domainName.labelCount() == (size_t)MAX_POINTER_HOPS + 1);
+    }
+
+    void testNameLimits() {
+        const std::string label63(63, 'x');
+
+        auto bytes = header(1);
+        for (int i = 0; i < 5; i++) {
+            pushLabels(bytes, label63);
+        }
+
+        bytes.push_back(0);
+        pushQuestionFields(bytes);
+        CHECK(parse(bytes) == DnsError::NameTooLong);
+        CHECK(!viewIndexes(bytes));
+
+        DomainName domain;
+        CHECK(domain.assign(std::string(64, 'x') + ".com") == DnsError::LabelTooLong);
+        CHECK(domain.assign("a..b") == DnsError::EmptyLabel);
+        CHECK(domain.assign(label63 + "." + label63 + "." + label63 + "." + label63) == DnsError::NameTooLong);
+        CHECK(domain.assign(label63 + "." + label63 + "." + label63 + "." + std::string(61, 'x')) == DnsError::None);
+    }
+
+    void testBadRdata() {
+        // A CNAME whose name runs past its data length.
+        auto bytes = header(1, 1);
+        pushName(bytes, "example.com");
+        pushQuestionFields(bytes);
+        pushPointer(bytes, DNS_HEADER_SIZE);
+        pushResourceFields(bytes, Type::CNAME, 3);
+        pushName(bytes, "www");
+        CHECK(parse(bytes) == DnsError::BadRdata);
+
+        // A CNAME with data left over after its name.
+        bytes = header(1, 1);
+        pushName(bytes, "example.com");
+        pushQuestionFields(bytes);
+        pushPointer(bytes, DNS_HEADER_SIZE);
+        pushResourceFields(bytes, Type::CNAME, 6);
+        pushName(bytes, "www");
+        bytes.push_back(0);
+        CHECK(parse(bytes) == DnsError::BadRdata);
+
+        // An MX too short for its preference.
+        bytes = header(1, 1);
+        pushName(bytes, "example.com");
+        pushQuestionFields(bytes);
+        pushPointer(bytes, DNS_HEADER_SIZE);
+        pushResourceFields(bytes, Type::MX, 1);
+        bytes.push_back(0);
+        CHECK(parse(bytes) == DnsError::BadRdata);
+
+        // An SOA missing its counters.
+        bytes = header(1, 1);
+        pushName(bytes, "example.com");
+        pushQuestionFields(bytes);
+        pushPointer(bytes, DNS_HEADER_SIZE);
+        pushResourceFields(bytes, Type::SOA, 8);
+        pushPointer(bytes, DNS_HEADER_SIZE);
+        pushPointer(bytes, DNS_HEADER_SIZE);
+        pushValue(bytes, (uint32_t)1);
+        CHECK(parse(bytes) == DnsError::BadRdata);
+
+        // A CNAME pointing forward, and one pointing at a reserved label type in the header.
+        for (const uint16_t target : { (uint16_t)200, (uint16_t)2 }) {
+            bytes = header(1, 1);
+            pushName(bytes, "example.com");
+            pushQuestionFields(bytes);
+            pushPointer(bytes, DNS_HEADER_SIZE);
+            pushResourceFields(bytes, Type::CNAME, 2);
+            pushPointer(bytes, target);
+            const auto error = parse(bytes);
+            CHECK(error == (target == 2 ? DnsError::BadLabelType : DnsError::BadPointer));
+
+            PacketView view(bytes.data(), bytes.size());
+            Packet packet;
+            CHECK(view.index() == DnsError::None);
+            CHECK(!view.materialize(packet));
+        }
+
+        Resource address;
+        address.rtype = Type::A;
+        AddressRdata addressData;
+        const uint8_t ip[] = { 192, 0, 2, 1 };
+        addressData.address = ip;
+        addressData.length = sizeof(ip);
+        CHECK(encodeRdata(addressData, address) == DnsError::None);
+
+        MxRdata mx;
+        CHECK(decodeRdata(address, mx) == DnsError::TypeMismatch);
+        CHECK(decodeRdata(address, addressData) == DnsError::None);
+
+        address.data.pop_back();
+        CHECK(decodeRdata(address, addressData) == DnsError::BadRdata);
+    }
+
+    Packet questionFor(const char* dotted) {
+        Packet packet;
+        packet.id = 7;
+        packet.isResponse = true;
+        auto& question = packet.questions.emplace_back();
+        question.label.domainName.assign(dotted);
+        return packet;
+    }
+
+    void testSerializeErrors() {
+        auto packet = questionFor("example.com");
+        auto& answer = packet.answers.emplace_back();
+        answer.label.domainName.assign("example.com");
+        answer.rtype = Type::A;
+        answer.data.assign({ 192, 0, 2, 1 });
+        answer.length = 3;
+
+        std::vector<uint8_t> bytes;
+        CHECK(serializeDnsPacket(packet, bytes) == DnsError::DataLengthMismatch);
+
+        answer.length = 4;
+        uint8_t buffer[512];
+        size_t length = 0;
+        CHECK(serializeDnsPacket(packet, buffer, 8, length) == DnsError::BufferTooSmall);
+        CHECK(serializeDnsPacket(packet, buffer, sizeof(buffer), length) == DnsError::None);
+    }
+
+    void testTruncatedFallback() {
+        auto packet = questionFor("example.com");
+        for (int i = 0; i < 40; i++) {
+            auto& answer = packet.answers.emplace_back();
+            answer.label.domainName.assign("example.com");
+            answer.rtype = Type::TXT;
+            TxtRdata text;
+            const std::string line = "record number " + std::to_string(i);
+            text.strings.push_back(line);
+            CHECK(encodeRdata(text, answer) == DnsError::None);
+        }
+
+        Edns edns;
+        edns.udpPayloadSize = 1232;
+        CHECK(encodeEdns(edns, packet.additionalRecords.emplace_back()) == DnsError::None);
+
+        uint8_t buffer[512];
+        size_t length = 0;
+        CHECK(serializeDnsPacket(packet, buffer, sizeof(buffer), length) == DnsError::None);
+
+        PacketView view(buffer, length);
+        CHECK(view.index() == DnsError::None);
+        CHECK(view.isTruncated());
+        CHECK(view.questionCount() == 1);
+        CHECK(view.answerCount() == 0);
+        CHECK(view.additionalRecordCount() == 1);
+
+        Edns found;
+        bool present = false;
+        CHECK(findEdns(view, found, present) == DnsError::None);
+        CHECK(present && found.udpPayloadSize == 1232);
+
+        // The whole message fits a larger buffer untouched.
+        std::vector<uint8_t> large(4096);
+        CHECK(serializeDnsPacket(packet, large.data(), large.size(), length) == DnsError::None);
+        PacketView full(large.data(), length);
+        CHECK(full.index() == DnsError::None);
+        CHECK(!full.isTruncated() && full.answerCount() == 40);
+    }
+
+    void testBadOpt() {
+        Resource opt;
+        CHECK(encodeEdns(Edns(), opt) == DnsError::None);
+
+        auto packet = questionFor("example.com");
+        packet.additionalRecords.push_back(opt);
+        packet.additionalRecords.push_back(opt);
+
+        std::vector<uint8_t> bytes;
+        CHECK(serializeDnsPacket(packet, bytes) == DnsError::None);
+
+        Edns edns;
+        bool present = false;
+        PacketView twice(bytes.data(), bytes.size());
+        CHECK(findEdns(twice, edns, present) == DnsError::BadOpt);
+
+        packet.additionalRecords.clear();
+        packet.answers.push_back(opt);
+        CHECK(serializeDnsPacket(packet, bytes) == DnsError::None);
+        PacketView misplaced(bytes.data(), bytes.size());
+        CHECK(findEdns(misplaced, edns, present) == DnsError::BadOpt);
+    }
+
+    // Serializes a response holding resource, checks that its names were compressed when the
+    // type allows it, and that both readers give back the original data.
+    void roundTrip(const Resource& resource) {
+        auto packet = questionFor("www.example.com");
+        packet.answers.push_back(resource);
+
+        std::vector<uint8_t> bytes;
+        CHECK(serializeDnsPacket(packet, bytes) == DnsError::None);
+
+        PacketView view(bytes.data(), bytes.size());
+        CHECK(view.index() == DnsError::None);
+        const auto written = view.answers().begin()->data.length;
+
+        RdataLayout layout;
+        CHECK(rdataLayout(resource.rtype, layout));
+        if (layout.compressible) {
+            CHECK(written < resource.data.size());
+        } else {
+            CHECK(written == resource.data.size());
+        }
+
+        Packet parsed;
+        CHECK(parseDnsPacket(bytes, parsed) == DnsError::None);
+        CHECK(parsed.answers.size() == 1);
+        if (parsed.answers.size() == 1) {
+            const auto& answer = parsed.answers[0];
+            CHECK(answer.rtype == resource.rtype);
+            CHECK(answer.length == resource.data.size());
+            CHECK(answer.data == resource.data);
+
+            CHECK(!answer.label.isPointer);
+            CHECK(answer.label.domainName == name("www.example.com"));
+        }
+
+        Packet materialized;
+        CHECK(view.materialize(materialized));
+        CHECK(materialized.answers.size() == 1);
+        if (materialized.answers.size() == 1) {
+            CHECK(materialized.answers[0].data == resource.data);
+            CHECK(materialized.answers[0].label.domainName == name("www.example.com"));
+        }
+    }
+
+    Resource record(Type type) {
+        Resource resource;
+        resource.label.domainName.assign("www.example.com");
+        resource.rtype = type;
+        resource.ttl = 300;
+        return resource;
+    }
+
+    void testRoundTrips() {
+        for (const auto type : { Type::NS, Type::CNAME, Type::PTR }) {
+            auto resource = record(type);
+            NameRdata rdata;
+            rdata.name.assign("host.example.com");
+            CHECK(encodeRdata(rdata, resource) == DnsError::None);
+            roundTrip(resource);
+        }
+
+        auto mx = record(Type::MX);
+        MxRdata mxData;
+        mxData.preference = 10;
+        mxData.exchange.assign("mail.example.com");
+        CHECK(encodeRdata(mxData, mx) == DnsError::None);
+        roundTrip(mx);
+
+        auto srv = record(Type::SRV);
+        SrvRdata srvData;
+        srvData.priority = 1;
+        srvData.weight = 2;
+        srvData.port = 5060;
+        srvData.target.assign("sip.example.com");
+        CHECK(encodeRdata(srvData, srv) == DnsError::None);
+        roundTrip(srv);
+
+        auto soa = record(Type::SOA);
+        SoaRdata soaData;
+        soaData.primaryServer.assign("ns1.example.com");
+        soaData.responsibleMailbox.assign("hostmaster.example.com");
+        soaData.serial = 2024010101;
+        soaData.refresh = 7200;
+        soaData.retry = 900;
+        soaData.expire = 1209600;
+        soaData.minimum = 300;
+        CHECK(encodeRdata(soaData, soa) == DnsError::None);
+        roundTrip(soa);
+
+        SoaRdata decoded;
+        CHECK(decodeRdata(soa, decoded) == DnsError::None);
+        CHECK(decoded.responsibleMailbox == soaData.responsibleMailbox && decoded.minimum == 300);
+    }
+}
+
+int main() {
+    testTruncation();
+    testReservedLabelTypes();
+    testBadPointers();
+    testPointerHops();
+    testNameLimits();
+    testBadRdata();
+    testSerializeErrors();
+    testTruncatedFallback();
+    testBadOpt();
+    testRoundTrips();
+
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("all checks passed\n");
+    return 0;
+}